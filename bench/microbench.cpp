@@ -0,0 +1,771 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "camera.h"
+#include "cpu_topology.h"
+#include "grid.h"
+#include "hittable.h"
+#include "material.h"
+#include "moving_sphere.h"
+#include "ray.h"
+#include "ray_query.h"
+#include "renderer.h"
+#include "scene.h"
+#include "sphere.h"
+#include "thread_pool.h"
+#include "vec3.h"
+
+#include "perf_counters.h"
+
+// Microbenchmarks of the intersection and sampling kernels
+// Every dataset is generated from a fixed seed so that two runs, or two builds, time exactly the same work
+// Usage : microbench [--min-time <seconds>] [--check] [name filter]
+// The vec3 backend is checked against the scalar formulas before anything is timed, the program fails when they
+// disagree. --check stops there, it is what the vec3_backend tests run.
+
+namespace
+{
+
+// Keeps the compiler from discarding the kernels' results
+volatile double sink = 0.0;
+
+// Fixed seed generator for the datasets, independent from the renderer's per thread streams
+class dataset_random
+{
+public:
+    dataset_random(uint64_t s) : state(s) {}
+
+    double next_double()
+    {
+        return static_cast<double>(splitmix64(state) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    double next_double(double min, double max)
+    {
+        return min + (max - min) * next_double();
+    }
+
+    vec3 next_vec3(double min, double max)
+    {
+        auto x = next_double(min, max);
+        auto y = next_double(min, max);
+        auto z = next_double(min, max);
+        return vec3(x, y, z);
+    }
+
+private:
+    uint64_t state;
+};
+
+struct bench_result
+{
+    std::string name;
+    double ns_per_op;
+    double mops_per_second;
+    perf_counters::values counters;
+    uint64_t ops;
+};
+
+// Runs kernel (one pass over its dataset, ops_per_run operations) until min_seconds are spent
+// One untimed pass warms the caches and the branch predictors first
+bench_result run_benchmark(
+    const std::string& name, uint64_t ops_per_run, const std::function<double()>& kernel, double min_seconds, perf_counters& counters)
+{
+    using bench_clock = std::chrono::steady_clock;
+
+    sink = sink + kernel();
+
+    uint64_t runs = 0;
+    double result = 0.0;
+    auto start = bench_clock::now();
+    auto min_duration = std::chrono::duration<double>(min_seconds);
+
+    counters.start();
+    do
+    {
+        result += kernel();
+        ++runs;
+    } while (bench_clock::now() - start < min_duration);
+    auto values = counters.stop();
+    auto seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    sink = sink + result;
+
+    auto ops = runs * ops_per_run;
+    return bench_result{name, seconds * 1e9 / static_cast<double>(ops), static_cast<double>(ops) / seconds / 1e6, values, ops};
+}
+
+// The vec3 operations against the formulas written out on doubles, which is what the scalar backend computes
+// The SIMD backend sums in another order, the results may differ in the last bits but no more
+bool check_vec3_backend(dataset_random& rng)
+{
+    double max_error = 0.0;
+    auto compare = [&](const vec3& actual, double x, double y, double z)
+    {
+        auto scale = std::max({1.0, std::fabs(x), std::fabs(y), std::fabs(z)});
+        max_error = std::max({max_error, std::fabs(actual.x() - x) / scale, std::fabs(actual.y() - y) / scale, std::fabs(actual.z() - z) / scale});
+    };
+    auto compare_scalar = [&](double actual, double expected)
+    {
+        max_error = std::max(max_error, std::fabs(actual - expected) / std::max(1.0, std::fabs(expected)));
+    };
+
+    for (int idx = 0; idx < 4096; ++idx)
+    {
+        auto u = rng.next_vec3(-10.0, 10.0);
+        auto v = rng.next_vec3(-10.0, 10.0);
+        auto t = rng.next_double(-4.0, 4.0);
+        double a[3] = {u.x(), u.y(), u.z()};
+        double b[3] = {v.x(), v.y(), v.z()};
+
+        compare(u + v, a[0] + b[0], a[1] + b[1], a[2] + b[2]);
+        compare(u - v, a[0] - b[0], a[1] - b[1], a[2] - b[2]);
+        compare(u * v, a[0] * b[0], a[1] * b[1], a[2] * b[2]);
+        compare(t * u, t * a[0], t * a[1], t * a[2]);
+        compare(-u, -a[0], -a[1], -a[2]);
+        compare(vec3(u[0], u[1], u[2]), a[0], a[1], a[2]);
+
+        auto sum = u;
+        sum += v;
+        compare(sum, a[0] + b[0], a[1] + b[1], a[2] + b[2]);
+        auto scaled = u;
+        scaled *= t;
+        compare(scaled, t * a[0], t * a[1], t * a[2]);
+
+        auto d = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+        compare_scalar(dot(u, v), d);
+        compare_scalar(u.length_squared(), a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+        compare(cross(u, v), a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]);
+
+        auto length = std::sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+        compare(unit_vector(u), a[0] / length, a[1] / length, a[2] / length);
+
+        // Reflection and refraction of a unit direction about a unit normal
+        auto dir = unit_vector(u);
+        auto n = unit_vector(v);
+        if (dot(dir, n) > 0.0)
+        {
+            n = -n;
+        }
+        auto dn = dir.x() * n.x() + dir.y() * n.y() + dir.z() * n.z();
+        compare(reflect(dir, n), dir.x() - 2 * dn * n.x(), dir.y() - 2 * dn * n.y(), dir.z() - 2 * dn * n.z());
+
+        auto eta = 1.0 / 1.5;
+        double parallel[3] = {eta * (dir.x() - dn * n.x()), eta * (dir.y() - dn * n.y()), eta * (dir.z() - dn * n.z())};
+        auto perp = -std::sqrt(1.0 - (parallel[0] * parallel[0] + parallel[1] * parallel[1] + parallel[2] * parallel[2]));
+        compare(refract(dir, n, eta), parallel[0] + perp * n.x(), parallel[1] + perp * n.y(), parallel[2] + perp * n.z());
+    }
+
+#if defined(RT_SIMD_VEC3)
+    const char* backend = "SIMD (Vec4d)";
+#else
+    const char* backend = "scalar";
+#endif
+    // A few ulps of the inputs, which are at most about 10
+    bool agree = max_error < 1e-13;
+    std::printf("vec3 backend : %s, largest relative difference to the scalar formulas %.3g%s\n", backend, max_error, agree ? "" : ", too large");
+    return agree;
+}
+
+void print_header()
+{
+    std::printf("%-32s %10s %10s %10s %6s %12s %12s %12s\n",
+        "kernel", "ns/op", "Mops/s", "cycles/op", "IPC", "cache ref/op", "cache miss/op", "br miss/op");
+}
+
+void print_result(const bench_result& result)
+{
+    const auto& c = result.counters;
+    auto per_op = [&](int counter, char* buffer, size_t size)
+    {
+        if (c.valid[counter])
+        {
+            std::snprintf(buffer, size, "%.3f%s", static_cast<double>(c.count[counter]) / static_cast<double>(result.ops), c.scaled[counter] ? "*" : "");
+        }
+        else
+        {
+            std::snprintf(buffer, size, "n/a");
+        }
+        return buffer;
+    };
+
+    char cycles[32], ipc[32], refs[32], misses[32], branch_misses[32];
+    if (c.valid[perf_counters::cycles] && c.valid[perf_counters::instructions] && c.count[perf_counters::cycles] > 0)
+    {
+        std::snprintf(ipc, sizeof(ipc), "%.2f",
+            static_cast<double>(c.count[perf_counters::instructions]) / static_cast<double>(c.count[perf_counters::cycles]));
+    }
+    else
+    {
+        std::snprintf(ipc, sizeof(ipc), "n/a");
+    }
+
+    std::printf("%-32s %10.2f %10.2f %10s %6s %12s %12s %12s\n",
+        result.name.c_str(), result.ns_per_op, result.mops_per_second,
+        per_op(perf_counters::cycles, cycles, sizeof(cycles)),
+        ipc,
+        per_op(perf_counters::cache_references, refs, sizeof(refs)),
+        per_op(perf_counters::cache_misses, misses, sizeof(misses)),
+        per_op(perf_counters::branch_misses, branch_misses, sizeof(branch_misses)));
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    double min_seconds = 0.5;
+    bool check_only = false;
+    std::string filter;
+
+    for (int arg_idx = 1; arg_idx < argc; ++arg_idx)
+    {
+        std::string arg = argv[arg_idx];
+        if (arg == "--min-time" && arg_idx + 1 < argc)
+        {
+            min_seconds = std::atof(argv[++arg_idx]);
+        }
+        else if (arg == "--check")
+        {
+            check_only = true;
+        }
+        else if (arg == "--help")
+        {
+            std::printf("Usage : %s [--min-time <seconds>] [--check] [name filter]\n", argv[0]);
+            return EXIT_SUCCESS;
+        }
+        else
+        {
+            filter = arg;
+        }
+    }
+
+    // Its own seed, the datasets stay the same whatever the check draws
+    dataset_random check_rng(0x7ec3);
+    if (!check_vec3_backend(check_rng))
+    {
+        return EXIT_FAILURE;
+    }
+    if (check_only)
+    {
+        return EXIT_SUCCESS;
+    }
+
+    static constexpr const size_t num_rays = 1 << 16;
+    static constexpr const size_t num_samples = 1 << 16;
+
+    dataset_random rng(0x5eed);
+    auto material_ptr = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    // One primitive per ray, each ray aims close enough to its primitive to hit it about half of the time
+    std::vector<ray> rays;
+    std::vector<sphere> spheres;
+    std::vector<moving_sphere> moving_spheres;
+    std::vector<aabb> boxes;
+    rays.reserve(num_rays);
+    for (size_t idx = 0; idx < num_rays; ++idx)
+    {
+        auto center = rng.next_vec3(-10.0, 10.0);
+        auto radius = rng.next_double(0.1, 1.0);
+        auto origin = center + unit_vector(rng.next_vec3(-1.0, 1.0)) * rng.next_double(5.0, 20.0);
+        auto target = center + rng.next_vec3(-1.6 * radius, 1.6 * radius);
+        rays.push_back(ray(origin, target - origin, rng.next_double()));
+        spheres.push_back(sphere(center, radius, material_ptr));
+        moving_spheres.push_back(moving_sphere(center, center + vec3(0, rng.next_double(0.0, 0.5), 0), 0.0, 1.0, radius, material_ptr));
+
+        aabb box;
+        spheres.back().bounding_box(0.0, 1.0, box);
+        boxes.push_back(box);
+    }
+
+    // The book's random scene, built from the main thread's fixed random streams, and its camera
+    auto scn = random_scene();
+    auto world = bvh_node(scn.world, scn.time0, scn.time1);
+    camera cam(scn.lookfrom, scn.lookat, scn.vup, scn.vfov, 16.0 / 9.0, scn.aperture, scn.dist_to_focus, scn.time0, scn.time1);
+
+    std::vector<double> uniforms(num_samples * 5);
+    for (auto& u : uniforms)
+    {
+        u = rng.next_double();
+    }
+
+    // The same bsdf numbers as a bounce of the wavefront renderer would hold them
+    std::vector<bounce_sample> bsdf_batch(num_samples);
+    for (size_t idx = 0; idx < num_samples; ++idx)
+    {
+        bsdf_batch[idx].bsdf.u = vec3(uniforms[idx * 5], uniforms[idx * 5 + 1], uniforms[idx * 5 + 2]);
+    }
+
+    // Camera rays in scanline order are coherent, bounce rays start on the ground and go anywhere upwards
+    std::vector<ray> camera_rays;
+    std::vector<ray> bounce_rays;
+    for (size_t idx = 0; idx < num_rays; ++idx)
+    {
+        auto s = static_cast<double>(idx % 256) / 255.0;
+        auto t = static_cast<double>(idx / 256) / 255.0;
+        camera_rays.push_back(cam.get_ray(s, t, 0.5, 0.5, rng.next_double()));
+
+        auto origin = point3(rng.next_double(-11.0, 11.0), 0.0, rng.next_double(-11.0, 11.0));
+        auto direction = sample_cosine_hemisphere(rng.next_double(), rng.next_double());
+        bounce_rays.push_back(ray(origin, vec3(direction.x(), direction.z(), direction.y()), rng.next_double()));
+    }
+
+    // The bounce rays again through the batched queries, as arrays, spread over a pool of every hardware thread
+    auto topology = cpu_topology::detect();
+    thread_pool pool(topology, 0, true, true);
+    ray_query query(pool, std::make_shared<prepared_scene>(scn));
+
+    // The random scene again in both grids, and a particle cloud, dense clumps of small spheres in a sparse haze,
+    // through every accelerator with rays starting inside the cloud
+    auto uniform_grid = grid_accelerator(scn.world, scn.time0, scn.time1, grid_kind::uniform, pool);
+    auto two_level_grid = grid_accelerator(scn.world, scn.time0, scn.time1, grid_kind::two_level, pool);
+
+    static constexpr const size_t num_particles = 1 << 16;
+    hittable_list particles;
+    std::vector<point3> clumps;
+    for (int clump = 0; clump < 32; ++clump)
+    {
+        clumps.push_back(rng.next_vec3(-40.0, 40.0));
+    }
+    for (size_t idx = 0; idx < num_particles; ++idx)
+    {
+        // A quarter spread over the whole volume, the rest around the clumps
+        auto center = idx % 4 == 0
+            ? rng.next_vec3(-50.0, 50.0)
+            : clumps[idx % clumps.size()] + (rng.next_vec3(-3.0, 3.0) + rng.next_vec3(-3.0, 3.0));
+        particles.add(std::make_shared<sphere>(center, rng.next_double(0.05, 0.15), material_ptr));
+    }
+    std::vector<ray> particle_rays;
+    for (size_t idx = 0; idx < num_rays; ++idx)
+    {
+        auto origin = idx % 2 == 0 ? clumps[idx % clumps.size()] + rng.next_vec3(-3.0, 3.0) : rng.next_vec3(-50.0, 50.0);
+        particle_rays.push_back(ray(origin, unit_vector(rng.next_vec3(-1.0, 1.0)), 0.0));
+    }
+    auto particle_list = particles;
+    auto particle_bvh = bvh_node(particle_list, 0.0, 1.0);
+    auto particle_uniform_grid = grid_accelerator(particles, 0.0, 1.0, grid_kind::uniform, pool);
+    auto particle_two_level_grid = grid_accelerator(particles, 0.0, 1.0, grid_kind::two_level, pool);
+    std::printf("Particle grids : uniform %zu cells %.0f KiB, two level %zu cells in %zu sub grids %.0f KiB\n",
+        particle_uniform_grid.num_cells(), static_cast<double>(particle_uniform_grid.memory_bytes()) / 1024.0, particle_two_level_grid.num_cells(),
+        particle_two_level_grid.num_sub_grids(), static_cast<double>(particle_two_level_grid.memory_bytes()) / 1024.0);
+
+    std::vector<double> batch_values(num_rays * 6);
+    for (size_t idx = 0; idx < num_rays; ++idx)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            auto slot = static_cast<size_t>(axis) * num_rays + idx;
+            batch_values[slot] = bounce_rays[idx].origin()[axis];
+            batch_values[3 * num_rays + slot] = bounce_rays[idx].direction()[axis];
+        }
+    }
+    std::vector<double> batch_t_min(num_rays, 0.001);
+    ray_batch batch;
+    batch.count = num_rays;
+    batch.origin_x = &batch_values[0];
+    batch.origin_y = &batch_values[num_rays];
+    batch.origin_z = &batch_values[2 * num_rays];
+    batch.direction_x = &batch_values[3 * num_rays];
+    batch.direction_y = &batch_values[4 * num_rays];
+    batch.direction_z = &batch_values[5 * num_rays];
+    batch.t_min = batch_t_min.data();
+
+    std::vector<double> batch_t(num_rays);
+    std::vector<uint32_t> batch_primitives(num_rays);
+    std::vector<uint8_t> batch_blocked(num_rays);
+    hit_batch batch_hits;
+    batch_hits.t = batch_t.data();
+    batch_hits.primitive = batch_primitives.data();
+
+    struct benchmark
+    {
+        std::string name;
+        uint64_t ops;
+        std::function<double()> kernel;
+    };
+
+    std::vector<benchmark> benchmarks = {
+        {"sphere::hit", num_rays, [&]()
+        {
+            hit_record rec;
+            double hits = 0.0;
+            for (size_t idx = 0; idx < num_rays; ++idx)
+            {
+                hits += spheres[idx].hit(rays[idx], 0.001, infinity, rec) ? rec.t : 0.0;
+            }
+            return hits;
+        }},
+        {"sphere::occluded", num_rays, [&]()
+        {
+            double hits = 0.0;
+            for (size_t idx = 0; idx < num_rays; ++idx)
+            {
+                hits += spheres[idx].occluded(rays[idx], 0.001, infinity) ? 1.0 : 0.0;
+            }
+            return hits;
+        }},
+        {"moving_sphere::hit", num_rays, [&]()
+        {
+            hit_record rec;
+            double hits = 0.0;
+            for (size_t idx = 0; idx < num_rays; ++idx)
+            {
+                hits += moving_spheres[idx].hit(rays[idx], 0.001, infinity, rec) ? rec.t : 0.0;
+            }
+            return hits;
+        }},
+        {"aabb::hit", num_rays, [&]()
+        {
+            double hits = 0.0;
+            for (size_t idx = 0; idx < num_rays; ++idx)
+            {
+                hits += boxes[idx].hit(rays[idx], 0.001, infinity) ? 1.0 : 0.0;
+            }
+            return hits;
+        }},
+        {"bvh_node::hit camera", num_rays, [&]()
+        {
+            hit_record rec;
+            double hits = 0.0;
+            for (const auto& r : camera_rays)
+            {
+                hits += world.hit(r, 0.001, infinity, rec) ? rec.t : 0.0;
+            }
+            return hits;
+        }},
+        {"bvh_node::hit bounce", num_rays, [&]()
+        {
+            hit_record rec;
+            double hits = 0.0;
+            for (const auto& r : bounce_rays)
+            {
+                hits += world.hit(r, 0.001, infinity, rec) ? rec.t : 0.0;
+            }
+            return hits;
+        }},
+        {"bvh_node::intersect bounce", num_rays, [&]()
+        {
+            surface_hit closest;
+            double hits = 0.0;
+            for (const auto& r : bounce_rays)
+            {
+                hits += world.intersect(r, 0.001, infinity, closest) ? closest.t : 0.0;
+            }
+            return hits;
+        }},
+        {"bvh_node::occluded bounce", num_rays, [&]()
+        {
+            double hits = 0.0;
+            for (const auto& r : bounce_rays)
+            {
+                hits += world.occluded(r, 0.001, infinity) ? 1.0 : 0.0;
+            }
+            return hits;
+        }},
+        {"grid uniform::intersect camera", num_rays, [&]()
+        {
+            surface_hit closest;
+            double hits = 0.0;
+            for (const auto& r : camera_rays)
+            {
+                hits += uniform_grid.intersect(r, 0.001, infinity, closest) ? closest.t : 0.0;
+            }
+            return hits;
+        }},
+        {"grid uniform::intersect bounce", num_rays, [&]()
+        {
+            surface_hit closest;
+            double hits = 0.0;
+            for (const auto& r : bounce_rays)
+            {
+                hits += uniform_grid.intersect(r, 0.001, infinity, closest) ? closest.t : 0.0;
+            }
+            return hits;
+        }},
+        {"grid uniform::occluded bounce", num_rays, [&]()
+        {
+            double hits = 0.0;
+            for (const auto& r : bounce_rays)
+            {
+                hits += uniform_grid.occluded(r, 0.001, infinity) ? 1.0 : 0.0;
+            }
+            return hits;
+        }},
+        {"grid two-level::intersect camera", num_rays, [&]()
+        {
+            surface_hit closest;
+            double hits = 0.0;
+            for (const auto& r : camera_rays)
+            {
+                hits += two_level_grid.intersect(r, 0.001, infinity, closest) ? closest.t : 0.0;
+            }
+            return hits;
+        }},
+        {"grid two-level::intersect bounce", num_rays, [&]()
+        {
+            surface_hit closest;
+            double hits = 0.0;
+            for (const auto& r : bounce_rays)
+            {
+                hits += two_level_grid.intersect(r, 0.001, infinity, closest) ? closest.t : 0.0;
+            }
+            return hits;
+        }},
+        {"grid two-level::occluded bounce", num_rays, [&]()
+        {
+            double hits = 0.0;
+            for (const auto& r : bounce_rays)
+            {
+                hits += two_level_grid.occluded(r, 0.001, infinity) ? 1.0 : 0.0;
+            }
+            return hits;
+        }},
+        {"bvh_node::intersect particles", num_rays, [&]()
+        {
+            surface_hit closest;
+            double hits = 0.0;
+            for (const auto& r : particle_rays)
+            {
+                hits += particle_bvh.intersect(r, 0.001, infinity, closest) ? closest.t : 0.0;
+            }
+            return hits;
+        }},
+        {"grid uniform::intersect particles", num_rays, [&]()
+        {
+            surface_hit closest;
+            double hits = 0.0;
+            for (const auto& r : particle_rays)
+            {
+                hits += particle_uniform_grid.intersect(r, 0.001, infinity, closest) ? closest.t : 0.0;
+            }
+            return hits;
+        }},
+        {"grid two-level::intersect particles", num_rays, [&]()
+        {
+            surface_hit closest;
+            double hits = 0.0;
+            for (const auto& r : particle_rays)
+            {
+                hits += particle_two_level_grid.intersect(r, 0.001, infinity, closest) ? closest.t : 0.0;
+            }
+            return hits;
+        }},
+        {"bvh_node::occluded particles", num_rays, [&]()
+        {
+            double hits = 0.0;
+            for (const auto& r : particle_rays)
+            {
+                hits += particle_bvh.occluded(r, 0.001, infinity) ? 1.0 : 0.0;
+            }
+            return hits;
+        }},
+        {"grid uniform::occluded particles", num_rays, [&]()
+        {
+            double hits = 0.0;
+            for (const auto& r : particle_rays)
+            {
+                hits += particle_uniform_grid.occluded(r, 0.001, infinity) ? 1.0 : 0.0;
+            }
+            return hits;
+        }},
+        {"grid two-level::occluded particles", num_rays, [&]()
+        {
+            double hits = 0.0;
+            for (const auto& r : particle_rays)
+            {
+                hits += particle_two_level_grid.occluded(r, 0.001, infinity) ? 1.0 : 0.0;
+            }
+            return hits;
+        }},
+        {"bvh_node build particles", num_particles, [&]()
+        {
+            auto list = particles;
+            auto tree = bvh_node(list, 0.0, 1.0);
+            return tree.box.max().x();
+        }},
+        {"grid uniform build particles", num_particles, [&]()
+        {
+            auto built = grid_accelerator(particles, 0.0, 1.0, grid_kind::uniform, pool);
+            return static_cast<double>(built.num_cells());
+        }},
+        {"grid two-level build particles", num_particles, [&]()
+        {
+            auto built = grid_accelerator(particles, 0.0, 1.0, grid_kind::two_level, pool);
+            return static_cast<double>(built.num_cells());
+        }},
+        {"ray_query::intersect bounce", num_rays, [&]()
+        {
+            query.intersect(batch, batch_hits);
+            double hits = 0.0;
+            for (size_t idx = 0; idx < num_rays; idx += 64)
+            {
+                hits += batch_primitives[idx] != ray_query::no_primitive ? batch_t[idx] : 0.0;
+            }
+            return hits;
+        }},
+        {"ray_query::occluded bounce", num_rays, [&]()
+        {
+            query.occluded(batch, batch_blocked.data());
+            double hits = 0.0;
+            for (size_t idx = 0; idx < num_rays; idx += 64)
+            {
+                hits += batch_blocked[idx];
+            }
+            return hits;
+        }},
+        {"camera::get_ray", num_samples, [&]()
+        {
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                const auto* u = &uniforms[idx * 5];
+                sum += cam.get_ray(u[0], u[1], u[2], u[3], u[4]).direction().x();
+            }
+            return sum;
+        }},
+        {"vec3 shading frame", num_rays, [&]()
+        {
+            // The usual shading math, a normal, a frame around it and the mirror and refracted directions
+            double sum = 0.0;
+            for (const auto& r : bounce_rays)
+            {
+                auto n = unit_vector(r.origin() - point3(0, -1000, 0));
+                auto tangent = unit_vector(cross(std::fabs(n.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0), n));
+                auto bitangent = cross(n, tangent);
+                auto dir = unit_vector(r.direction());
+                sum += dot(reflect(dir, n), tangent) + dot(refract(dir, n, 1.0 / 1.5), bitangent);
+            }
+            return sum;
+        }},
+        {"random_in_unit_sphere", num_samples, [&]()
+        {
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                sum += random_in_unit_sphere().x();
+            }
+            return sum;
+        }},
+        {"random_unit_vector", num_samples, [&]()
+        {
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                sum += random_unit_vector().x();
+            }
+            return sum;
+        }},
+        {"random_in_unit_disk", num_samples, [&]()
+        {
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                sum += random_in_unit_disk().x();
+            }
+            return sum;
+        }},
+        {"sample_unit_sphere_surface", num_samples, [&]()
+        {
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                sum += sample_unit_sphere_surface(uniforms[idx * 5], uniforms[idx * 5 + 1]).x();
+            }
+            return sum;
+        }},
+        {"sample_in_unit_sphere", num_samples, [&]()
+        {
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                sum += sample_in_unit_sphere(uniforms[idx * 5], uniforms[idx * 5 + 1], uniforms[idx * 5 + 2]).x();
+            }
+            return sum;
+        }},
+        {"sample_in_unit_disk", num_samples, [&]()
+        {
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                sum += sample_in_unit_disk(uniforms[idx * 5], uniforms[idx * 5 + 1]).x();
+            }
+            return sum;
+        }},
+        {"sample_cosine_hemisphere", num_samples, [&]()
+        {
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                sum += sample_cosine_hemisphere(uniforms[idx * 5], uniforms[idx * 5 + 1]).x();
+            }
+            return sum;
+        }},
+        {"bsdf_sample scalar warps", num_samples, [&]()
+        {
+            // What a material pays per bounce without the batch, both of the warps it may ask for
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                const auto& bsdf = bsdf_batch[idx].bsdf;
+                sum += sample_unit_sphere_surface(bsdf.u.x(), bsdf.u.y()).x() + sample_in_unit_sphere(bsdf.u.x(), bsdf.u.y(), bsdf.u.z()).x();
+            }
+            return sum;
+        }},
+        {"warp_bsdf_samples", num_samples, [&]()
+        {
+            warp_bsdf_samples(bsdf_batch);
+            double sum = 0.0;
+            for (size_t idx = 0; idx < num_samples; ++idx)
+            {
+                sum += bsdf_batch[idx].bsdf.on_sphere.x() + bsdf_batch[idx].bsdf.in_sphere.x();
+            }
+            return sum;
+        }},
+        {"warp_cosine_hemisphere x4", num_samples, [&]()
+        {
+            Vec4d sum(0.0);
+            for (size_t idx = 0; idx + 4 <= num_samples; idx += 4)
+            {
+                Vec4d x, y, z;
+                warp_cosine_hemisphere(Vec4d().load(&uniforms[idx * 5]), Vec4d().load(&uniforms[idx * 5 + 4]), x, y, z);
+                sum += x;
+            }
+            return horizontal_add(sum);
+        }},
+    };
+
+    perf_counters counters;
+    if (!counters.available())
+    {
+        std::printf("Hardware counters unavailable, only timings are reported\n");
+    }
+    else
+    {
+        std::printf("Counts marked * were multiplexed by the PMU and are extrapolated, ratios within a group stay exact\n");
+    }
+
+    print_header();
+    for (const auto& bench : benchmarks)
+    {
+        if (!filter.empty() && bench.name.find(filter) == std::string::npos)
+        {
+            continue;
+        }
+        print_result(run_benchmark(bench.name, bench.ops, bench.kernel, min_seconds, counters));
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters of the calling thread, read with perf_event_open on Linux
+// Kernels with perf disabled (perf_event_paranoid, containers without the capability...) and other platforms
+// simply report the counters as unavailable, the timings are still valid
+class perf_counters
+{
+public:
+    enum counter
+    {
+        cycles,
+        instructions,
+        cache_references,
+        cache_misses,
+        branch_misses,
+        num_counters
+    };
+
+    struct values
+    {
+        uint64_t count[num_counters] = {};
+        bool valid[num_counters] = {};
+        // Multiplexed with other counters, count is extrapolated from the part of the interval it ran for
+        bool scaled[num_counters] = {};
+    };
+
+    perf_counters();
+    ~perf_counters();
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    bool available() const { return num_open > 0; }
+
+    void start();
+    values stop();
+
+private:
+    int fds[num_counters];
+    // Opened as the leader of its group, only leaders get reset, enabled and disabled
+    bool leads[num_counters] = {};
+    int num_open = 0;
+};
+
+#if defined(__linux__)
+
+inline perf_counters::perf_counters()
+{
+    static constexpr const uint64_t configs[num_counters] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_REFERENCES,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    // The counters whose ratio gets printed share a group, the PMU only schedules a group as a whole so cycles and
+    // instructions, cache references and misses, always cover the same intervals. Groups are kept small rather
+    // than one for all, a PMU short of registers then only loses the ones it cannot schedule instead of the set
+    static constexpr const int leader_of[num_counters] = {cycles, cycles, cache_references, cache_references, branch_misses};
+
+    for (int idx = 0; idx < num_counters; ++idx)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[idx];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // When counters outnumber the registers the PMU multiplexes them, these times let stop() scale the counts
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // A member whose leader failed to open counts on its own
+        auto leader = leader_of[idx];
+        leads[idx] = leader == idx || fds[leader] < 0;
+        // Members follow their leader, which starts disabled
+        attr.disabled = leads[idx] ? 1 : 0;
+
+        fds[idx] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leads[idx] ? -1 : fds[leader], 0));
+        if (fds[idx] >= 0)
+        {
+            ++num_open;
+        }
+    }
+}
+
+inline perf_counters::~perf_counters()
+{
+    // Members before their leaders
+    for (int idx = num_counters - 1; idx >= 0; --idx)
+    {
+        if (fds[idx] >= 0)
+        {
+            close(fds[idx]);
+        }
+    }
+}
+
+inline void perf_counters::start()
+{
+    for (int idx = 0; idx < num_counters; ++idx)
+    {
+        if (leads[idx] && fds[idx] >= 0)
+        {
+            ioctl(fds[idx], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds[idx], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+}
+
+inline perf_counters::values perf_counters::stop()
+{
+    values result;
+    for (int idx = 0; idx < num_counters; ++idx)
+    {
+        if (leads[idx] && fds[idx] >= 0)
+        {
+            ioctl(fds[idx], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+    for (int idx = 0; idx < num_counters; ++idx)
+    {
+        // Layout given by read_format
+        struct
+        {
+            uint64_t value;
+            uint64_t time_enabled;
+            uint64_t time_running;
+        } reading = {};
+        if (fds[idx] < 0 || read(fds[idx], &reading, sizeof(reading)) != static_cast<ssize_t>(sizeof(reading)) || reading.time_running == 0)
+        {
+            continue;
+        }
+
+        // Extrapolated to the whole interval when the counter only ran for part of it
+        result.count[idx] = reading.value;
+        if (reading.time_running < reading.time_enabled)
+        {
+            auto scale = static_cast<double>(reading.time_enabled) / static_cast<double>(reading.time_running);
+            result.count[idx] = static_cast<uint64_t>(static_cast<double>(reading.value) * scale + 0.5);
+            result.scaled[idx] = true;
+        }
+        result.valid[idx] = true;
+    }
+    return result;
+}
+
+#else
+
+inline perf_counters::perf_counters()
+{
+    for (auto& fd : fds)
+    {
+        fd = -1;
+    }
+}
+
+inline perf_counters::~perf_counters() {}
+
+inline void perf_counters::start() {}
+
+inline perf_counters::values perf_counters::stop()
+{
+    return values();
+}
+
+#endif
@@ -53,7 +53,7 @@ public:
     point3 _max;
 };
 
-aabb surrounding_box(aabb box0, aabb box1)
+inline aabb surrounding_box(aabb box0, aabb box1)
 {
     point3 small(std::fmin(box0.min().x(), box1.min().x()),
                  std::fmin(box0.min().y(), box1.min().y()),
@@ -65,3 +65,22 @@ aabb surrounding_box(aabb box0, aabb box1)
 
     return aabb(small, big);
 }
+
+inline double surface_area(const aabb& box)
+{
+    auto extent = box.max() - box.min();
+    return 2.0 * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+}
+
+// Empty boxes have a 0 area
+inline double intersection_area(const aabb& box0, const aabb& box1)
+{
+    auto dx = std::fmin(box0.max().x(), box1.max().x()) - std::fmax(box0.min().x(), box1.min().x());
+    auto dy = std::fmin(box0.max().y(), box1.max().y()) - std::fmax(box0.min().y(), box1.min().y());
+    auto dz = std::fmin(box0.max().z(), box1.max().z()) - std::fmax(box0.min().z(), box1.min().z());
+    if (dx <= 0 || dy <= 0 || dz <= 0)
+    {
+        return 0.0;
+    }
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "aabb.h"
+#include "hittable_list.h"
+#include "renderer.h"
+#include "vec3.h"
+
+// Averaged views of a render kept between runs, the base of the next render when that one only updates a region
+// The bounds of the objects the render saw are kept along, the next render compares them to its own to find the
+// objects that moved, appeared or went away, the pixels where they used to be need rendering again too
+// Layout : the magic, then width, height, number of views and whether the AOVs are there as int32, the number of
+// objects as int32 and their boxes as six doubles (min then max, infinite for objects without bounds) in the order
+// of the scene's list, then for every view the image, albedo and normal, three doubles per pixel, rows top to bottom
+static constexpr const char accumulation_magic[8] = {'R', 'T', 'A', 'C', 'C', '0', '0', '2'};
+
+struct saved_accumulation
+{
+    std::vector<std::shared_ptr<const rendered_view>> views;
+    std::vector<aabb> object_boxes;
+};
+
+// Bounds of the objects in the order of the list, the infinite box for those without any
+inline std::vector<aabb> object_bounds(const hittable_list& world, double time0, double time1)
+{
+    std::vector<aabb> boxes;
+    boxes.reserve(world.objects.size());
+    for (const auto& object : world.objects)
+    {
+        aabb box;
+        if (!object->bounding_box(time0, time1, box))
+        {
+            box = aabb(point3(-infinity, -infinity, -infinity), point3(infinity, infinity, infinity));
+        }
+        boxes.push_back(box);
+    }
+    return boxes;
+}
+
+inline void save_accumulation(const std::string& filename, const render_result& result, const std::vector<aabb>& object_boxes)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Unable to write accumulation file " + filename);
+    }
+
+    bool has_aovs = !result.views.empty() && !result.views[0].albedo.empty();
+    int32_t header[4] = {result.width, result.height, static_cast<int32_t>(result.views.size()), has_aovs ? 1 : 0};
+    file.write(accumulation_magic, sizeof(accumulation_magic));
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    auto num_objects = static_cast<int32_t>(object_boxes.size());
+    file.write(reinterpret_cast<const char*>(&num_objects), sizeof(num_objects));
+    for (const auto& box : object_boxes)
+    {
+        double bounds[6] = {box.min().x(), box.min().y(), box.min().z(), box.max().x(), box.max().y(), box.max().z()};
+        file.write(reinterpret_cast<const char*>(bounds), sizeof(bounds));
+    }
+
+    // Component by component, the layout does not depend on the vec3 backend
+    std::vector<double> values;
+    auto write_buffer = [&](const std::vector<vec3>& buffer)
+    {
+        values.resize(buffer.size() * 3);
+        for (size_t idx = 0; idx < buffer.size(); ++idx)
+        {
+            values[idx * 3] = buffer[idx].x();
+            values[idx * 3 + 1] = buffer[idx].y();
+            values[idx * 3 + 2] = buffer[idx].z();
+        }
+        file.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(double)));
+    };
+
+    for (const auto& view : result.views)
+    {
+        write_buffer(view.image);
+        if (has_aovs)
+        {
+            write_buffer(view.albedo);
+            write_buffer(view.normal);
+        }
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("Unable to write accumulation file " + filename);
+    }
+}
+
+// The views and object bounds saved by save_accumulation, the views have to match the render they are the base of
+inline saved_accumulation load_accumulation(
+    const std::string& filename, int width, int height, int num_views, bool need_aovs)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Unable to open accumulation file " + filename);
+    }
+
+    char magic[sizeof(accumulation_magic)];
+    int32_t header[4];
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!file || !std::equal(magic, magic + sizeof(magic), accumulation_magic))
+    {
+        throw std::runtime_error("Not an accumulation file : " + filename);
+    }
+    if (header[0] != width || header[1] != height || header[2] != num_views || (need_aovs && !header[3]))
+    {
+        throw std::runtime_error("The accumulation file " + filename + " does not match the render, it holds " + std::to_string(header[2])
+                                 + " views of " + std::to_string(header[0]) + "x" + std::to_string(header[1]) + (header[3] ? " with" : " without") + " AOVs");
+    }
+
+    saved_accumulation saved;
+    int32_t num_objects = 0;
+    file.read(reinterpret_cast<char*>(&num_objects), sizeof(num_objects));
+    if (!file || num_objects < 0)
+    {
+        throw std::runtime_error("The accumulation file " + filename + " is corrupt");
+    }
+    for (int32_t object = 0; object < num_objects && file; ++object)
+    {
+        double bounds[6];
+        file.read(reinterpret_cast<char*>(bounds), sizeof(bounds));
+        saved.object_boxes.push_back(aabb(point3(bounds[0], bounds[1], bounds[2]), point3(bounds[3], bounds[4], bounds[5])));
+    }
+
+    auto pixels = static_cast<size_t>(width) * static_cast<size_t>(height);
+    std::vector<double> values(pixels * 3);
+    auto read_buffer = [&](std::vector<vec3>& buffer)
+    {
+        file.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(double)));
+        buffer.resize(pixels);
+        for (size_t idx = 0; idx < pixels; ++idx)
+        {
+            buffer[idx] = vec3(values[idx * 3], values[idx * 3 + 1], values[idx * 3 + 2]);
+        }
+    };
+
+    for (int view = 0; view < num_views; ++view)
+    {
+        auto loaded = std::make_shared<rendered_view>();
+        read_buffer(loaded->image);
+        if (header[3])
+        {
+            read_buffer(loaded->albedo);
+            read_buffer(loaded->normal);
+        }
+        saved.views.push_back(std::move(loaded));
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("The accumulation file " + filename + " is truncated");
+    }
+    return saved;
+}
+
+// Boxes to re-render for the dirty objects, each object where it is now and where the saved render saw it, and every
+// object whose bounds differ from the saved ones, or that only one of the two renders has
+inline std::vector<aabb> changed_boxes(const std::vector<aabb>& saved_boxes, const std::vector<aabb>& current_boxes, const std::vector<int>& dirty_objects)
+{
+    std::vector<aabb> boxes;
+    auto add_object = [&](size_t index)
+    {
+        if (index < saved_boxes.size())
+        {
+            boxes.push_back(saved_boxes[index]);
+        }
+        if (index < current_boxes.size())
+        {
+            boxes.push_back(current_boxes[index]);
+        }
+    };
+
+    for (auto index : dirty_objects)
+    {
+        add_object(static_cast<size_t>(index));
+    }
+
+    auto same_box = [](const aabb& a, const aabb& b)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (a.min()[axis] != b.min()[axis] || a.max()[axis] != b.max()[axis])
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    for (size_t index = 0; index < std::max(saved_boxes.size(), current_boxes.size()); ++index)
+    {
+        if (index >= saved_boxes.size() || index >= current_boxes.size() || !same_box(saved_boxes[index], current_boxes[index]))
+        {
+            add_object(index);
+        }
+    }
+    return boxes;
+}
@@ -23,7 +23,8 @@ public:
         std::vector<std::shared_ptr<hittable>>& objects,
         size_t start, size_t end, double time0, double time1);
 
-    virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+    virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
 public:
@@ -44,22 +45,22 @@ inline bool box_compare(const std::shared_ptr<hittable> a, const std::shared_ptr
 }
 
 
-bool box_x_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
+inline bool box_x_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
 {
     return box_compare(a, b, 0);
 }
 
-bool box_y_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
+inline bool box_y_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
 {
     return box_compare(a, b, 1);
 }
 
-bool box_z_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
+inline bool box_z_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b)
 {
     return box_compare(a, b, 2);
 }
 
-bvh_node::bvh_node(
+inline bvh_node::bvh_node(
     std::vector<std::shared_ptr<hittable>>& objects,
     size_t start, size_t end, double time0, double time1
 )
@@ -107,20 +108,31 @@ bvh_node::bvh_node(
     box = surrounding_box(box_left, box_right);
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool bvh_node::intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const
 {
     if (!box.hit(r, t_min, t_max))
     {
         return false;
     }
 
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    bool hit_left = left->intersect(r, t_min, t_max, closest);
+    bool hit_right = right->intersect(r, t_min, hit_left ? closest.t : t_max, closest);
 
     return hit_left || hit_right;
 }
 
-bool bvh_node::bounding_box(double /*t0*/, double /*t1*/, aabb& output_box) const
+inline bool bvh_node::occluded(const ray& r, double t_min, double t_max) const
+{
+    if (!box.hit(r, t_min, t_max))
+    {
+        return false;
+    }
+
+    // Any child will do, the right one is skipped as soon as the left one is blocked
+    return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+}
+
+inline bool bvh_node::bounding_box(double /*t0*/, double /*t1*/, aabb& output_box) const
 {
     output_box = box;
     return true;
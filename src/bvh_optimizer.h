@@ -0,0 +1,515 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+
+// SAH cost model of bvh_node: a node tests its own box then calls both children, primitives have no box test
+// of their own. A node therefore costs its box test plus one intersection per primitive child, weighted by the
+// probability that a ray reaching the root also reaches the node (ratio of surface areas).
+static constexpr const double sah_box_cost = 1.0;
+static constexpr const double sah_primitive_cost = 1.0;
+
+inline bvh_node* as_bvh_node(const std::shared_ptr<hittable>& object)
+{
+    return dynamic_cast<bvh_node*>(object.get());
+}
+
+struct bvh_stats
+{
+    double sah_cost = 0.0;
+    int num_nodes = 0;
+    int max_depth = 0;
+    double average_leaf_depth = 0.0;
+    // Number of distinct primitives under a node that has primitive children -> number of such nodes
+    std::map<int, int> leaf_sizes;
+    // Sum of the overlap between sibling boxes, relative to the root surface area
+    double overlap = 0.0;
+
+    void print(std::ostream& out, const char* title) const
+    {
+        out << title << " : SAH cost " << sah_cost << ", " << num_nodes << " nodes, depth " << max_depth
+            << " (average leaf depth " << average_leaf_depth << "), sibling overlap " << overlap << ", leaf sizes";
+        for (const auto& entry : leaf_sizes)
+        {
+            out << " [" << entry.first << "]x" << entry.second;
+        }
+        out << std::endl;
+    }
+};
+
+inline aabb object_box(const std::shared_ptr<hittable>& object, double time0, double time1)
+{
+    aabb box;
+    if (!object->bounding_box(time0, time1, box))
+    {
+        std::cerr << "No bounding box in bvh statistics.\n";
+    }
+    return box;
+}
+
+inline bvh_stats compute_bvh_stats(const bvh_node& root, double time0, double time1)
+{
+    bvh_stats stats;
+    auto root_area = surface_area(root.box);
+
+    long long leaf_depth_sum = 0;
+    int num_leaves = 0;
+
+    std::vector<std::pair<const bvh_node*, int>> stack;
+    stack.push_back({&root, 1});
+
+    while (!stack.empty())
+    {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+
+        ++stats.num_nodes;
+        stats.max_depth = std::max(stats.max_depth, depth);
+
+        int primitive_tests = 0;
+        std::unordered_set<const hittable*> primitives;
+        for (const auto* child : {&node->left, &node->right})
+        {
+            if (auto* child_node = as_bvh_node(*child))
+            {
+                stack.push_back({child_node, depth + 1});
+            }
+            else
+            {
+                ++primitive_tests;
+                primitives.insert(child->get());
+            }
+        }
+
+        stats.sah_cost += surface_area(node->box) * (sah_box_cost + sah_primitive_cost * primitive_tests);
+
+        if (!primitives.empty())
+        {
+            ++stats.leaf_sizes[static_cast<int>(primitives.size())];
+            leaf_depth_sum += depth;
+            ++num_leaves;
+        }
+
+        if (node->left != node->right)
+        {
+            stats.overlap += intersection_area(object_box(node->left, time0, time1), object_box(node->right, time0, time1));
+        }
+    }
+
+    if (root_area > 0.0)
+    {
+        stats.sah_cost /= root_area;
+        stats.overlap /= root_area;
+    }
+    stats.average_leaf_depth = num_leaves ? static_cast<double>(leaf_depth_sum) / num_leaves : 0.0;
+
+    return stats;
+}
+
+// Improves a built tree in place, see Kensler 2008, Tree Rotations for Improving Bounding Volume Hierarchies and
+// Bittner et al. 2013, Fast Insertion-Based Optimization of Bounding Volume Hierarchies
+// Every change is evaluated on the exact SAH cost of the nodes it touches and undone when it does not help, so
+// the tree cost never goes up. The root node object stays the root.
+class bvh_optimizer
+{
+public:
+    bvh_optimizer(bvh_node& r, double t0, double t1) : root(r), time0(t0), time1(t1) {}
+
+    // Returns the number of changes kept
+    int optimize(std::chrono::duration<double> budget);
+
+private:
+    aabb child_box(const std::shared_ptr<hittable>& child);
+    double node_cost(const bvh_node* node) const;
+    void refit_upwards(bvh_node* node);
+    void rebuild_parents();
+    std::shared_ptr<hittable>& slot_of(bvh_node* parent, const hittable* child);
+
+    int collapse_single_primitive_nodes();
+    bool try_rotations(bvh_node* node);
+    bool try_reinsert(bvh_node* node);
+
+private:
+    bvh_node& root;
+    double time0;
+    double time1;
+
+    std::unordered_map<const hittable*, aabb> primitive_boxes;
+    std::unordered_map<const bvh_node*, bvh_node*> parents;
+    // Post order, children before parents
+    std::vector<bvh_node*> nodes;
+};
+
+inline aabb bvh_optimizer::child_box(const std::shared_ptr<hittable>& child)
+{
+    if (auto* node = as_bvh_node(child))
+    {
+        return node->box;
+    }
+    auto it = primitive_boxes.find(child.get());
+    if (it == primitive_boxes.end())
+    {
+        it = primitive_boxes.emplace(child.get(), object_box(child, time0, time1)).first;
+    }
+    return it->second;
+}
+
+inline double bvh_optimizer::node_cost(const bvh_node* node) const
+{
+    int primitive_tests = (as_bvh_node(node->left) ? 0 : 1) + (as_bvh_node(node->right) ? 0 : 1);
+    return surface_area(node->box) * (sah_box_cost + sah_primitive_cost * primitive_tests);
+}
+
+inline void bvh_optimizer::refit_upwards(bvh_node* node)
+{
+    while (node)
+    {
+        node->box = surrounding_box(child_box(node->left), child_box(node->right));
+        auto it = parents.find(node);
+        node = it == parents.end() ? nullptr : it->second;
+    }
+}
+
+inline void bvh_optimizer::rebuild_parents()
+{
+    parents.clear();
+    nodes.clear();
+    parents[&root] = nullptr;
+
+    // Reverse pre order with the right child visited first is a valid post order
+    std::vector<bvh_node*> stack{&root};
+    std::vector<bvh_node*> pre_order;
+    while (!stack.empty())
+    {
+        auto* node = stack.back();
+        stack.pop_back();
+        pre_order.push_back(node);
+        for (auto* child : {as_bvh_node(node->left), as_bvh_node(node->right)})
+        {
+            if (child)
+            {
+                parents[child] = node;
+                stack.push_back(child);
+            }
+        }
+    }
+    nodes.assign(pre_order.rbegin(), pre_order.rend());
+}
+
+inline std::shared_ptr<hittable>& bvh_optimizer::slot_of(bvh_node* parent, const hittable* child)
+{
+    return parent->left.get() == child ? parent->left : parent->right;
+}
+
+// The constructor stores a single object twice in its node, which makes every ray intersect it twice
+// The parent can reference the object directly instead
+inline int bvh_optimizer::collapse_single_primitive_nodes()
+{
+    int collapsed = 0;
+    for (auto* node : nodes)
+    {
+        for (auto* child : {&node->left, &node->right})
+        {
+            auto* child_node = as_bvh_node(*child);
+            if (child_node && child_node->left == child_node->right && !as_bvh_node(child_node->left))
+            {
+                *child = child_node->left;
+                ++collapsed;
+            }
+        }
+    }
+    if (collapsed)
+    {
+        rebuild_parents();
+    }
+    return collapsed;
+}
+
+// Swaps a child of node with a grandchild, node's own box does not change so only node and the modified child
+// are evaluated
+inline bool bvh_optimizer::try_rotations(bvh_node* node)
+{
+    bool improved = false;
+
+    for (int side = 0; side < 2; ++side)
+    {
+        auto& inner_slot = side == 0 ? node->left : node->right;
+        auto& other_slot = side == 0 ? node->right : node->left;
+        auto* inner = as_bvh_node(inner_slot);
+        if (!inner || inner->left == inner->right)
+        {
+            continue;
+        }
+
+        for (int grandchild = 0; grandchild < 2; ++grandchild)
+        {
+            auto& grandchild_slot = grandchild == 0 ? inner->left : inner->right;
+
+            auto before = node_cost(node) + node_cost(inner);
+            auto old_box = inner->box;
+
+            std::swap(other_slot, grandchild_slot);
+            inner->box = surrounding_box(child_box(inner->left), child_box(inner->right));
+            auto after = node_cost(node) + node_cost(inner);
+
+            if (after < before * (1.0 - 1e-9))
+            {
+                // Parents changed for the two swapped subtrees
+                if (auto* moved = as_bvh_node(other_slot))
+                {
+                    parents[moved] = node;
+                }
+                if (auto* moved = as_bvh_node(grandchild_slot))
+                {
+                    parents[moved] = inner;
+                }
+                improved = true;
+            }
+            else
+            {
+                std::swap(other_slot, grandchild_slot);
+                inner->box = old_box;
+            }
+        }
+    }
+
+    return improved;
+}
+
+// Removes node with its parent, then inserts it again next to the subtree where it adds the least surface area
+inline bool bvh_optimizer::try_reinsert(bvh_node* node)
+{
+    auto* parent = parents[node];
+    if (!parent || parent == &root)
+    {
+        return false;
+    }
+    auto* grand_parent = parents[parent];
+
+    auto ancestors = [&](bvh_node* start)
+    {
+        std::vector<bvh_node*> chain;
+        for (auto* n = start; n; n = parents[n])
+        {
+            chain.push_back(n);
+        }
+        return chain;
+    };
+
+    const bool node_was_left = parent->left.get() == node;
+    auto node_ptr = node_was_left ? parent->left : parent->right;
+    auto sibling_ptr = node_was_left ? parent->right : parent->left;
+    auto& parent_slot = slot_of(grand_parent, parent);
+    auto parent_ptr = parent_slot;
+
+    auto old_chain = ancestors(grand_parent);
+    double before = node_cost(parent);
+    for (auto* n : old_chain)
+    {
+        before += node_cost(n);
+    }
+
+    // Detach, the sibling takes the parent's place
+    parent_slot = sibling_ptr;
+    if (auto* sibling_node = as_bvh_node(sibling_ptr))
+    {
+        parents[sibling_node] = grand_parent;
+    }
+    refit_upwards(grand_parent);
+
+    // Branch and bound search of the best sibling, induced is the area added to the ancestors of a candidate
+    struct candidate
+    {
+        double induced;
+        bvh_node* owner;
+        std::shared_ptr<hittable> child;
+        bool operator<(const candidate& other) const { return induced > other.induced; }
+    };
+
+    const auto node_box = node->box;
+    const auto node_area = surface_area(node_box);
+    std::priority_queue<candidate> queue;
+    auto root_induced = surface_area(surrounding_box(root.box, node_box)) - surface_area(root.box);
+    queue.push({root_induced, &root, root.left});
+    if (root.right != root.left)
+    {
+        queue.push({root_induced, &root, root.right});
+    }
+
+    double best_cost = infinity;
+    candidate best{0.0, nullptr, nullptr};
+    while (!queue.empty())
+    {
+        auto current = queue.top();
+        queue.pop();
+        if (current.induced + node_area >= best_cost)
+        {
+            break;
+        }
+
+        auto box = child_box(current.child);
+        auto merged_area = surface_area(surrounding_box(box, node_box));
+        if (current.induced + merged_area < best_cost)
+        {
+            best_cost = current.induced + merged_area;
+            best = current;
+        }
+
+        if (auto* child_node = as_bvh_node(current.child))
+        {
+            auto induced = current.induced + merged_area - surface_area(box);
+            if (induced + node_area < best_cost && child_node->left != child_node->right)
+            {
+                queue.push({induced, child_node, child_node->left});
+                queue.push({induced, child_node, child_node->right});
+            }
+        }
+    }
+
+    auto undo_detach = [&]()
+    {
+        parent_slot = parent_ptr;
+        if (auto* sibling_node = as_bvh_node(sibling_ptr))
+        {
+            parents[sibling_node] = parent;
+        }
+        refit_upwards(parent);
+    };
+
+    if (!best.owner)
+    {
+        undo_detach();
+        return false;
+    }
+
+    // Nodes of the new chain outside the old one still have their original boxes
+    auto new_owner_chain = ancestors(best.owner);
+    for (auto* n : new_owner_chain)
+    {
+        if (std::find(old_chain.begin(), old_chain.end(), n) == old_chain.end())
+        {
+            before += node_cost(n);
+        }
+    }
+
+    // The parent node object is reused to join the best sibling and node
+    auto& target_slot = slot_of(best.owner, best.child.get());
+    target_slot = parent_ptr;
+    parent->left = best.child;
+    parent->right = node_ptr;
+    parents[parent] = best.owner;
+    if (auto* child_node = as_bvh_node(best.child))
+    {
+        parents[child_node] = parent;
+    }
+    refit_upwards(parent);
+
+    double after = node_cost(parent);
+    auto affected = old_chain;
+    for (auto* n : new_owner_chain)
+    {
+        if (std::find(affected.begin(), affected.end(), n) == affected.end())
+        {
+            affected.push_back(n);
+        }
+    }
+    for (auto* n : affected)
+    {
+        after += node_cost(n);
+    }
+
+    if (after < before * (1.0 - 1e-9))
+    {
+        return true;
+    }
+
+    // Put everything back where it was
+    target_slot = best.child;
+    if (auto* child_node = as_bvh_node(best.child))
+    {
+        parents[child_node] = best.owner;
+    }
+    refit_upwards(best.owner);
+    parent->left = node_was_left ? node_ptr : sibling_ptr;
+    parent->right = node_was_left ? sibling_ptr : node_ptr;
+    parents[parent] = grand_parent;
+    undo_detach();
+    return false;
+}
+
+inline int bvh_optimizer::optimize(std::chrono::duration<double> budget)
+{
+    using optimize_clock = std::chrono::steady_clock;
+    auto deadline = optimize_clock::now() + std::chrono::duration_cast<optimize_clock::duration>(budget);
+
+    rebuild_parents();
+    int changes = collapse_single_primitive_nodes();
+
+    while (optimize_clock::now() < deadline)
+    {
+        int round_changes = 0;
+
+        // Reinsert the worst nodes first, ranked like Bittner et al. by how much larger than its children a
+        // node is, times its own area
+        std::vector<std::pair<double, bvh_node*>> candidates;
+        for (auto* node : nodes)
+        {
+            if (node == &root || parents[node] == &root)
+            {
+                continue;
+            }
+            auto area = surface_area(node->box);
+            auto left_area = surface_area(child_box(node->left));
+            auto right_area = surface_area(child_box(node->right));
+            auto m_min = area / std::max(std::min(left_area, right_area), 1e-12);
+            auto m_sum = area / std::max(0.5 * (left_area + right_area), 1e-12);
+            candidates.push_back({m_min * m_sum * area, node});
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+
+        auto batch = std::max<size_t>(16, candidates.size() / 100);
+        for (size_t idx = 0; idx < std::min(batch, candidates.size()); ++idx)
+        {
+            if (optimize_clock::now() >= deadline)
+            {
+                break;
+            }
+            if (try_reinsert(candidates[idx].second))
+            {
+                ++round_changes;
+            }
+        }
+
+        // Reinsertions keep parents up to date but not the post order
+        rebuild_parents();
+
+        for (auto* node : nodes)
+        {
+            if (try_rotations(node))
+            {
+                ++round_changes;
+                refit_upwards(parents[node]);
+            }
+        }
+
+        changes += round_changes;
+        if (round_changes == 0)
+        {
+            break;
+        }
+    }
+
+    return changes;
+}
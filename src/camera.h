@@ -33,15 +33,16 @@ public:
         vertical = 2 * half_height * focus_dist * v;
     }
 
-    ray get_ray(double s, double t) const
+    // lens_u, lens_v and time_u are uniform in [0, 1), they pick the point on the lens and the time of the ray
+    ray get_ray(double s, double t, double lens_u, double lens_v, double time_u) const
     {
-        vec3 rd = lens_radius * random_in_unit_disk();
+        vec3 rd = lens_radius * sample_in_unit_disk(lens_u, lens_v);
         vec3 offset = u * rd.x() + v * rd.y();
 
         return ray(
             origin + offset,
             lower_left_corner + s * horizontal + t * vertical - origin - offset,
-            random_double(time0, time1)
+            time0 + (time1 - time0) * time_u
         );
     }
 
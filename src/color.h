@@ -7,7 +7,7 @@
 
 #include "vec3.h"
 
-void write_color(std::ostream& out, color pixel_color, int samples_per_pixel)
+inline void write_color(std::ostream& out, color pixel_color, int samples_per_pixel)
 {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
@@ -25,7 +25,7 @@ void write_color(std::ostream& out, color pixel_color, int samples_per_pixel)
         << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
 }
 
-void write_color(unsigned char pixel_data[3], color pixel_color, int samples_per_pixel)
+inline void write_color(unsigned char pixel_data[3], color pixel_color, int samples_per_pixel)
 {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// No warnings from external headers
+#pragma warning(push, 0)
+#include <vectorclass.h>
+#pragma warning(pop)
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_optimizer.h"
+#include "hittable.h"
+#include "ray.h"
+#include "vec3.h"
+
+// Four children per node, each one a node or a primitive
+// The child boxes are stored on 8 bits per bound inside a frame around them, bound = origin + q * scale where scale is
+// a power of two so that the decoded value is exact. Lower bounds are rounded down and upper bounds up, a decoded
+// box always contains the real one, it is just a little looser.
+// A node fills exactly one cache line, a bvh_node is an aabb of six doubles, two shared_ptrs and a control block.
+struct alignas(64) compressed_bvh_node
+{
+    static constexpr const uint32_t empty_child = 0xffffffff;
+    // Set on the references to primitives, the other bits index compressed_bvh::primitives
+    static constexpr const uint32_t primitive_flag = 0x80000000;
+
+    float origin[3];
+    float scale[3];
+    // [axis][child]
+    uint8_t lower[3][4];
+    uint8_t upper[3][4];
+    uint32_t children[4];
+
+    double decode(int axis, uint8_t q) const
+    {
+        return static_cast<double>(origin[axis]) + static_cast<double>(q) * static_cast<double>(scale[axis]);
+    }
+};
+
+static_assert(sizeof(compressed_bvh_node) == 64, "A compressed node should fill one cache line");
+
+// Read only copy of a bvh_node tree in compressed nodes, made once the tree is built (and optimized)
+// The binary tree is collapsed to four children per node by opening the largest internal children first
+class compressed_bvh : public hittable
+{
+public:
+    compressed_bvh(const bvh_node& root, double time0, double time1);
+
+    virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const;
+    virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+
+    size_t num_nodes() const { return nodes.size(); }
+    size_t memory_bytes() const { return nodes.size() * sizeof(compressed_bvh_node) + primitives.size() * sizeof(primitives[0]); }
+
+private:
+    uint32_t flatten(const bvh_node& node);
+
+    // The ray against the decoded boxes of the four children at once, a lane is set when the ray enters that box
+    // and t_entry holds the entry distances. Lanes of empty children are meaningless.
+    Vec4db child_hits(const compressed_bvh_node& node, const ray& r, const vec3& inv_dir, double t_min, double t_max, Vec4d& t_entry) const;
+    bool intersect_node(uint32_t index, const ray& r, const vec3& inv_dir, double t_min, double t_max, surface_hit& closest) const;
+    bool occluded_node(uint32_t index, const ray& r, const vec3& inv_dir, double t_min, double t_max) const;
+
+public:
+    aabb box;
+
+private:
+    double time0;
+    double time1;
+    std::vector<compressed_bvh_node> nodes;
+    std::vector<std::shared_ptr<hittable>> primitives;
+};
+
+inline compressed_bvh::compressed_bvh(const bvh_node& root, double t0, double t1) : box(root.box), time0(t0), time1(t1)
+{
+    flatten(root);
+}
+
+inline uint32_t compressed_bvh::flatten(const bvh_node& node)
+{
+    auto index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    // Open the internal child with the largest area until there are four children
+    std::vector<std::shared_ptr<hittable>> children = {node.left};
+    if (node.right != node.left)
+    {
+        children.push_back(node.right);
+    }
+    while (children.size() < 4)
+    {
+        auto largest = children.size();
+        double largest_area = -1.0;
+        for (size_t c = 0; c < children.size(); ++c)
+        {
+            if (auto* child_node = as_bvh_node(children[c]))
+            {
+                auto area = surface_area(child_node->box);
+                if (area > largest_area)
+                {
+                    largest = c;
+                    largest_area = area;
+                }
+            }
+        }
+        if (largest == children.size())
+        {
+            break;
+        }
+
+        auto* opened = as_bvh_node(children[largest]);
+        auto left = opened->left;
+        auto right = opened->right;
+        children[largest] = left;
+        if (right != left)
+        {
+            children.push_back(right);
+        }
+    }
+
+    std::vector<aabb> boxes;
+    for (const auto& child : children)
+    {
+        boxes.push_back(object_box(child, time0, time1));
+    }
+    auto frame = boxes[0];
+    for (const auto& child_box : boxes)
+    {
+        frame = surrounding_box(frame, child_box);
+    }
+
+    compressed_bvh_node packed;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        auto origin = static_cast<float>(frame.min()[axis]);
+        if (origin > frame.min()[axis])
+        {
+            origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+        }
+        packed.origin[axis] = origin;
+
+        // Smallest power of two that covers the frame in 255 steps
+        auto extent = frame.max()[axis] - origin;
+        auto exponent = extent > 0.0 ? static_cast<int>(std::ceil(std::log2(extent / 255.0))) : -100;
+        exponent = std::max(exponent, -100);
+        packed.scale[axis] = std::ldexp(1.0f, exponent);
+        while (packed.decode(axis, 255) < frame.max()[axis])
+        {
+            packed.scale[axis] *= 2.0f;
+        }
+    }
+
+    for (size_t c = 0; c < 4; ++c)
+    {
+        if (c >= children.size())
+        {
+            packed.children[c] = compressed_bvh_node::empty_child;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                packed.lower[axis][c] = 0;
+                packed.upper[axis][c] = 0;
+            }
+            continue;
+        }
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // Rounded then nudged until the decoded bounds contain the box, whatever rounding the decoding does
+            auto to_steps = [&](double value) { return (value - packed.origin[axis]) / packed.scale[axis]; };
+            auto lower = static_cast<int>(clamp(std::floor(to_steps(boxes[c].min()[axis])), 0.0, 255.0));
+            while (lower > 0 && packed.decode(axis, static_cast<uint8_t>(lower)) > boxes[c].min()[axis])
+            {
+                --lower;
+            }
+            auto upper = static_cast<int>(clamp(std::ceil(to_steps(boxes[c].max()[axis])), 0.0, 255.0));
+            while (upper < 255 && packed.decode(axis, static_cast<uint8_t>(upper)) < boxes[c].max()[axis])
+            {
+                ++upper;
+            }
+            packed.lower[axis][c] = static_cast<uint8_t>(lower);
+            packed.upper[axis][c] = static_cast<uint8_t>(upper);
+        }
+
+        if (auto* child_node = as_bvh_node(children[c]))
+        {
+            packed.children[c] = flatten(*child_node);
+        }
+        else
+        {
+            packed.children[c] = static_cast<uint32_t>(primitives.size()) | compressed_bvh_node::primitive_flag;
+            primitives.push_back(children[c]);
+        }
+    }
+
+    // flatten may have moved the nodes
+    nodes[index] = packed;
+    return index;
+}
+
+inline Vec4db compressed_bvh::child_hits(
+    const compressed_bvh_node& node, const ray& r, const vec3& inv_dir, double t_min, double t_max, Vec4d& t_entry) const
+{
+    // Same operations as decode and aabb::hit, lane by lane, the distances are exactly those of one box at a time
+    Vec4d entry(t_min);
+    Vec4d exit(t_max);
+    for (int a = 0; a < 3; a++)
+    {
+        Vec4d origin(static_cast<double>(node.origin[a]));
+        Vec4d scale(static_cast<double>(node.scale[a]));
+        Vec4d lower(node.lower[a][0], node.lower[a][1], node.lower[a][2], node.lower[a][3]);
+        Vec4d upper(node.upper[a][0], node.upper[a][1], node.upper[a][2], node.upper[a][3]);
+
+        Vec4d t0 = (origin + lower * scale - r.origin()[a]) * inv_dir[a];
+        Vec4d t1 = (origin + upper * scale - r.origin()[a]) * inv_dir[a];
+        if (inv_dir[a] < 0.0)
+        {
+            std::swap(t0, t1);
+        }
+        entry = select(t0 > entry, t0, entry);
+        exit = select(t1 < exit, t1, exit);
+    }
+    t_entry = entry;
+    return exit > entry;
+}
+
+inline bool compressed_bvh::intersect_node(
+    uint32_t index, const ray& r, const vec3& inv_dir, double t_min, double t_max, surface_hit& closest) const
+{
+    const auto& node = nodes[index];
+
+    // Children the ray enters, nearest first so that the closest hit shortens the ray early
+    Vec4d t_entries;
+    auto hits = child_hits(node, r, inv_dir, t_min, t_max, t_entries);
+
+    int order[4];
+    double entry[4];
+    int num_hit = 0;
+    for (int c = 0; c < 4 && node.children[c] != compressed_bvh_node::empty_child; ++c)
+    {
+        if (hits[c])
+        {
+            auto t_entry = t_entries[c];
+            int slot = num_hit++;
+            while (slot > 0 && entry[slot - 1] > t_entry)
+            {
+                order[slot] = order[slot - 1];
+                entry[slot] = entry[slot - 1];
+                --slot;
+            }
+            order[slot] = c;
+            entry[slot] = t_entry;
+        }
+    }
+
+    bool hit_anything = false;
+    for (int k = 0; k < num_hit; ++k)
+    {
+        if (entry[k] >= t_max)
+        {
+            break;
+        }
+
+        auto child = node.children[order[k]];
+        bool child_hit_found = (child & compressed_bvh_node::primitive_flag)
+            ? primitives[child & ~compressed_bvh_node::primitive_flag]->intersect(r, t_min, t_max, closest)
+            : intersect_node(child, r, inv_dir, t_min, t_max, closest);
+        if (child_hit_found)
+        {
+            hit_anything = true;
+            t_max = closest.t;
+        }
+    }
+    return hit_anything;
+}
+
+inline bool compressed_bvh::occluded_node(uint32_t index, const ray& r, const vec3& inv_dir, double t_min, double t_max) const
+{
+    const auto& node = nodes[index];
+
+    Vec4d t_entries;
+    auto hits = child_hits(node, r, inv_dir, t_min, t_max, t_entries);
+
+    for (int c = 0; c < 4 && node.children[c] != compressed_bvh_node::empty_child; ++c)
+    {
+        if (!hits[c])
+        {
+            continue;
+        }
+
+        auto child = node.children[c];
+        bool blocked = (child & compressed_bvh_node::primitive_flag)
+            ? primitives[child & ~compressed_bvh_node::primitive_flag]->occluded(r, t_min, t_max)
+            : occluded_node(child, r, inv_dir, t_min, t_max);
+        if (blocked)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool compressed_bvh::intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const
+{
+    if (!box.hit(r, t_min, t_max))
+    {
+        return false;
+    }
+
+    auto inv_dir = vec3(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    return intersect_node(0, r, inv_dir, t_min, t_max, closest);
+}
+
+inline bool compressed_bvh::occluded(const ray& r, double t_min, double t_max) const
+{
+    if (!box.hit(r, t_min, t_max))
+    {
+        return false;
+    }
+
+    auto inv_dir = vec3(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    return occluded_node(0, r, inv_dir, t_min, t_max);
+}
+
+inline bool compressed_bvh::bounding_box(double /*t0*/, double /*t1*/, aabb& output_box) const
+{
+    output_box = box;
+    return true;
+}
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+// No warnings from external headers
+#pragma warning(push, 0)
+#include <windows.h>
+#pragma warning(pop)
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct logical_cpu
+{
+    // OS index, on Windows the processor number inside its group
+    int id;
+    int group;
+    int package;
+    int core;
+    int numa_node;
+    // 0 for the first hardware thread of a core, 1 for its SMT sibling...
+    int smt_index;
+};
+
+class cpu_topology
+{
+public:
+    // Only the CPUs this process may run on
+    static cpu_topology detect();
+
+    int num_numa_nodes() const { return num_nodes; }
+    int num_logical_cpus() const { return static_cast<int>(cpus.size()); }
+
+    int num_cores() const
+    {
+        return static_cast<int>(std::count_if(cpus.begin(), cpus.end(), [](const logical_cpu& cpu) { return cpu.smt_index == 0; }));
+    }
+
+    // Order in which workers get pinned: one hardware thread per core first, cores are dealt round robin over the
+    // NUMA nodes so that small pools still use every node's memory bandwidth, SMT siblings come last
+    std::vector<logical_cpu> placement_order(bool use_smt) const;
+
+    // Pins the calling thread, returns false when the OS refused
+    static bool pin_current_thread(const logical_cpu& cpu);
+
+public:
+    std::vector<logical_cpu> cpus;
+    int num_nodes = 1;
+};
+
+inline std::vector<logical_cpu> cpu_topology::placement_order(bool use_smt) const
+{
+    auto sorted = cpus;
+    std::sort(sorted.begin(), sorted.end(), [](const logical_cpu& a, const logical_cpu& b)
+    {
+        if (a.smt_index != b.smt_index)
+        {
+            return a.smt_index < b.smt_index;
+        }
+        if (a.numa_node != b.numa_node)
+        {
+            return a.numa_node < b.numa_node;
+        }
+        if (a.package != b.package)
+        {
+            return a.package < b.package;
+        }
+        return a.core < b.core;
+    });
+
+    std::vector<logical_cpu> order;
+    order.reserve(sorted.size());
+
+    for (int smt = 0; ; ++smt)
+    {
+        // Per node queues of this SMT level, dealt round robin
+        std::vector<std::vector<logical_cpu>> per_node(static_cast<size_t>(num_nodes));
+        for (const auto& cpu : sorted)
+        {
+            if (cpu.smt_index == smt)
+            {
+                per_node[static_cast<size_t>(std::min(cpu.numa_node, num_nodes - 1))].push_back(cpu);
+            }
+        }
+
+        bool any = false;
+        for (size_t rank = 0; ; ++rank)
+        {
+            bool dealt = false;
+            for (const auto& node_cpus : per_node)
+            {
+                if (rank < node_cpus.size())
+                {
+                    order.push_back(node_cpus[rank]);
+                    dealt = true;
+                    any = true;
+                }
+            }
+            if (!dealt)
+            {
+                break;
+            }
+        }
+
+        if (!any || !use_smt)
+        {
+            break;
+        }
+    }
+
+    return order;
+}
+
+#if defined(_WIN32)
+
+inline cpu_topology cpu_topology::detect()
+{
+    cpu_topology topology;
+
+    DWORD length = 0;
+    GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+    std::vector<char> buffer(length);
+    auto* info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data());
+
+    if (length == 0 || !GetLogicalProcessorInformationEx(RelationAll, info, &length))
+    {
+        auto count = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        for (int id = 0; id < count; ++id)
+        {
+            topology.cpus.push_back(logical_cpu{id % 64, id / 64, 0, id, 0, 0});
+        }
+        return topology;
+    }
+
+    auto find_cpus = [&](const GROUP_AFFINITY& mask, auto&& fn)
+    {
+        for (auto& cpu : topology.cpus)
+        {
+            if (cpu.group == mask.Group && (mask.Mask & (KAFFINITY(1) << cpu.id)))
+            {
+                fn(cpu);
+            }
+        }
+    };
+
+    // Cores first, packages and nodes refer to their logical processors
+    int core_id = 0;
+    for (DWORD offset = 0; offset < length; )
+    {
+        auto* entry = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+        if (entry->Relationship == RelationProcessorCore)
+        {
+            int smt_index = 0;
+            for (WORD group_idx = 0; group_idx < entry->Processor.GroupCount; ++group_idx)
+            {
+                const auto& mask = entry->Processor.GroupMask[group_idx];
+                for (int bit = 0; bit < static_cast<int>(sizeof(KAFFINITY) * 8); ++bit)
+                {
+                    if (mask.Mask & (KAFFINITY(1) << bit))
+                    {
+                        topology.cpus.push_back(logical_cpu{bit, mask.Group, 0, core_id, 0, smt_index++});
+                    }
+                }
+            }
+            ++core_id;
+        }
+        offset += entry->Size;
+    }
+
+    int package_id = 0;
+    for (DWORD offset = 0; offset < length; )
+    {
+        auto* entry = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+        if (entry->Relationship == RelationProcessorPackage)
+        {
+            for (WORD group_idx = 0; group_idx < entry->Processor.GroupCount; ++group_idx)
+            {
+                find_cpus(entry->Processor.GroupMask[group_idx], [&](logical_cpu& cpu) { cpu.package = package_id; });
+            }
+            ++package_id;
+        }
+        else if (entry->Relationship == RelationNumaNode)
+        {
+            auto node = static_cast<int>(entry->NumaNode.NodeNumber);
+            find_cpus(entry->NumaNode.GroupMask, [&](logical_cpu& cpu) { cpu.numa_node = node; });
+            topology.num_nodes = std::max(topology.num_nodes, node + 1);
+        }
+        offset += entry->Size;
+    }
+
+    return topology;
+}
+
+inline bool cpu_topology::pin_current_thread(const logical_cpu& cpu)
+{
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = static_cast<WORD>(cpu.group);
+    affinity.Mask = KAFFINITY(1) << cpu.id;
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+}
+
+#elif defined(__linux__)
+
+inline int read_int_file(const std::filesystem::path& path, int default_value)
+{
+    std::ifstream file(path);
+    int value;
+    if (file >> value)
+    {
+        return value;
+    }
+    return default_value;
+}
+
+inline cpu_topology cpu_topology::detect()
+{
+    namespace fs = std::filesystem;
+
+    cpu_topology topology;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        auto count = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        for (int id = 0; id < count; ++id)
+        {
+            CPU_SET(static_cast<size_t>(id), &allowed);
+        }
+    }
+
+    for (int id = 0; id < CPU_SETSIZE; ++id)
+    {
+        if (!CPU_ISSET(static_cast<size_t>(id), &allowed))
+        {
+            continue;
+        }
+
+        auto cpu_dir = fs::path("/sys/devices/system/cpu") / ("cpu" + std::to_string(id));
+        logical_cpu cpu{id, 0, 0, id, 0, 0};
+        cpu.package = read_int_file(cpu_dir / "topology" / "physical_package_id", 0);
+        cpu.core = read_int_file(cpu_dir / "topology" / "core_id", id);
+
+        // The node shows up as a nodeN link in the cpu directory
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(cpu_dir, ec))
+        {
+            auto name = entry.path().filename().string();
+            if (name.size() > 4 && name.compare(0, 4, "node") == 0)
+            {
+                cpu.numa_node = std::atoi(name.c_str() + 4);
+                break;
+            }
+        }
+
+        topology.cpus.push_back(cpu);
+        topology.num_nodes = std::max(topology.num_nodes, cpu.numa_node + 1);
+    }
+
+    // Hardware threads of a core are numbered in OS order
+    for (auto& cpu : topology.cpus)
+    {
+        cpu.smt_index = static_cast<int>(std::count_if(topology.cpus.begin(), topology.cpus.end(), [&](const logical_cpu& other)
+        {
+            return other.package == cpu.package && other.core == cpu.core && other.id < cpu.id;
+        }));
+    }
+
+    return topology;
+}
+
+inline bool cpu_topology::pin_current_thread(const logical_cpu& cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(static_cast<size_t>(cpu.id), &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#else
+
+inline cpu_topology cpu_topology::detect()
+{
+    cpu_topology topology;
+    auto count = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    for (int id = 0; id < count; ++id)
+    {
+        topology.cpus.push_back(logical_cpu{id, 0, 0, id, 0, 0});
+    }
+    return topology;
+}
+
+inline bool cpu_topology::pin_current_thread(const logical_cpu& /*cpu*/)
+{
+    return false;
+}
+
+#endif
+
+// Pages allocated by the calling thread while this is alive are spread round robin over all the NUMA nodes
+// Meant for the scene and the BVH, which every worker reads, instead of piling them on the main thread's node
+// Only implemented on Linux, elsewhere allocations keep following the first touch policy
+class numa_interleave_scope
+{
+public:
+    numa_interleave_scope(const cpu_topology& topology)
+    {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+        static constexpr const int mpol_interleave = 3;
+        static constexpr const size_t bits_per_word = sizeof(unsigned long) * 8;
+        if (topology.num_numa_nodes() > 1)
+        {
+            // As many words as the highest node needs
+            std::vector<unsigned long> node_mask(static_cast<size_t>(topology.num_numa_nodes() - 1) / bits_per_word + 1, 0);
+            for (const auto& cpu : topology.cpus)
+            {
+                auto node = static_cast<size_t>(cpu.numa_node);
+                node_mask[node / bits_per_word] |= 1UL << (node % bits_per_word);
+            }
+            // The kernel reads one bit less than the count it is given
+            active = syscall(SYS_set_mempolicy, mpol_interleave, node_mask.data(), node_mask.size() * bits_per_word + 1) == 0;
+        }
+#else
+        (void)topology;
+#endif
+    }
+
+    ~numa_interleave_scope()
+    {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+        static constexpr const int mpol_default = 0;
+        if (active)
+        {
+            syscall(SYS_set_mempolicy, mpol_default, nullptr, 0);
+        }
+#endif
+    }
+
+    numa_interleave_scope(const numa_interleave_scope&) = delete;
+    numa_interleave_scope& operator=(const numa_interleave_scope&) = delete;
+
+private:
+    bool active = false;
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "thread_pool.h"
+#include "vec3.h"
+
+// First hit attributes gathered by ray_color, averaged over the pixel samples they guide the denoiser
+struct first_hit_aov
+{
+    color albedo;
+    vec3 normal;
+};
+
+// Edge-avoiding a-trous wavelet filter
+// See Dammertz et al. 2010, Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering
+// Each pass is a 5x5 B3 spline kernel whose taps are spread 2^pass pixels apart, the taps are weighted by how
+// close their color, normal and albedo are to the center pixel so that edges survive the blur.
+class atrous_denoiser
+{
+public:
+    atrous_denoiser() {}
+    atrous_denoiser(int iter) : iterations(iter) {}
+
+    // image holds the averaged pixel colors and is filtered in place, rows are spread over the pool
+    template<typename ColorBuffer, typename AlbedoBuffer, typename NormalBuffer>
+    void denoise(
+        ColorBuffer& image, const AlbedoBuffer& albedo, const NormalBuffer& normal,
+        int width, int height, thread_pool& pool) const;
+
+public:
+    int iterations = 5;
+    double sigma_color = 0.6;
+    double sigma_normal = 0.3;
+    double sigma_albedo = 0.1;
+};
+
+template<typename ColorBuffer, typename AlbedoBuffer, typename NormalBuffer>
+void atrous_denoiser::denoise(
+    ColorBuffer& image, const AlbedoBuffer& albedo, const NormalBuffer& normal,
+    int width, int height, thread_pool& pool) const
+{
+    static constexpr const double kernel[5] = {1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0};
+    static constexpr const double min_albedo = 1e-3;
+
+    auto pixel_index = [&](int i, int j)
+    {
+        return static_cast<size_t>(j) * static_cast<size_t>(width) + static_cast<size_t>(i);
+    };
+
+    auto safe_albedo = [&](size_t idx)
+    {
+        const auto& a = albedo[idx];
+        return color(std::fmax(a.x(), min_albedo), std::fmax(a.y(), min_albedo), std::fmax(a.z(), min_albedo));
+    };
+
+    // Filter the irradiance rather than the color, the albedo is multiplied back at the end so texture details
+    // do not get blurred away
+    auto current = std::vector<color>(image.size());
+    auto next = std::vector<color>(image.size());
+
+    pool.parallel_for(height, [&](int j, int /*worker*/)
+    {
+        for (int i = 0; i < width; ++i)
+        {
+            auto idx = pixel_index(i, j);
+            auto a = safe_albedo(idx);
+            current[idx] = color(image[idx].x() / a.x(), image[idx].y() / a.y(), image[idx].z() / a.z());
+        }
+    });
+
+    for (int pass = 0; pass < iterations; ++pass)
+    {
+        auto step = 1 << pass;
+        // Smaller details are removed by the first passes, later ones should only smooth what is left
+        auto sigma_c = sigma_color / static_cast<double>(step);
+        auto inv_sigma_c2 = 1.0 / (sigma_c * sigma_c);
+        auto inv_sigma_n2 = 1.0 / (sigma_normal * sigma_normal);
+        auto inv_sigma_a2 = 1.0 / (sigma_albedo * sigma_albedo);
+
+        pool.parallel_for(height, [&](int j, int /*worker*/)
+        {
+            for (int i = 0; i < width; ++i)
+            {
+                auto idx = pixel_index(i, j);
+                const auto& c_p = current[idx];
+                const auto& n_p = normal[idx];
+                const auto& a_p = albedo[idx];
+
+                color sum(0, 0, 0);
+                double weight_sum = 0.0;
+
+                for (int dy = -2; dy <= 2; ++dy)
+                {
+                    auto q_j = j + dy * step;
+                    if (q_j < 0 || q_j >= height)
+                    {
+                        continue;
+                    }
+                    for (int dx = -2; dx <= 2; ++dx)
+                    {
+                        auto q_i = i + dx * step;
+                        if (q_i < 0 || q_i >= width)
+                        {
+                            continue;
+                        }
+                        auto q_idx = pixel_index(q_i, q_j);
+                        const auto& c_q = current[q_idx];
+
+                        auto w_c = std::exp(-(c_p - c_q).length_squared() * inv_sigma_c2);
+                        auto w_n = std::exp(-(n_p - normal[q_idx]).length_squared() * inv_sigma_n2);
+                        auto w_a = std::exp(-(a_p - albedo[q_idx]).length_squared() * inv_sigma_a2);
+                        auto w = kernel[dx + 2] * kernel[dy + 2] * w_c * w_n * w_a;
+
+                        sum += w * c_q;
+                        weight_sum += w;
+                    }
+                }
+
+                // The center tap always has a weight of kernel[2]^2, no division by 0 here
+                next[idx] = sum / weight_sum;
+            }
+        });
+
+        std::swap(current, next);
+    }
+
+    pool.parallel_for(height, [&](int j, int /*worker*/)
+    {
+        for (int i = 0; i < width; ++i)
+        {
+            auto idx = pixel_index(i, j);
+            image[idx] = current[idx] * safe_albedo(idx);
+        }
+    });
+}
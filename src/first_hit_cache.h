@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "aabb.h"
+#include "hittable_list.h"
+#include "views.h"
+
+// Where the camera ray of every sample of a view first hits the scene, the object and the distance
+// A render records it, later renders of the same camera and geometry replay it and start shading from that hit
+// without tracing the camera rays, the position, normal and material are rebuilt from the object so that material
+// changes show up. Objects are indices in the prepared scene's list.
+// Takes 12 bytes per sample, width * height * samples_per_pixel of them.
+class first_hit_cache
+{
+public:
+    static constexpr const uint32_t miss = 0xffffffff;
+
+    first_hit_cache(int w, int h, int spp)
+        : width(w), height(h), samples_per_pixel(spp), t(sample_count()), primitive(sample_count(), miss)
+    {
+    }
+
+    size_t sample_count() const
+    {
+        return static_cast<size_t>(width) * static_cast<size_t>(height) * static_cast<size_t>(samples_per_pixel);
+    }
+    // Sample s of pixel (i, j), rows from the top of the view
+    size_t index(int i, int j, int s) const
+    {
+        auto pixel = static_cast<size_t>(j) * static_cast<size_t>(width) + static_cast<size_t>(i);
+        return pixel * static_cast<size_t>(samples_per_pixel) + static_cast<size_t>(s);
+    }
+
+public:
+    int width;
+    int height;
+    int samples_per_pixel;
+    // Replayed when set, recorded by the next render otherwise
+    bool recorded = false;
+    std::vector<double> t;
+    std::vector<uint32_t> primitive;
+};
+
+// Everything the recorded hits depend on, the image size, the samples, the cameras and the bounds of the objects in
+// the order of the prepared scene. Material parameters are left out on purpose.
+inline uint64_t first_hit_fingerprint(
+    const hittable_list& objects, double time0, double time1, const std::vector<view_spec>& views, int width, int height,
+    int samples_per_pixel, const std::string& sampler_name)
+{
+    // FNV-1a over the bytes of the values
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto add_bytes = [&](const void* data, size_t size)
+    {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        for (size_t idx = 0; idx < size; ++idx)
+        {
+            hash = (hash ^ bytes[idx]) * 0x100000001b3ull;
+        }
+    };
+    auto add_double = [&](double value) { add_bytes(&value, sizeof(value)); };
+    auto add_vec3 = [&](const vec3& v)
+    {
+        add_double(v.x());
+        add_double(v.y());
+        add_double(v.z());
+    };
+
+    int32_t sizes[4] = {width, height, samples_per_pixel, static_cast<int32_t>(objects.objects.size())};
+    add_bytes(sizes, sizeof(sizes));
+    add_bytes(sampler_name.data(), sampler_name.size());
+    add_double(time0);
+    add_double(time1);
+
+    for (const auto& view : views)
+    {
+        add_vec3(view.lookfrom);
+        add_vec3(view.lookat);
+        add_vec3(view.vup);
+        add_double(view.vfov);
+        add_double(view.aperture);
+        add_double(view.dist_to_focus);
+    }
+
+    for (const auto& object : objects.objects)
+    {
+        aabb box;
+        object->bounding_box(time0, time1, box);
+        add_vec3(box.min());
+        add_vec3(box.max());
+    }
+    return hash;
+}
+
+// Layout : the magic, the fingerprint, the number of views, then for every view its width, height and samples per
+// pixel as int32 followed by the distances and the objects of its samples
+static constexpr const char first_hit_magic[8] = {'R', 'T', 'H', 'I', 'T', '0', '0', '1'};
+
+inline void save_first_hits(const std::string& filename, uint64_t fingerprint, const std::vector<std::shared_ptr<first_hit_cache>>& caches)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Unable to write first hit cache " + filename);
+    }
+
+    auto num_views = static_cast<int32_t>(caches.size());
+    file.write(first_hit_magic, sizeof(first_hit_magic));
+    file.write(reinterpret_cast<const char*>(&fingerprint), sizeof(fingerprint));
+    file.write(reinterpret_cast<const char*>(&num_views), sizeof(num_views));
+    for (const auto& cache : caches)
+    {
+        int32_t sizes[3] = {cache->width, cache->height, cache->samples_per_pixel};
+        file.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+        file.write(reinterpret_cast<const char*>(cache->t.data()), static_cast<std::streamsize>(cache->t.size() * sizeof(double)));
+        file.write(reinterpret_cast<const char*>(cache->primitive.data()), static_cast<std::streamsize>(cache->primitive.size() * sizeof(uint32_t)));
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("Unable to write first hit cache " + filename);
+    }
+}
+
+// The recorded caches of the file, none when it was recorded for another fingerprint
+inline std::vector<std::shared_ptr<first_hit_cache>> load_first_hits(const std::string& filename, uint64_t fingerprint)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Unable to open first hit cache " + filename);
+    }
+
+    char magic[sizeof(first_hit_magic)];
+    uint64_t file_fingerprint = 0;
+    int32_t num_views = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&file_fingerprint), sizeof(file_fingerprint));
+    file.read(reinterpret_cast<char*>(&num_views), sizeof(num_views));
+    if (!file || std::memcmp(magic, first_hit_magic, sizeof(magic)) != 0)
+    {
+        throw std::runtime_error("Not a first hit cache : " + filename);
+    }
+
+    std::vector<std::shared_ptr<first_hit_cache>> caches;
+    if (file_fingerprint != fingerprint)
+    {
+        return caches;
+    }
+
+    for (int32_t view = 0; view < num_views; ++view)
+    {
+        int32_t sizes[3];
+        file.read(reinterpret_cast<char*>(sizes), sizeof(sizes));
+        if (!file || sizes[0] <= 0 || sizes[1] <= 0 || sizes[2] <= 0)
+        {
+            throw std::runtime_error("The first hit cache " + filename + " is corrupt");
+        }
+        auto cache = std::make_shared<first_hit_cache>(sizes[0], sizes[1], sizes[2]);
+        file.read(reinterpret_cast<char*>(cache->t.data()), static_cast<std::streamsize>(cache->t.size() * sizeof(double)));
+        file.read(reinterpret_cast<char*>(cache->primitive.data()), static_cast<std::streamsize>(cache->primitive.size() * sizeof(uint32_t)));
+        cache->recorded = true;
+        caches.push_back(std::move(cache));
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("The first hit cache " + filename + " is truncated");
+    }
+    return caches;
+}
@@ -0,0 +1,567 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray.h"
+#include "thread_pool.h"
+#include "vec3.h"
+
+enum class grid_kind
+{
+    // One resolution over the whole scene
+    uniform,
+    // A coarse grid whose crowded cells hold a finer grid of their own
+    two_level
+};
+
+// Cells of a box, the objects overlapping cell c are items[cell_start[c]] to items[cell_start[c + 1]]
+struct grid_level
+{
+    point3 origin;
+    vec3 cell_size;
+    vec3 inv_cell_size;
+    int res[3] = {1, 1, 1};
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> items;
+
+    size_t num_cells() const { return static_cast<size_t>(res[0]) * static_cast<size_t>(res[1]) * static_cast<size_t>(res[2]); }
+    uint32_t cell_index(int x, int y, int z) const { return static_cast<uint32_t>((z * res[1] + y) * res[0] + x); }
+};
+
+// Grid accelerator traversed with a 3D-DDA, an alternative to bvh_node for dense and even scenes such as the
+// random spheres or particles, it is built in a few linear passes over the objects instead of sorts
+// Objects that are large compared to the rest, the ground sphere, would land in most cells, they are kept aside
+// and tested against every ray before the grid. The grid then only spans the other objects.
+// Cells are filled in parallel on the pool, the objects of every cell are then sorted so that the result does
+// not depend on the scheduling. The two level grid refines every crowded top cell into a grid of its own.
+class grid_accelerator : public hittable
+{
+public:
+    grid_accelerator(const hittable_list& list, double time0, double time1, grid_kind kind, thread_pool& pool);
+
+    virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const;
+    virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+
+    size_t num_cells() const;
+    size_t num_sub_grids() const { return sub_grids.size(); }
+    size_t num_large_objects() const { return large.size(); }
+    size_t memory_bytes() const;
+
+private:
+    // Cells per object of the uniform grid, of the top level and of the refined cells of the two level one
+    static constexpr const double uniform_density = 4.0;
+    static constexpr const double top_density = 0.5;
+    static constexpr const double sub_density = 4.0;
+    static constexpr const int max_resolution = 256;
+    static constexpr const int max_sub_resolution = 32;
+    // Top cells with more objects than this get a grid of their own
+    static constexpr const size_t refine_above = 8;
+    // An object is large when it is wider than this fraction of everything smaller than it
+    static constexpr const double large_fraction = 0.5;
+    static constexpr const uint32_t no_sub_grid = 0xffffffff;
+    static constexpr const uint32_t no_item = 0xffffffff;
+
+    void split_large(const std::vector<aabb>& boxes, const std::vector<uint8_t>& has_box, std::vector<uint32_t>& small);
+    // Sets the cells of level over box for ids, about density cells per object
+    static void build_level(
+        grid_level& level, const aabb& box, const std::vector<aabb>& boxes, const std::vector<uint32_t>& ids,
+        double density, int max_res, thread_pool* pool);
+    static void cell_range(const grid_level& level, const aabb& object_box, int lo[3], int hi[3]);
+
+    // Calls visit(cell, t_enter, t_exit) for the cells of level the ray crosses between t_enter and t_exit, nearest
+    // first, until visit returns true
+    template<typename Visit>
+    static bool walk(const grid_level& level, const ray& r, const vec3& inv_dir, double t_enter, double t_exit, const Visit& visit);
+
+    // The cells of the top level and of the sub grids the ray crosses, visit_items(first, last, t_exit) gets the
+    // objects of every leaf cell
+    template<typename Visit>
+    bool walk_leaves(const ray& r, double t_min, double t_max, const Visit& visit_items) const;
+
+public:
+    aabb box;
+
+private:
+    std::vector<std::shared_ptr<hittable>> objects;
+    // Raw pointers of objects, what the cells index
+    std::vector<const hittable*> primitives;
+    std::vector<const hittable*> large;
+
+    aabb grid_box;
+    bool has_grid = false;
+    grid_level top;
+    // Sub grid of every top cell, no_sub_grid for the plain ones
+    std::vector<uint32_t> top_sub_grid;
+    std::vector<grid_level> sub_grids;
+};
+
+namespace grid_detail
+{
+
+// Calls fn(first, last) over count items, in chunks on the pool when there is one and enough work
+template<typename Function>
+void for_each_chunk(thread_pool* pool, size_t count, const Function& fn)
+{
+    static constexpr const size_t chunk_size = 4096;
+    if (!pool || count <= chunk_size)
+    {
+        if (count > 0)
+        {
+            fn(size_t(0), count);
+        }
+        return;
+    }
+
+    auto num_chunks = static_cast<int>((count + chunk_size - 1) / chunk_size);
+    pool->parallel_for(num_chunks, [&](int chunk, int /*worker*/)
+    {
+        auto first = static_cast<size_t>(chunk) * chunk_size;
+        fn(first, std::min(first + chunk_size, count));
+    });
+}
+
+inline double largest_extent(const aabb& box)
+{
+    auto extent = box.max() - box.min();
+    return std::fmax(extent.x(), std::fmax(extent.y(), extent.z()));
+}
+
+}
+
+inline grid_accelerator::grid_accelerator(const hittable_list& list, double time0, double time1, grid_kind kind, thread_pool& pool)
+    : objects(list.objects)
+{
+    auto count = objects.size();
+    primitives.resize(count);
+    std::vector<aabb> boxes(count);
+    // Not a vector<bool>, the chunks write it from several threads
+    std::vector<uint8_t> has_box(count);
+    grid_detail::for_each_chunk(&pool, count, [&](size_t first, size_t last)
+    {
+        for (size_t idx = first; idx < last; ++idx)
+        {
+            primitives[idx] = objects[idx].get();
+            has_box[idx] = objects[idx]->bounding_box(time0, time1, boxes[idx]) ? 1 : 0;
+        }
+    });
+
+    bool first_box = true;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        if (!has_box[idx])
+        {
+            std::cerr << "No bounding box in grid_accelerator constructor.\n";
+            continue;
+        }
+        box = first_box ? boxes[idx] : surrounding_box(box, boxes[idx]);
+        first_box = false;
+    }
+
+    std::vector<uint32_t> small;
+    split_large(boxes, has_box, small);
+    if (small.empty())
+    {
+        return;
+    }
+
+    grid_box = boxes[small[0]];
+    for (auto id : small)
+    {
+        grid_box = surrounding_box(grid_box, boxes[id]);
+    }
+
+    // A flat scene still gets cells of some thickness
+    auto padding = std::fmax(grid_detail::largest_extent(grid_box) * 1e-6, 1e-9);
+    grid_box = aabb(grid_box.min() - vec3(padding, padding, padding), grid_box.max() + vec3(padding, padding, padding));
+    has_grid = true;
+
+    if (kind == grid_kind::uniform)
+    {
+        build_level(top, grid_box, boxes, small, uniform_density, max_resolution, &pool);
+        return;
+    }
+
+    build_level(top, grid_box, boxes, small, top_density, max_resolution, &pool);
+
+    std::vector<uint32_t> refined;
+    top_sub_grid.assign(top.num_cells(), no_sub_grid);
+    for (uint32_t cell = 0; cell < top.num_cells(); ++cell)
+    {
+        if (top.cell_start[cell + 1] - top.cell_start[cell] > refine_above)
+        {
+            top_sub_grid[cell] = static_cast<uint32_t>(refined.size());
+            refined.push_back(cell);
+        }
+    }
+
+    // One sub grid per item, each one built by a single worker
+    sub_grids.resize(refined.size());
+    if (!refined.empty())
+    {
+        pool.parallel_for(static_cast<int>(refined.size()), [&](int sub, int /*worker*/)
+        {
+            auto cell = refined[static_cast<size_t>(sub)];
+            auto res_x = static_cast<uint32_t>(top.res[0]);
+            auto res_y = static_cast<uint32_t>(top.res[1]);
+            auto x = static_cast<int>(cell % res_x);
+            auto y = static_cast<int>((cell / res_x) % res_y);
+            auto z = static_cast<int>(cell / (res_x * res_y));
+            auto cell_min = top.origin + vec3(x * top.cell_size.x(), y * top.cell_size.y(), z * top.cell_size.z());
+            auto cell_box = aabb(cell_min, cell_min + top.cell_size);
+
+            std::vector<uint32_t> ids(top.items.begin() + top.cell_start[cell], top.items.begin() + top.cell_start[cell + 1]);
+            build_level(sub_grids[static_cast<size_t>(sub)], cell_box, boxes, ids, sub_density, max_sub_resolution, nullptr);
+        });
+    }
+}
+
+inline void grid_accelerator::split_large(const std::vector<aabb>& boxes, const std::vector<uint8_t>& has_box, std::vector<uint32_t>& small)
+{
+    // Widest last, every object is compared to the bounds of all the narrower ones, the first one that is not
+    // large leaves everything narrower in the grid
+    std::vector<uint32_t> order;
+    for (uint32_t id = 0; id < boxes.size(); ++id)
+    {
+        if (has_box[id])
+        {
+            order.push_back(id);
+        }
+        else
+        {
+            large.push_back(primitives[id]);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+    {
+        auto extent_a = grid_detail::largest_extent(boxes[a]);
+        auto extent_b = grid_detail::largest_extent(boxes[b]);
+        return extent_a < extent_b || (extent_a == extent_b && a < b);
+    });
+
+    std::vector<aabb> narrower(order.size());
+    for (size_t idx = 0; idx < order.size(); ++idx)
+    {
+        narrower[idx] = idx == 0 ? boxes[order[0]] : surrounding_box(narrower[idx - 1], boxes[order[idx]]);
+    }
+
+    auto num_small = order.size();
+    while (num_small > 1
+           && grid_detail::largest_extent(boxes[order[num_small - 1]]) > large_fraction * grid_detail::largest_extent(narrower[num_small - 2]))
+    {
+        --num_small;
+        large.push_back(primitives[order[num_small]]);
+    }
+
+    small.assign(order.data(), order.data() + num_small);
+    std::sort(small.begin(), small.end());
+}
+
+inline void grid_accelerator::cell_range(const grid_level& level, const aabb& object_box, int lo[3], int hi[3])
+{
+    for (int a = 0; a < 3; a++)
+    {
+        // Widened a little, a hit on the face between two cells is found from both of them
+        auto margin = level.cell_size[a] * 1e-9;
+        auto low = std::floor((object_box.min()[a] - margin - level.origin[a]) * level.inv_cell_size[a]);
+        auto high = std::floor((object_box.max()[a] + margin - level.origin[a]) * level.inv_cell_size[a]);
+        lo[a] = static_cast<int>(clamp(low, 0.0, level.res[a] - 1.0));
+        hi[a] = static_cast<int>(clamp(high, 0.0, level.res[a] - 1.0));
+    }
+}
+
+inline void grid_accelerator::build_level(
+    grid_level& level, const aabb& level_box, const std::vector<aabb>& boxes, const std::vector<uint32_t>& ids,
+    double density, int max_res, thread_pool* pool)
+{
+    // Cubic cells, as many as density cells per object would make
+    auto extent = level_box.max() - level_box.min();
+    auto volume = extent.x() * extent.y() * extent.z();
+    auto cells_per_length = std::cbrt(density * static_cast<double>(ids.size()) / volume);
+    for (int a = 0; a < 3; a++)
+    {
+        level.res[a] = static_cast<int>(clamp(std::round(extent[a] * cells_per_length), 1.0, static_cast<double>(max_res)));
+    }
+    level.origin = level_box.min();
+    level.cell_size = vec3(extent.x() / level.res[0], extent.y() / level.res[1], extent.z() / level.res[2]);
+    level.inv_cell_size = vec3(1.0 / level.cell_size.x(), 1.0 / level.cell_size.y(), 1.0 / level.cell_size.z());
+
+    auto num_cells = level.num_cells();
+    std::unique_ptr<std::atomic<uint32_t>[]> counts(new std::atomic<uint32_t>[num_cells + 1]());
+
+    // Count, then offsets, then the same walk over the objects again to place them
+    auto for_each_cell = [&](uint32_t id, auto&& fn)
+    {
+        int lo[3];
+        int hi[3];
+        cell_range(level, boxes[id], lo, hi);
+        for (int z = lo[2]; z <= hi[2]; ++z)
+        {
+            for (int y = lo[1]; y <= hi[1]; ++y)
+            {
+                for (int x = lo[0]; x <= hi[0]; ++x)
+                {
+                    fn(level.cell_index(x, y, z));
+                }
+            }
+        }
+    };
+
+    grid_detail::for_each_chunk(pool, ids.size(), [&](size_t first, size_t last)
+    {
+        for (size_t idx = first; idx < last; ++idx)
+        {
+            for_each_cell(ids[idx], [&](uint32_t cell) { counts[cell].fetch_add(1, std::memory_order_relaxed); });
+        }
+    });
+
+    level.cell_start.resize(num_cells + 1);
+    uint32_t total = 0;
+    for (size_t cell = 0; cell < num_cells; ++cell)
+    {
+        level.cell_start[cell] = total;
+        total += counts[cell].load(std::memory_order_relaxed);
+        // Reused as the next free slot of the cell
+        counts[cell].store(level.cell_start[cell], std::memory_order_relaxed);
+    }
+    level.cell_start[num_cells] = total;
+
+    level.items.resize(total);
+    grid_detail::for_each_chunk(pool, ids.size(), [&](size_t first, size_t last)
+    {
+        for (size_t idx = first; idx < last; ++idx)
+        {
+            auto id = ids[idx];
+            for_each_cell(id, [&](uint32_t cell) { level.items[counts[cell].fetch_add(1, std::memory_order_relaxed)] = id; });
+        }
+    });
+
+    grid_detail::for_each_chunk(pool, num_cells, [&](size_t first, size_t last)
+    {
+        for (size_t cell = first; cell < last; ++cell)
+        {
+            std::sort(level.items.begin() + level.cell_start[cell], level.items.begin() + level.cell_start[cell + 1]);
+        }
+    });
+}
+
+template<typename Visit>
+bool grid_accelerator::walk(const grid_level& level, const ray& r, const vec3& inv_dir, double t_enter, double t_exit, const Visit& visit)
+{
+    int cell[3];
+    int step[3];
+    int out[3];
+    double next_t[3];
+    double delta_t[3];
+    for (int a = 0; a < 3; a++)
+    {
+        auto origin = r.origin()[a];
+        auto direction = r.direction()[a];
+        auto position = origin + t_enter * direction;
+        cell[a] = static_cast<int>(clamp(std::floor((position - level.origin[a]) * level.inv_cell_size[a]), 0.0, level.res[a] - 1.0));
+
+        if (direction > 0.0)
+        {
+            step[a] = 1;
+            out[a] = level.res[a];
+            next_t[a] = (level.origin[a] + (cell[a] + 1) * level.cell_size[a] - origin) * inv_dir[a];
+            delta_t[a] = level.cell_size[a] * inv_dir[a];
+        }
+        else if (direction < 0.0)
+        {
+            step[a] = -1;
+            out[a] = -1;
+            next_t[a] = (level.origin[a] + cell[a] * level.cell_size[a] - origin) * inv_dir[a];
+            delta_t[a] = -level.cell_size[a] * inv_dir[a];
+        }
+        else
+        {
+            // Never leaves the slab
+            step[a] = 0;
+            out[a] = -1;
+            next_t[a] = infinity;
+            delta_t[a] = infinity;
+        }
+    }
+
+    auto cell_enter = t_enter;
+    while (true)
+    {
+        auto axis = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+        auto cell_exit = std::fmin(next_t[axis], t_exit);
+        if (visit(level.cell_index(cell[0], cell[1], cell[2]), cell_enter, cell_exit))
+        {
+            return true;
+        }
+        if (next_t[axis] >= t_exit)
+        {
+            return false;
+        }
+
+        cell_enter = next_t[axis];
+        cell[axis] += step[axis];
+        if (cell[axis] == out[axis])
+        {
+            return false;
+        }
+        next_t[axis] += delta_t[axis];
+    }
+}
+
+template<typename Visit>
+bool grid_accelerator::walk_leaves(const ray& r, double t_min, double t_max, const Visit& visit_items) const
+{
+    if (!has_grid)
+    {
+        return false;
+    }
+
+    // The part of the ray inside the grid, same slabs as aabb::hit
+    auto inv_dir = vec3(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    auto t_enter = t_min;
+    auto t_exit = t_max;
+    for (int a = 0; a < 3; a++)
+    {
+        auto t0 = (grid_box.min()[a] - r.origin()[a]) * inv_dir[a];
+        auto t1 = (grid_box.max()[a] - r.origin()[a]) * inv_dir[a];
+        if (inv_dir[a] < 0.0)
+        {
+            std::swap(t0, t1);
+        }
+        t_enter = t0 > t_enter ? t0 : t_enter;
+        t_exit = t1 < t_exit ? t1 : t_exit;
+        if (t_exit <= t_enter)
+        {
+            return false;
+        }
+    }
+
+    return walk(top, r, inv_dir, t_enter, t_exit, [&](uint32_t cell, double cell_enter, double cell_exit)
+    {
+        auto sub = top_sub_grid.empty() ? no_sub_grid : top_sub_grid[cell];
+        if (sub == no_sub_grid)
+        {
+            return visit_items(top.items.data() + top.cell_start[cell], top.items.data() + top.cell_start[cell + 1], cell_exit);
+        }
+
+        const auto& level = sub_grids[sub];
+        return walk(level, r, inv_dir, cell_enter, cell_exit, [&](uint32_t sub_cell, double /*sub_enter*/, double sub_exit)
+        {
+            return visit_items(level.items.data() + level.cell_start[sub_cell], level.items.data() + level.cell_start[sub_cell + 1], sub_exit);
+        });
+    });
+}
+
+inline bool grid_accelerator::intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const
+{
+    bool hit_anything = false;
+    for (const auto* object : large)
+    {
+        if (object->intersect(r, t_min, t_max, closest))
+        {
+            hit_anything = true;
+            t_max = closest.t;
+        }
+    }
+
+    // Objects spanning several cells are tested once, a test always passes the closest hit so far as t_max and
+    // that only ever shrinks, a repeated test would find nothing new
+    uint32_t mailbox[8] = {no_item, no_item, no_item, no_item, no_item, no_item, no_item, no_item};
+    walk_leaves(r, t_min, t_max, [&](const uint32_t* first, const uint32_t* last, double cell_exit)
+    {
+        for (auto* item = first; item != last; ++item)
+        {
+            auto& slot = mailbox[*item & 7];
+            if (slot == *item)
+            {
+                continue;
+            }
+            slot = *item;
+
+            if (primitives[*item]->intersect(r, t_min, t_max, closest))
+            {
+                hit_anything = true;
+                t_max = closest.t;
+            }
+        }
+        // Nothing in the cells further along can be closer than a hit inside this one
+        return hit_anything && t_max <= cell_exit;
+    });
+
+    return hit_anything;
+}
+
+inline bool grid_accelerator::occluded(const ray& r, double t_min, double t_max) const
+{
+    for (const auto* object : large)
+    {
+        if (object->occluded(r, t_min, t_max))
+        {
+            return true;
+        }
+    }
+
+    uint32_t mailbox[8] = {no_item, no_item, no_item, no_item, no_item, no_item, no_item, no_item};
+    return walk_leaves(r, t_min, t_max, [&](const uint32_t* first, const uint32_t* last, double /*cell_exit*/)
+    {
+        for (auto* item = first; item != last; ++item)
+        {
+            auto& slot = mailbox[*item & 7];
+            if (slot == *item)
+            {
+                continue;
+            }
+            slot = *item;
+
+            if (primitives[*item]->occluded(r, t_min, t_max))
+            {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+inline bool grid_accelerator::bounding_box(double /*t0*/, double /*t1*/, aabb& output_box) const
+{
+    output_box = box;
+    return true;
+}
+
+inline size_t grid_accelerator::num_cells() const
+{
+    auto count = has_grid ? top.num_cells() : 0;
+    for (const auto& level : sub_grids)
+    {
+        count += level.num_cells();
+    }
+    return count;
+}
+
+inline size_t grid_accelerator::memory_bytes() const
+{
+    auto level_bytes = [](const grid_level& level)
+    {
+        return level.cell_start.size() * sizeof(uint32_t) + level.items.size() * sizeof(uint32_t);
+    };
+
+    auto bytes = level_bytes(top) + top_sub_grid.size() * sizeof(uint32_t) + sub_grids.size() * sizeof(grid_level)
+        + primitives.size() * sizeof(const hittable*) + large.size() * sizeof(const hittable*);
+    for (const auto& level : sub_grids)
+    {
+        bytes += level_bytes(level);
+    }
+    return bytes;
+}
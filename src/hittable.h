@@ -23,11 +23,52 @@ struct hit_record
     }
 };
 
+class hittable;
+
+// Closest hit as found while traversing, the surface attributes are only computed for the final one, by
+// hittable::surface_interaction of the primitive that was hit
+struct surface_hit
+{
+    double t;
+    const hittable* primitive;
+};
+
 class hittable
 {
 public:
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+    // Closest hit with its surface attributes
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+    {
+        surface_hit closest;
+        if (!intersect(r, t_min, t_max, closest))
+        {
+            return false;
+        }
+        closest.primitive->surface_interaction(r, closest, rec);
+        return true;
+    }
+
+    // Closest hit between t_min and t_max, only its distance and the primitive, aggregates pass the query down
+    virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const = 0;
+    // Fills rec for a hit of this primitive returned by intersect, aggregates are never asked
+    virtual void surface_interaction(const ray& /*r*/, const surface_hit& /*closest*/, hit_record& /*rec*/) const {}
+
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const = 0;
 
+    // Any hit query, true as soon as something lies on the ray between t_min and t_max
+    // No surface attributes are computed, which is all shadow and visibility rays need
+    virtual bool occluded(const ray& r, double t_min, double t_max) const
+    {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // Light sampling, solid angle pdf of reaching this object from origin along direction
+    // Objects that cannot be sampled keep the default and are never picked by next event estimation
+    virtual double pdf_value(const point3& /*origin*/, const vec3& /*direction*/) const { return 0.0; }
+    // Direction from origin towards a point on this object, distributed according to pdf_value
+    // u1 and u2 are uniform in [0, 1)
+    virtual vec3 random(const point3& /*origin*/, double /*u1*/, double /*u2*/) const { return vec3(1, 0, 0); }
+
     virtual ~hittable() {};
 };
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
 #include <vector>
 
@@ -14,33 +16,48 @@ public:
     void clear() { objects.clear(); }
     void add(std::shared_ptr<hittable> object) { objects.push_back(object); }
 
-    virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+    virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
+    // Picks one of the objects uniformly
+    virtual double pdf_value(const point3& origin, const vec3& direction) const;
+    virtual vec3 random(const point3& origin, double u1, double u2) const;
+
 public:
     std::vector<std::shared_ptr<hittable>> objects;
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool hittable_list::intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const
 {
-    hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
     for (const auto& object : objects)
     {
-        if (object->hit(r, t_min, closest_so_far, temp_rec))
+        if (object->intersect(r, t_min, closest_so_far, closest))
         {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = closest.t;
         }
     }
 
     return hit_anything;
 }
 
-bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const
+inline bool hittable_list::occluded(const ray& r, double t_min, double t_max) const
+{
+    for (const auto& object : objects)
+    {
+        if (object->occluded(r, t_min, t_max))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const
 {
     if (objects.empty())
     {
@@ -62,3 +79,31 @@ bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const
 
     return true;
 }
+
+inline double hittable_list::pdf_value(const point3& origin, const vec3& direction) const
+{
+    if (objects.empty())
+    {
+        return 0.0;
+    }
+
+    auto weight = 1.0 / static_cast<double>(objects.size());
+    auto sum = 0.0;
+
+    for (const auto& object : objects)
+    {
+        sum += weight * object->pdf_value(origin, direction);
+    }
+
+    return sum;
+}
+
+inline vec3 hittable_list::random(const point3& origin, double u1, double u2) const
+{
+    // u1 picks the object, what is left of it is uniform again and gets reused
+    auto int_size = static_cast<int>(objects.size());
+    auto scaled = u1 * int_size;
+    auto index = std::min(static_cast<int>(scaled), int_size - 1);
+    auto remapped_u1 = std::fmin(scaled - index, 1.0 - 1e-12);
+    return objects[static_cast<size_t>(index)]->random(origin, remapped_u1, u2);
+}
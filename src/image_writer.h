@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "color.h"
+#include "png_encoder.h"
+#include "thread_pool.h"
+#include "vec3.h"
+
+// Output pipeline, images are tonemapped, encoded and written by a background thread while the caller goes on
+// rendering, the tonemapping and the compression of each image are spread over the pool
+class image_writer
+{
+public:
+    // Converts an averaged pixel value to the color write_color gamma-corrects and quantizes
+    using tonemap_function = std::function<color(const color&)>;
+
+    image_writer(thread_pool& p, png_compression c);
+    // Writes whatever is still queued before returning
+    ~image_writer();
+
+    image_writer(const image_writer&) = delete;
+    image_writer& operator=(const image_writer&) = delete;
+
+    // Takes over pixels (width * height averaged values, rows top to bottom)
+    // A replaceable image still waiting in the queue is dropped when a newer one for the same file comes in,
+    // that way previews never pile up behind a slow encoder
+    void submit(
+        const std::string& filename, int width, int height, std::vector<color> pixels, tonemap_function tonemap,
+        bool replaceable = false);
+
+    // Blocks until every submitted image is on disk
+    void wait();
+
+private:
+    struct job
+    {
+        std::string filename;
+        int width;
+        int height;
+        std::vector<color> pixels;
+        tonemap_function tonemap;
+        bool replaceable;
+    };
+
+    void writer_loop();
+    void write(const job& image);
+
+private:
+    thread_pool& pool;
+    png_compression compression;
+
+    std::mutex mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable idle_cv;
+    std::deque<job> queue;
+    bool busy = false;
+    bool stopping = false;
+
+    std::thread thread;
+};
+
+inline image_writer::image_writer(thread_pool& p, png_compression c) : pool(p), compression(c)
+{
+    thread = std::thread([this]() { writer_loop(); });
+}
+
+inline image_writer::~image_writer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    thread.join();
+}
+
+inline void image_writer::submit(
+    const std::string& filename, int width, int height, std::vector<color> pixels, tonemap_function tonemap,
+    bool replaceable)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job image{filename, width, height, std::move(pixels), std::move(tonemap), replaceable};
+
+        auto pending = std::find_if(queue.begin(), queue.end(), [&](const job& queued)
+        {
+            return queued.replaceable && queued.filename == filename;
+        });
+        if (replaceable && pending != queue.end())
+        {
+            *pending = std::move(image);
+        }
+        else
+        {
+            queue.push_back(std::move(image));
+        }
+    }
+    queue_cv.notify_one();
+}
+
+inline void image_writer::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_cv.wait(lock, [&]() { return queue.empty() && !busy; });
+}
+
+inline void image_writer::writer_loop()
+{
+    while (true)
+    {
+        job image;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue_cv.wait(lock, [&]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            image = std::move(queue.front());
+            queue.pop_front();
+            busy = true;
+        }
+
+        write(image);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = false;
+        }
+        idle_cv.notify_all();
+    }
+}
+
+inline void image_writer::write(const job& image)
+{
+    static constexpr const int num_channels = 3;
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto row_size = static_cast<size_t>(image.width) * num_channels;
+    auto rgb = std::vector<unsigned char>(row_size * static_cast<size_t>(image.height));
+    pool.parallel_for(image.height, [&](int j, int /*worker*/)
+    {
+        auto* row = rgb.data() + static_cast<size_t>(j) * row_size;
+        const auto* row_pixels = image.pixels.data() + static_cast<size_t>(j) * static_cast<size_t>(image.width);
+        for (int i = 0; i < image.width; ++i)
+        {
+            write_color(&row[num_channels * i], image.tonemap(row_pixels[i]), 1);
+        }
+    });
+
+    auto png = encode_png(rgb.data(), image.width, image.height, compression, pool);
+
+    std::ofstream file(image.filename, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(png.data()), static_cast<std::streamsize>(png.size()));
+    if (!file)
+    {
+        std::cerr << "Unable to write " << image.filename << std::endl;
+        return;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    if (!image.replaceable)
+    {
+        std::cerr << "Writing " << image.filename << " took : "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms" << std::endl;
+    }
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "denoiser.h"
+#include "hittable.h"
+#include "material.h"
+#include "onb.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "vec3.h"
+
+// Balance between two sampling strategies, see Veach's thesis, beta = 2
+inline double power_heuristic(double pdf_a, double pdf_b)
+{
+    auto a2 = pdf_a * pdf_a;
+    auto b2 = pdf_b * pdf_b;
+    return a2 + b2 > 0.0 ? a2 / (a2 + b2) : 0.0;
+}
+
+inline bool is_black(const color& c)
+{
+    return c.x() <= 0.0 && c.y() <= 0.0 && c.z() <= 0.0;
+}
+
+// Everything a path carries from one bounce to the next
+// The path tracer is split in steps around the ray queries so that ray_color can run a path to completion while
+// the wavefront renderer runs whole batches of paths one bounce at a time
+struct path_state
+{
+    ray r;
+    color radiance = color(0, 0, 0);
+    color throughput = color(1, 1, 1);
+
+    // The camera ray behaves as a specular bounce, what it sees directly is not light sampled
+    bool specular_bounce = true;
+    double bsdf_pdf = 0.0;
+    point3 previous_p;
+    bool alive = true;
+
+    // Next event estimation, the light sample is found on the lights alone and shadow_contribution is added
+    // unless something in the world blocks shadow_ray before shadow_t_max
+    bool has_shadow_ray = false;
+    ray shadow_ray;
+    double shadow_t_max = 0.0;
+    color shadow_contribution;
+
+    path_state() {}
+    path_state(const ray& camera_ray) : r(camera_ray) {}
+};
+
+// The path left the scene
+inline void shade_miss(path_state& path, const scene& scn, int bounce, first_hit_aov* aov)
+{
+    auto background = scn.background_color(path.r);
+    if (aov && bounce == 0)
+    {
+        aov->albedo = background;
+        aov->normal = vec3(0, 0, 0);
+    }
+    path.radiance += path.throughput * background;
+    path.alive = false;
+}
+
+// The uniform numbers of a bounce, the whole block is drawn whatever the material uses, see sampler.h
+struct bounce_sample
+{
+    point2 light_u;
+    bsdf_sample bsdf;
+};
+
+inline bounce_sample draw_bounce_sample(sampler& smp, int bounce)
+{
+    smp.start_bounce(bounce);
+    bounce_sample sample;
+    sample.light_u = smp.get_2d();
+    auto bsdf_u = smp.get_2d();
+    auto lobe_u = smp.get_1d();
+    sample.bsdf.u = vec3(bsdf_u.x, bsdf_u.y, lobe_u);
+    return sample;
+}
+
+// Adds the emission of the hit, prepares the shadow ray towards one of the lights and scatters the path
+// aov is only filled for the camera ray
+inline void shade_hit(path_state& path, const hit_record& rec, const scene& scn, int bounce, const bounce_sample& sample, first_hit_aov* aov)
+{
+    const auto& lights = scn.lights;
+    const bool sample_lights = !lights.objects.empty();
+    const auto& r = path.r;
+
+    path.has_shadow_ray = false;
+
+    if (aov && bounce == 0)
+    {
+        aov->albedo = rec.mat_ptr->base_color();
+        aov->normal = rec.normal;
+    }
+
+    auto emitted = rec.mat_ptr->emitted(r, rec);
+    if (!is_black(emitted))
+    {
+        if (path.specular_bounce || !sample_lights)
+        {
+            path.radiance += path.throughput * emitted;
+        }
+        else
+        {
+            auto light_pdf = lights.pdf_value(path.previous_p, r.direction());
+            path.radiance += power_heuristic(path.bsdf_pdf, light_pdf) * path.throughput * emitted;
+        }
+    }
+
+    scatter_record srec;
+    if (!rec.mat_ptr->scatter(r, rec, sample.bsdf, srec))
+    {
+        path.alive = false;
+        return;
+    }
+
+    if (!srec.is_specular && sample_lights)
+    {
+        auto to_light = unit_vector(lights.random(rec.p, sample.light_u.x, sample.light_u.y));
+        auto light_pdf = lights.pdf_value(rec.p, to_light);
+        auto f = rec.mat_ptr->eval(r, rec, to_light);
+        if (light_pdf > 0.0 && !is_black(f))
+        {
+            // The lights are also part of the world, the shadow ray stops just short of the light it reaches
+            ray shadow_ray(rec.p, to_light, r.time());
+            hit_record light_rec;
+            if (lights.hit(shadow_ray, 0.001, infinity, light_rec))
+            {
+                auto light_emitted = light_rec.mat_ptr->emitted(shadow_ray, light_rec);
+                if (!is_black(light_emitted))
+                {
+                    auto weight = power_heuristic(light_pdf, rec.mat_ptr->scattering_pdf(r, rec, to_light));
+                    path.has_shadow_ray = true;
+                    path.shadow_ray = shadow_ray;
+                    path.shadow_t_max = light_rec.t * (1.0 - 1e-6);
+                    path.shadow_contribution = (weight / light_pdf) * path.throughput * f * light_emitted;
+                }
+            }
+        }
+    }
+
+    path.throughput = path.throughput * srec.attenuation;
+    path.specular_bounce = srec.is_specular;
+    path.bsdf_pdf = srec.pdf;
+    path.previous_p = rec.p;
+    path.r = srec.scattered;
+}
+
+// Result of the occlusion query of the shadow ray
+inline void resolve_shadow_ray(path_state& path, bool occluded)
+{
+    if (!occluded)
+    {
+        path.radiance += path.shadow_contribution;
+    }
+    path.has_shadow_ray = false;
+}
+
+// Path tracer with next event estimation, every non specular hit sends a shadow ray towards one of the lights
+// and emitters reached by bsdf sampling are weighted against the light sampling pdf (multiple importance sampling)
+// aov is only filled for the camera ray, ray_count gets the number of rays traced against the world added
+// first_hit, when given, gets the hit of the camera ray (a null primitive on a miss), or provides it when
+// replay_first_hit is set and the camera ray is not traced at all, see first_hit_cache.h
+inline color ray_color(
+    const ray& camera_ray, const hittable& world, const scene& scn, int depth, sampler& smp, first_hit_aov* aov = nullptr,
+    long long* ray_count = nullptr, surface_hit* first_hit = nullptr, bool replay_first_hit = false)
+{
+    path_state path(camera_ray);
+    long long rays = 0;
+
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    for (int bounce = 0; bounce < depth && path.alive; ++bounce)
+    {
+        hit_record rec;
+        bool hit_anything;
+        if (bounce == 0 && first_hit)
+        {
+            if (!replay_first_hit)
+            {
+                ++rays;
+                if (!world.intersect(path.r, 0.001, infinity, *first_hit))
+                {
+                    first_hit->primitive = nullptr;
+                }
+            }
+            hit_anything = first_hit->primitive != nullptr;
+            if (hit_anything)
+            {
+                first_hit->primitive->surface_interaction(path.r, *first_hit, rec);
+            }
+        }
+        else
+        {
+            ++rays;
+            hit_anything = world.hit(path.r, 0.001, infinity, rec);
+        }
+
+        if (!hit_anything)
+        {
+            shade_miss(path, scn, bounce, aov);
+            break;
+        }
+
+        shade_hit(path, rec, scn, bounce, draw_bounce_sample(smp, bounce), aov);
+
+        if (path.has_shadow_ray)
+        {
+            ++rays;
+            resolve_shadow_ray(path, world.occluded(path.shadow_ray, 0.001, path.shadow_t_max));
+        }
+    }
+
+    if (ray_count)
+    {
+        *ray_count += rays;
+    }
+    return path.radiance;
+}
+
+// Ambient occlusion, the fraction of the hemisphere above the first hit left open up to max_distance, cosine
+// weighted. Every camera ray sends a single occlusion ray, drawn from the bsdf dimensions of the first bounce
+// Rays leaving the scene see a fully open hemisphere
+inline color ambient_occlusion(
+    const ray& camera_ray, const hittable& world, double max_distance, sampler& smp, first_hit_aov* aov = nullptr,
+    long long* ray_count = nullptr)
+{
+    if (ray_count)
+    {
+        ++*ray_count;
+    }
+
+    hit_record rec;
+    if (!world.hit(camera_ray, 0.001, infinity, rec))
+    {
+        if (aov)
+        {
+            aov->albedo = color(1, 1, 1);
+            aov->normal = vec3(0, 0, 0);
+        }
+        return color(1, 1, 1);
+    }
+
+    if (aov)
+    {
+        aov->albedo = color(1, 1, 1);
+        aov->normal = rec.normal;
+    }
+
+    // The light dimensions are skipped, see sampler.h
+    smp.start_bounce(0);
+    smp.get_2d();
+    auto bsdf_u = smp.get_2d();
+
+    onb uvw;
+    uvw.build_from_w(rec.normal);
+    ray ao_ray(rec.p, uvw.local(sample_cosine_hemisphere(bsdf_u.x, bsdf_u.y)), camera_ray.time());
+    if (ray_count)
+    {
+        ++*ray_count;
+    }
+
+    return world.occluded(ao_ray, 0.001, max_distance) ? color(0, 0, 0) : color(1, 1, 1);
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray.h"
+
+// BVH whose nodes are only split the first time a ray reaches them
+// The top eager_depth levels are built up front, below that a node keeps its objects and their box until a ray
+// hits the box, the thread that gets there first splits it and the others wait for it. Parts of the scene no ray
+// ever reaches are never sorted, which gets the first pixels out much sooner on large scenes.
+// Nodes split at the median of the longest axis of their box, bvh_node picks a random axis but random_int is not
+// safe to call from the render threads.
+class lazy_bvh_node : public hittable
+{
+public:
+    lazy_bvh_node(hittable_list& list, double t0, double t1, int eager_depth)
+        : lazy_bvh_node(list.objects, t0, t1, eager_depth)
+    {
+    }
+
+    lazy_bvh_node(std::vector<std::shared_ptr<hittable>> src_objects, double t0, double t1, int eager_depth);
+
+    virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const;
+    virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+
+private:
+    // Objects at or below this count go straight to the children, there is nothing left to split
+    static constexpr const size_t leaf_size = 2;
+
+    // Children are only valid once built is set
+    void ensure_built() const
+    {
+        if (!built.load(std::memory_order_acquire))
+        {
+            build(0);
+        }
+    }
+
+    void build(int eager_depth) const;
+
+public:
+    aabb box;
+
+private:
+    double time0;
+    double time1;
+
+    mutable std::vector<std::shared_ptr<hittable>> objects;
+    mutable std::shared_ptr<hittable> left;
+    mutable std::shared_ptr<hittable> right;
+    mutable std::atomic<bool> built{false};
+    mutable std::mutex build_mutex;
+};
+
+inline lazy_bvh_node::lazy_bvh_node(std::vector<std::shared_ptr<hittable>> src_objects, double t0, double t1, int eager_depth)
+    : time0(t0), time1(t1), objects(std::move(src_objects))
+{
+    bool first = true;
+    for (const auto& object : objects)
+    {
+        aabb object_box;
+        if (!object->bounding_box(time0, time1, object_box))
+        {
+            std::cerr << "No bounding box in lazy_bvh_node constructor.\n";
+        }
+        box = first ? object_box : surrounding_box(box, object_box);
+        first = false;
+    }
+
+    if (eager_depth > 0)
+    {
+        build(eager_depth);
+    }
+}
+
+inline void lazy_bvh_node::build(int eager_depth) const
+{
+    std::lock_guard<std::mutex> lock(build_mutex);
+    if (built.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    if (objects.size() == 1)
+    {
+        left = right = objects[0];
+    }
+    else if (objects.size() <= leaf_size)
+    {
+        left = objects[0];
+        right = objects[1];
+    }
+    else
+    {
+        auto extent = box.max() - box.min();
+        auto axis = 0;
+        if (extent[1] > extent[axis])
+        {
+            axis = 1;
+        }
+        if (extent[2] > extent[axis])
+        {
+            axis = 2;
+        }
+
+        // Ordered by the low side of the boxes like bvh_node, which keeps a huge object such as a ground sphere at
+        // the edge of the splits, only the median has to be in place so nth_element does where bvh_node sorts
+        auto keyed = std::vector<std::pair<double, size_t>>(objects.size());
+        for (size_t idx = 0; idx < objects.size(); ++idx)
+        {
+            aabb object_box;
+            objects[idx]->bounding_box(time0, time1, object_box);
+            keyed[idx] = {object_box.min()[axis], idx};
+        }
+        auto mid = keyed.size() / 2;
+        std::nth_element(keyed.begin(), keyed.begin() + static_cast<std::ptrdiff_t>(mid), keyed.end());
+
+        auto left_objects = std::vector<std::shared_ptr<hittable>>();
+        auto right_objects = std::vector<std::shared_ptr<hittable>>();
+        for (size_t idx = 0; idx < keyed.size(); ++idx)
+        {
+            (idx < mid ? left_objects : right_objects).push_back(objects[keyed[idx].second]);
+        }
+
+        auto child_depth = std::max(0, eager_depth - 1);
+        left = std::make_shared<lazy_bvh_node>(std::move(left_objects), time0, time1, child_depth);
+        right = std::make_shared<lazy_bvh_node>(std::move(right_objects), time0, time1, child_depth);
+    }
+
+    objects.clear();
+    objects.shrink_to_fit();
+    built.store(true, std::memory_order_release);
+}
+
+inline bool lazy_bvh_node::intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const
+{
+    if (!box.hit(r, t_min, t_max))
+    {
+        return false;
+    }
+
+    ensure_built();
+
+    bool hit_left = left->intersect(r, t_min, t_max, closest);
+    bool hit_right = right != left && right->intersect(r, t_min, hit_left ? closest.t : t_max, closest);
+
+    return hit_left || hit_right;
+}
+
+inline bool lazy_bvh_node::occluded(const ray& r, double t_min, double t_max) const
+{
+    if (!box.hit(r, t_min, t_max))
+    {
+        return false;
+    }
+
+    ensure_built();
+
+    return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+}
+
+inline bool lazy_bvh_node::bounding_box(double /*t0*/, double /*t1*/, aabb& output_box) const
+{
+    output_box = box;
+    return true;
+}
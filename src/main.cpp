@@ -2,35 +2,41 @@
 #include <cstdlib>
 #include <ctime>
 
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <string>
 #include <thread>
 #include <vector>
 
 namespace fs = std::filesystem;
 
-// No warnings from external headers
-#pragma warning(push, 0)
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb/stb_image_write.h>
-
-#pragma warning(pop)
-
 #include "rtweekend.h"
 
+#include "accumulation_file.h"
 #include "bvh.h"
+#include "bvh_optimizer.h"
 #include "camera.h"
 #include "color.h"
+#include "cpu_topology.h"
+#include "first_hit_cache.h"
 #include "hittable_list.h"
+#include "image_writer.h"
 #include "material.h"
 #include "moving_sphere.h"
+#include "options.h"
 #include "ray.h"
+#include "renderer.h"
+#include "scene.h"
 #include "sphere.h"
+#include "thread_pool.h"
 #include "vec3.h"
+#include "views.h"
 
 static constexpr const char* output_dir = "outputs/";
 
@@ -49,88 +55,40 @@ const std::string currentDateTime()
     return buf;
 }
 
-color ray_color(const ray& r, const hittable& world, int depth)
+// Rewritten as a whole then renamed over the previous one, whoever reads it never sees half a file
+static void write_progress_file(const std::string& filename, const char* state, const render_progress& progress)
 {
-    hit_record rec;
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
+    auto tmp_filename = filename + ".tmp";
     {
-        return color(0, 0, 0);
-    }
-
-    if (world.hit(r, 0.001, infinity, rec))
-    {
-        ray scattered;
-        color attenuation;
-        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+        std::ofstream file(tmp_filename);
+        if (!file)
         {
-            return attenuation * ray_color(scattered, world, depth - 1);
+            throw std::runtime_error("Unable to write progress file " + tmp_filename);
         }
-        return color(0, 0, 0);
+        file << std::fixed << std::setprecision(3)
+             << "{\"state\":\"" << state << "\",\"fraction\":" << progress.fraction << ",\"pass\":" << progress.pass
+             << ",\"samples_per_pixel\":" << progress.samples_per_pixel << ",\"rays\":" << progress.rays
+             << ",\"rays_per_second\":" << progress.rays_per_second << ",\"elapsed_seconds\":" << progress.elapsed_seconds
+             << ",\"eta_seconds\":" << progress.eta_seconds << "}\n";
     }
-
-    vec3 unit_direction = unit_vector(r.direction());
-    auto t = 0.5 * (unit_direction.y() + 1.0);
-    return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+    fs::rename(tmp_filename, filename);
 }
 
-hittable_list random_scene()
+int main(int argc, char* argv[])
 {
-    hittable_list world;
-
-    world.add(std::make_shared<sphere>(point3(0, -1000, 0), 1000, std::make_shared<lambertian>(color(0.5, 0.5, 0.5))));
-
-    for (int a = -10; a < 10; a++)
-    {
-        for (int b = -10; b < 10; b++)
-        {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-            if ((center - vec3(4, 0.2, 0)).length() > 0.9)
-            {
-                if (choose_mat < 0.8)
-                {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    world.add(std::make_shared<moving_sphere>(
-                        center, center + vec3(0, random_double(0.0, 0.5), 0.0), 0.0, 1.0, 0.2,
-                        std::make_shared<lambertian>(albedo)));
-                }
-                else if (choose_mat < 0.95)
-                {
-                    // metal
-                    auto albedo = color::random(0.5, 1.0);
-                    auto fuzz = random_double(0.0, 0.5);
-                    world.add(
-                        std::make_shared<sphere>(center, 0.2, std::make_shared<metal>(albedo, fuzz)));
-                }
-                else
-                {
-                    // glass
-                    world.add(std::make_shared<sphere>(center, 0.2, std::make_shared<dielectric>(1.5)));
-                }
-            }
-        }
-    }
+    const auto options = parse_options(argc, argv);
 
-    world.add(std::make_shared<sphere>(point3(0, 1, 0), 1.0, std::make_shared<dielectric>(1.5)));
-    world.add(std::make_shared<sphere>(point3(-4, 1, 0), 1.0, std::make_shared<lambertian>(color(0.4, 0.2, 0.1))));
-    world.add(std::make_shared<sphere>(point3(4, 1, 0), 1.0, std::make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+    const int image_width = options.image_width;
+    const int image_height = options.image_height();
 
-    return world;
-}
+    const auto topology = cpu_topology::detect();
+    thread_pool pool(topology, options.num_threads, options.use_smt, options.pin_threads);
 
-int main(int /*argc*/, char* /*argv[]*/)
-{
-    static constexpr const auto aspect_ratio = 16.0 / 9.0;
-    static constexpr const int image_width = 1920;
-    static constexpr const int image_height = static_cast<int>(image_width / aspect_ratio);
-    static constexpr const int num_channels = 3;
-    static constexpr const int samples_per_pixel = 100;
-    static constexpr const int num_threads = 8;
-    static constexpr const int max_depth = 50;
+    // Images are encoded in the background, overlapped with whatever comes next
+    image_writer writer(pool, options.compression);
 
-    auto image = std::vector<unsigned char>(image_width * image_height * num_channels);
+    std::cerr << "Rendering with " << pool.size() << " threads on " << topology.num_cores() << " cores, "
+              << topology.num_logical_cpus() << " hardware threads, " << topology.num_numa_nodes() << " NUMA nodes" << std::endl;
 
     auto output_dir_path = fs::path(output_dir);
 
@@ -144,18 +102,41 @@ int main(int /*argc*/, char* /*argv[]*/)
         }
     }
 
-    auto out_filename = output_dir + currentDateTime() + ".png";
+    auto out_basename = output_dir + currentDateTime();
+
+    // Every worker reads the scene and the BVH, their pages are spread over all the nodes
+    auto interleave = std::make_unique<numa_interleave_scope>(topology);
+
+    auto scene_start = std::chrono::steady_clock::now();
+
+    auto made_scene = make_scene(options.scene_name);
+
+    for (auto index : options.dirty_objects)
+    {
+        if (index >= static_cast<int>(made_scene.world.objects.size()))
+        {
+            throw std::runtime_error("No object " + std::to_string(index) + " in the scene, it has " + std::to_string(made_scene.world.objects.size()));
+        }
+    }
+    // Boxes of the objects, taken before the BVH build reorders the scene's list
+    auto object_boxes = object_bounds(made_scene.world, made_scene.time0, made_scene.time1);
+
+    auto prepared = options.use_grid
+        ? std::make_shared<prepared_scene>(std::move(made_scene), options.grid, pool)
+        : std::make_shared<prepared_scene>(std::move(made_scene), options.lazy_bvh_depth);
+    const auto& scn = prepared->scn;
 
-    // Camera with exposure time
-    point3 lookfrom(13, 2, 3);
-    point3 lookat(0, 0, 0);
-    vec3 vup(0, 1, 0);
-    auto dist_to_focus = 10.0;
-    auto aperture = 0.0;
-    double time0 = 0.0;
-    double time1 = 1.0;
+    auto scene_end = std::chrono::steady_clock::now();
+    auto scene_seconds = std::chrono::duration<double>(scene_end - scene_start).count();
+    std::cerr << "Scene and " << (options.use_grid ? "grid" : "BVH") << " build took : "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(scene_end - scene_start).count() << " ms" << std::endl;
 
-    camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus, time0, time1);
+    if (prepared->grid)
+    {
+        std::cerr << "Grid : " << prepared->grid->num_cells() << " cells, " << prepared->grid->num_sub_grids() << " sub grids, "
+                  << prepared->grid->num_large_objects() << " large objects kept aside, " << static_cast<double>(prepared->grid->memory_bytes()) / 1024.0
+                  << " KiB" << std::endl;
+    }
 
     // Defocus blur aka depth of field
     //point3 lookfrom(13, 2, 3);
@@ -166,8 +147,39 @@ int main(int /*argc*/, char* /*argv[]*/)
 
     //camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus);
 
-    auto world_hittable_list = random_scene();
-    auto world = bvh_node(world_hittable_list, time0, time1);
+    if (options.bvh_report)
+    {
+        compute_bvh_stats(*prepared->bvh, scn.time0, scn.time1).print(std::cerr, "BVH as built");
+    }
+
+    if (options.bvh_optimize_budget > 0.0)
+    {
+        auto optimize_start = std::chrono::steady_clock::now();
+
+        auto changes = prepared->optimize_bvh(std::chrono::duration<double>(options.bvh_optimize_budget));
+
+        auto optimize_end = std::chrono::steady_clock::now();
+        std::cerr << "BVH optimization took : " << std::chrono::duration_cast<std::chrono::milliseconds>(optimize_end - optimize_start).count()
+                  << " ms, " << changes << " changes" << std::endl;
+
+        if (options.bvh_report)
+        {
+            compute_bvh_stats(*prepared->bvh, scn.time0, scn.time1).print(std::cerr, "BVH optimized");
+        }
+    }
+
+    if (options.compressed_bvh)
+    {
+        auto tree_nodes = compute_bvh_stats(*prepared->bvh, scn.time0, scn.time1).num_nodes;
+        // make_shared puts the control block, two counters and a vtable pointer, next to each node
+        auto tree_bytes = static_cast<double>(tree_nodes) * (sizeof(bvh_node) + 16);
+
+        const auto& compressed = prepared->compress_bvh();
+        std::cerr << "Compressed BVH : " << compressed.num_nodes() << " nodes, " << static_cast<double>(compressed.memory_bytes()) / 1024.0
+                  << " KiB instead of about " << tree_bytes / 1024.0 << " KiB" << std::endl;
+    }
+
+    interleave.reset();
 
     //hittable_list world;
     //world.add(std::make_shared<sphere>(point3(0, 0, -1), 0.5, std::make_shared<lambertian>(color(0.1, 0.2, 0.5))));
@@ -181,61 +193,216 @@ int main(int /*argc*/, char* /*argv[]*/)
     //world.add(std::make_shared<sphere>(point3(-R, 0, -1), R, std::make_shared<lambertian>(color(0, 0, 1))));
     //world.add(std::make_shared<sphere>(point3(R, 0, -1), R, std::make_shared<lambertian>(color(1, 0, 0))));
 
-    auto process_rows = [&](int start_j, int stop_j)
+    // Every view is rendered over the same scene and BVH, their rows are handed to the pool as one job so that
+    // the workers never idle between views
+    auto views = std::vector<view_spec>();
+    if (!options.views_file.empty())
+    {
+        views = load_views(options.views_file, scn);
+    }
+    else if (options.turntable > 0)
+    {
+        views = turntable_views(scn, options.turntable);
+    }
+    else
+    {
+        views.push_back(default_view(scn));
+    }
+
+    const int num_views = static_cast<int>(views.size());
+
+    // Partial render, the rest of every view comes from the previous render when it was kept
+    if (!options.dirty_objects.empty() || options.crop_width > 0)
     {
-        for (int j = stop_j - 1; j >= start_j; --j)
+        saved_accumulation saved;
+        if (!options.accumulation_file.empty() && fs::exists(options.accumulation_file))
+        {
+            saved = load_accumulation(options.accumulation_file, image_width, image_height, num_views, options.need_aovs());
+        }
+        const auto& bases = saved.views;
+
+        // Without a previous render there is nothing an object could have left behind
+        auto dirty_boxes = std::vector<aabb>();
+        if (bases.empty())
+        {
+            for (auto index : options.dirty_objects)
+            {
+                dirty_boxes.push_back(object_boxes[static_cast<size_t>(index)]);
+            }
+        }
+        else if (!options.dirty_objects.empty())
         {
-            //std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-            for (int i = 0; i < image_width; ++i)
+            dirty_boxes = changed_boxes(saved.object_boxes, object_boxes, options.dirty_objects);
+        }
+
+        size_t region_pixels = 0;
+        for (size_t view = 0; view < views.size(); ++view)
+        {
+            auto& spec = views[view];
+            if (!options.dirty_objects.empty())
+            {
+                spec.region = project_boxes(spec, options.aspect_ratio, image_width, image_height, dirty_boxes);
+            }
+            if (options.crop_width > 0)
             {
-                color pixel_color(0, 0, 0);
-                for (int s = 0; s < samples_per_pixel; ++s)
-                {
-                    auto u = (i + random_double()) / (image_width - 1);
-                    // Axis y is inverted in conventional images (a png is written below), invert j
-                    auto inverted_j = image_height - 1 - j;
-                    auto v = (inverted_j + random_double()) / (image_height - 1);
-                    ray r = cam.get_ray(u, v);
-                    pixel_color += ray_color(r, world, max_depth);
-                }
-                auto pixel_index = num_channels * (j * image_width + i);
-                write_color(&image.data()[pixel_index], pixel_color, samples_per_pixel);
+                spec.region.clip(image_width, image_height, options.crop_x, options.crop_y,
+                                 options.crop_x + options.crop_width, options.crop_y + options.crop_height);
             }
+            if (!bases.empty())
+            {
+                spec.base = bases[view];
+            }
+            region_pixels += spec.region.num_pixels(image_width, image_height);
         }
+
+        std::cerr << "Rendering " << region_pixels << " of " << static_cast<size_t>(image_width) * static_cast<size_t>(image_height) * views.size() << " pixels"
+                  << (bases.empty() ? ", no accumulation to take the others from" : "") << std::endl;
+    }
+
+    // Output files of a view, the view name is only appended when there are several
+    auto view_basename = [&](size_t view)
+    {
+        return num_views == 1 ? out_basename : out_basename + "_" + views[view].name;
     };
 
-    std::vector<std::thread> threads;
-    threads.reserve(num_threads);
+    // Camera ray hits replayed from the cache file, or recorded to it by this render
+    auto first_hit_caches = std::vector<std::shared_ptr<first_hit_cache>>();
+    bool record_first_hits = false;
+    uint64_t fingerprint = 0;
+    if (!options.first_hit_file.empty())
+    {
+        fingerprint = first_hit_fingerprint(scn.world, scn.time0, scn.time1, views, image_width, image_height, options.samples_per_pixel, options.sampler_name);
+        if (fs::exists(options.first_hit_file))
+        {
+            first_hit_caches = load_first_hits(options.first_hit_file, fingerprint);
+        }
+
+        record_first_hits = first_hit_caches.empty();
+        if (record_first_hits)
+        {
+            for (int view = 0; view < num_views; ++view)
+            {
+                first_hit_caches.push_back(std::make_shared<first_hit_cache>(image_width, image_height, options.samples_per_pixel));
+            }
+        }
+        for (size_t view = 0; view < views.size(); ++view)
+        {
+            views[view].first_hits = first_hit_caches[view];
+        }
+
+        auto cache_bytes = static_cast<double>(first_hit_caches[0]->sample_count()) * num_views * (sizeof(double) + sizeof(uint32_t));
+        std::cerr << (record_first_hits ? "Recording" : "Replaying") << " the camera ray hits, " << cache_bytes / (1024.0 * 1024.0) << " MiB" << std::endl;
+    }
+
+    // Previews are put together from the tiles as they come in and written in the background after every
+    // progressive pass, each worker fills its own rows
+    auto previews = std::vector<std::vector<color>>();
+    render_callbacks callbacks;
+    if (options.preview && options.time_budget > 0.0)
+    {
+        previews.assign(views.size(), std::vector<color>(static_cast<size_t>(image_width) * static_cast<size_t>(image_height)));
+        callbacks.on_tile = [&](const render_tile& tile)
+        {
+            for (int y = 0; y < tile.height; ++y)
+            {
+                auto first = tile.pixels + static_cast<size_t>(y) * static_cast<size_t>(tile.width);
+                auto dest = previews[static_cast<size_t>(tile.view)].data() + static_cast<size_t>(tile.y + y) * static_cast<size_t>(image_width) + static_cast<size_t>(tile.x);
+                std::copy(first, first + tile.width, dest);
+            }
+        };
+        callbacks.on_progress = [&](const render_progress& /*progress*/)
+        {
+            for (size_t view = 0; view < previews.size(); ++view)
+            {
+                writer.submit(view_basename(view) + "_preview.png", image_width, image_height, previews[view], [](const color& c) { return c; }, true);
+            }
+        };
+    }
+
+    renderer rt(pool);
+    auto job = rt.render(prepared, views, options, callbacks);
 
-    auto work_size = image_height / num_threads;
-    auto remaining_work = image_height % num_threads;
+    auto interval = std::chrono::duration<double>(options.progress_interval);
+    while (job.result.wait_for(interval) != std::future_status::ready)
+    {
+        auto progress = job.progress();
+        std::cerr << "Progress : " << std::fixed << std::setprecision(1) << progress.fraction * 100.0 << " %, pass "
+                  << progress.pass << ", " << std::setprecision(2) << progress.samples_per_pixel << " spp, "
+                  << progress.rays_per_second / 1e6 << " Mrays/s, ETA " << std::setprecision(1) << progress.eta_seconds
+                  << " s" << std::defaultfloat << std::setprecision(6) << std::endl;
+        if (!options.progress_file.empty())
+        {
+            write_progress_file(options.progress_file, "rendering", progress);
+        }
+    }
+    const auto& result = job.get();
 
-    auto start = std::chrono::high_resolution_clock::now();
+    if (!options.progress_file.empty())
+    {
+        write_progress_file(options.progress_file, result.cancelled ? "cancelled" : "done", job.progress());
+    }
 
-    for (auto thread_idx = 0; thread_idx < num_threads; ++thread_idx)
+    if (result.trace)
     {
-        auto start_row = thread_idx * work_size;
-        auto stop_row = start_row + work_size;
-        if (thread_idx < num_threads - 1)
+        auto thread_names = std::vector<std::string>();
+        for (int worker = 0; worker < pool.size(); ++worker)
         {
-            threads.push_back(std::thread(process_rows, start_row, stop_row));
+            const auto& cpu = pool.worker_cpu(worker);
+            thread_names.push_back("worker " + std::to_string(worker) + " (cpu " + std::to_string(cpu.id) + ", node "
+                                   + std::to_string(cpu.numa_node) + ")");
         }
-        else
+        thread_names.push_back("render driver");
+        result.trace->write_chrome_trace(options.trace_file, thread_names);
+    }
+
+    std::cerr << "Ray tracing took : " << static_cast<long long>(result.render_seconds) << " seconds, first row done "
+              << static_cast<long long>((scene_seconds + result.first_row_seconds) * 1000.0) << " ms after the scene was started" << std::endl;
+
+    {
+        auto pixels = 0.0;
+        for (const auto& spec : views)
         {
-            threads.push_back(std::thread(process_rows, start_row, stop_row + remaining_work));
+            pixels += static_cast<double>(spec.region.num_pixels(image_width, image_height));
         }
+        std::cerr << "Achieved " << static_cast<double>(result.total_samples) / pixels << " samples per pixel (min "
+                  << result.min_samples << ", max " << result.max_samples << "), "
+                  << static_cast<double>(result.total_samples) / std::max(result.render_seconds, 1e-6) / 1e6 << " Msamples/s, "
+                  << static_cast<double>(result.total_rays) / std::max(result.render_seconds, 1e-6) / 1e6 << " Mrays/s" << std::endl;
+    }
+
+    if (!options.accumulation_file.empty())
+    {
+        save_accumulation(options.accumulation_file, result, object_boxes);
+    }
+
+    if (record_first_hits && !result.cancelled)
+    {
+        save_first_hits(options.first_hit_file, fingerprint, first_hit_caches);
     }
 
-    for (auto& thread : threads)
+    if (options.denoise)
     {
-        thread.join();
+        std::cerr << "Denoising took : " << static_cast<long long>(result.denoise_seconds * 1000.0) << " ms" << std::endl;
     }
 
-    auto end = std::chrono::high_resolution_clock::now();
+    for (size_t view = 0; view < result.views.size(); ++view)
+    {
+        const auto& rendered = result.views[view];
 
-    std::cerr << "Ray tracing took : " << std::chrono::duration_cast<std::chrono::seconds>(end - start).count() << " seconds" << std::endl;
+        if (options.write_aovs)
+        {
+            // write_color gamma-corrects, square the values so that the AOVs are stored linearly
+            writer.submit(view_basename(view) + "_albedo.png", image_width, image_height, rendered.albedo, [](const color& c) { return c * c; });
+            writer.submit(view_basename(view) + "_normal.png", image_width, image_height, rendered.normal, [](const vec3& n)
+            {
+                auto c = 0.5 * (n + vec3(1, 1, 1));
+                return c * c;
+            });
+        }
 
-    stbi_write_png(out_filename.c_str(), image_width, image_height, 3, image.data(), image_width * num_channels * sizeof(unsigned char));
+        writer.submit(view_basename(view) + ".png", image_width, image_height, rendered.image, [](const color& c) { return c; });
+    }
+    writer.wait();
 
     std::cerr << "Done." << std::endl;;
 
@@ -4,19 +4,74 @@
 #include "ray.h"
 #include "vec3.h"
 
-double schlick(double cosine, double ref_idx)
+inline double schlick(double cosine, double ref_idx)
 {
     auto r0 = (1 - ref_idx) / (1 + ref_idx);
     r0 = r0 * r0;
     return r0 + (1 - r0) * pow((1 - cosine), 5);
 }
 
+struct scatter_record
+{
+    ray scattered;
+    // bsdf * cos(theta) / pdf for the scattered direction, i.e. the path throughput factor
+    color attenuation;
+    // Solid angle pdf the scattered direction was drawn with, meaningless for specular scattering
+    double pdf;
+    // Delta distributions (mirror, glass) cannot be reached by light sampling
+    bool is_specular;
+};
+
+// The three uniform numbers the sampler reserves for a bounce, x and y for the direction, z for lobe selection
+// The path tracer warps them on demand, the wavefront renderer warps a whole bounce four paths at a time and hands
+// the results in, see warp_bsdf_samples
+struct bsdf_sample
+{
+    vec3 u;
+    bool warped = false;
+    vec3 on_sphere;
+    vec3 in_sphere;
+
+    vec3 unit_sphere_surface() const
+    {
+        return warped ? on_sphere : sample_unit_sphere_surface(u.x(), u.y());
+    }
+
+    vec3 in_unit_sphere() const
+    {
+        return warped ? in_sphere : sample_in_unit_sphere(u.x(), u.y(), u.z());
+    }
+};
+
+// The emitted radiance and the eval/pdf pair are needed for next event estimation and multiple importance
+// sampling, see ray_color
+// Materials draw nothing but their bsdf_sample so that low discrepancy samples keep their properties
 class material
 {
 public:
-    virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+    virtual bool scatter(const ray& r_in, const hit_record& rec, const bsdf_sample& sample, scatter_record& srec) const = 0;
 
-    virtual ~material() = 0 {};
+    // bsdf * cos(theta) for a direction chosen by someone else (light sampling), 0 for specular materials
+    virtual color eval(const ray& /*r_in*/, const hit_record& /*rec*/, const vec3& /*direction*/) const
+    {
+        return color(0, 0, 0);
+    }
+
+    // Solid angle pdf with which scatter would have picked direction
+    virtual double scattering_pdf(const ray& /*r_in*/, const hit_record& /*rec*/, const vec3& /*direction*/) const
+    {
+        return 0.0;
+    }
+
+    virtual color emitted(const ray& /*r_in*/, const hit_record& /*rec*/) const
+    {
+        return color(0, 0, 0);
+    }
+
+    // Albedo seen by the denoiser, materials without a meaningful one are white
+    virtual color base_color() const { return color(1.0, 1.0, 1.0); }
+
+    virtual ~material() {};
 };
 
 class lambertian : public material
@@ -24,14 +79,36 @@ class lambertian : public material
 public:
     lambertian(const color& a) : albedo(a) {}
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
+    virtual bool scatter(const ray& r_in, const hit_record& rec, const bsdf_sample& sample, scatter_record& srec) const
     {
-        vec3 scatter_direction = rec.normal + random_unit_vector();
-        scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = albedo;
-        return true;
+        // normal + a point on the unit sphere is cosine distributed around the normal
+        vec3 scatter_direction = rec.normal + sample.unit_sphere_surface();
+        if (scatter_direction.length_squared() < 1e-12)
+        {
+            scatter_direction = rec.normal;
+        }
+        srec.scattered = ray(rec.p, scatter_direction, r_in.time());
+        srec.pdf = scattering_pdf(r_in, rec, scatter_direction);
+        srec.is_specular = false;
+        // (albedo / pi) * cos / (cos / pi)
+        srec.attenuation = albedo;
+        return srec.pdf > 0.0;
+    }
+
+    virtual color eval(const ray& /*r_in*/, const hit_record& rec, const vec3& direction) const
+    {
+        auto cosine = dot(rec.normal, unit_vector(direction));
+        return cosine > 0.0 ? (cosine / pi) * albedo : color(0, 0, 0);
+    }
+
+    virtual double scattering_pdf(const ray& /*r_in*/, const hit_record& rec, const vec3& direction) const
+    {
+        auto cosine = dot(rec.normal, unit_vector(direction));
+        return cosine > 0.0 ? cosine / pi : 0.0;
     }
 
+    virtual color base_color() const { return albedo; }
+
 public:
     color albedo;
 };
@@ -41,14 +118,19 @@ class metal : public material
 public:
     metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? (f > 0 ? f : 0): 1) {}
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
+    // The fuzzy reflection has no closed form pdf, it is handled as a specular lobe
+    virtual bool scatter(const ray& r_in, const hit_record& rec, const bsdf_sample& sample, scatter_record& srec) const
     {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
-        attenuation = albedo;
-        return (dot(scattered.direction(), rec.normal) > 0);
+        srec.scattered = ray(rec.p, reflected + fuzz * sample.in_unit_sphere(), r_in.time());
+        srec.attenuation = albedo;
+        srec.pdf = 0.0;
+        srec.is_specular = true;
+        return (dot(srec.scattered.direction(), rec.normal) > 0);
     }
 
+    virtual color base_color() const { return albedo; }
+
 public:
     color albedo;
     double fuzz;
@@ -59,9 +141,11 @@ class dielectric : public material
 public:
     dielectric(double ri) : ref_idx(ri) {}
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
+    virtual bool scatter(const ray& r_in, const hit_record& rec, const bsdf_sample& sample, scatter_record& srec) const
     {
-        attenuation = color(1.0, 1.0, 1.0);
+        srec.attenuation = color(1.0, 1.0, 1.0);
+        srec.pdf = 0.0;
+        srec.is_specular = true;
         double etai_over_etat;
         if (rec.front_face)
         {
@@ -78,21 +162,43 @@ public:
         if (etai_over_etat * sin_theta > 1.0)
         {
             vec3 reflected = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.p, reflected, r_in.time());
+            srec.scattered = ray(rec.p, reflected, r_in.time());
             return true;
         }
         double reflect_prob = schlick(cos_theta, etai_over_etat);
-        if (random_double() < reflect_prob)
+        if (sample.u.z() < reflect_prob)
         {
             vec3 reflected = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.p, reflected, r_in.time());
+            srec.scattered = ray(rec.p, reflected, r_in.time());
             return true;
         }
 
         vec3 refracted = refract(unit_direction, rec.normal, etai_over_etat);
-        scattered = ray(rec.p, refracted, r_in.time());
+        srec.scattered = ray(rec.p, refracted, r_in.time());
         return true;
     }
 
     double ref_idx;
 };
+
+class diffuse_light : public material
+{
+public:
+    diffuse_light(const color& c) : emit(c) {}
+
+    virtual bool scatter(const ray& /*r_in*/, const hit_record& /*rec*/, const bsdf_sample& /*sample*/, scatter_record& /*srec*/) const
+    {
+        return false;
+    }
+
+    // Only the outer side of a light emits
+    virtual color emitted(const ray& /*r_in*/, const hit_record& rec) const
+    {
+        return rec.front_face ? emit : color(0, 0, 0);
+    }
+
+    virtual color base_color() const { return emit; }
+
+public:
+    color emit;
+};
@@ -16,7 +16,9 @@ public:
     {
     };
 
-    virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+    virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const;
+    virtual void surface_interaction(const ray& r, const surface_hit& closest, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
     point3 center(double time) const;
@@ -28,13 +30,13 @@ public:
     std::shared_ptr<material> mat_ptr;
 };
 
-point3 moving_sphere::center(double time) const
+inline point3 moving_sphere::center(double time) const
 {
     return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(
-    const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool moving_sphere::intersect(
+    const ray& r, double t_min, double t_max, surface_hit& closest) const
 {
     vec3 oc = r.origin() - center(r.time());
     auto a = r.direction().length_squared();
@@ -47,33 +49,51 @@ bool moving_sphere::hit(
     {
         auto root = sqrt(discriminant);
         auto temp = (-half_b - root) / a;
-
-        auto fill_sphere_hit_record = [&]()
-        {
-            rec.t = temp;
-            rec.p = r.at(rec.t);
-            auto outward_normal = (rec.p - center(r.time())) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-        };
-
         if (temp < t_max && temp > t_min)
         {
-            fill_sphere_hit_record();
+            closest = surface_hit{temp, this};
             return true;
         }
 
         temp = (-half_b + root) / a;
         if (temp < t_max && temp > t_min)
         {
-            fill_sphere_hit_record();
+            closest = surface_hit{temp, this};
             return true;
         }
     }
     return false;
 }
 
-bool moving_sphere::bounding_box(double t0, double t1, aabb& output_box) const
+inline void moving_sphere::surface_interaction(const ray& r, const surface_hit& closest, hit_record& rec) const
+{
+    rec.t = closest.t;
+    rec.p = r.at(rec.t);
+    auto outward_normal = (rec.p - center(r.time())) / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr;
+}
+
+inline bool moving_sphere::occluded(const ray& r, double t_min, double t_max) const
+{
+    vec3 oc = r.origin() - center(r.time());
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+    auto discriminant = half_b * half_b - a * c;
+
+    if (discriminant <= 0)
+    {
+        return false;
+    }
+
+    auto root = std::sqrt(discriminant);
+    auto near_t = (-half_b - root) / a;
+    auto far_t = (-half_b + root) / a;
+    return (near_t < t_max && near_t > t_min) || (far_t < t_max && far_t > t_min);
+}
+
+inline bool moving_sphere::bounding_box(double t0, double t1, aabb& output_box) const
 {
     aabb box0(
         center(t0) - vec3(radius, radius, radius),
@@ -0,0 +1,395 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "grid.h"
+#include "png_encoder.h"
+
+// Everything that used to be a constant in main(), defaults are the values we always rendered with
+struct render_options
+{
+    double aspect_ratio = 16.0 / 9.0;
+    int image_width = 1920;
+    int samples_per_pixel = 100;
+    // 0 picks one thread per hardware thread, or per core without SMT
+    int num_threads = 0;
+    bool use_smt = true;
+    bool pin_threads = true;
+    int max_depth = 50;
+    // Seconds, when set the image is rendered in progressive passes until the budget is spent and
+    // samples_per_pixel is only used to size the strata of the stratified sampler
+    double time_budget = 0.0;
+    std::string scene_name = "random";
+    // independent, stratified, sobol or bluenoise
+    std::string sampler_name = "sobol";
+
+    // Several views of the scene rendered in one go, from a file (see load_views) or turning around the scene's
+    // camera target, the scene's own camera otherwise
+    std::string views_file;
+    int turntable = 0;
+
+    // Renders ambient occlusion instead of the path traced image, occlusion rays longer than ao_distance are
+    // considered open
+    bool ambient_occlusion = false;
+    double ao_distance = 1.0;
+
+    // Bounce synchronous batches of paths whose rays are sorted before being traced, see wavefront.h
+    bool wavefront = false;
+    // Paths per batch, rounded to whole samples of a row
+    int wavefront_batch_size = 16384;
+
+    // Output, previews are rewritten after every progressive pass
+    png_compression compression = png_compression::normal;
+    bool preview = false;
+
+    // Denoising, the albedo and normal AOVs are always gathered when denoising as they guide the filter
+    bool denoise = false;
+    bool write_aovs = false;
+    int denoise_iterations = 5;
+
+    // Seconds spent improving the BVH after it is built, 0 keeps the tree as built
+    double bvh_optimize_budget = 0.0;
+    bool bvh_report = false;
+    // Levels of the BVH built before rendering, the rest is built as rays reach it, 0 builds everything up front
+    int lazy_bvh_depth = 0;
+    // Traces against a copy of the BVH in quantized cache line nodes, see compressed_bvh.h
+    bool compressed_bvh = false;
+    // Traces against a grid instead of a BVH, see grid.h
+    bool use_grid = false;
+    grid_kind grid = grid_kind::uniform;
+
+    // Reporting, a progress line every progress_interval seconds, mirrored as JSON to progress_file when set,
+    // and a Chrome trace of the rows rendered by every thread to trace_file when set
+    double progress_interval = 1.0;
+    std::string progress_file;
+    std::string trace_file;
+
+    // Partial renders, only the crop rectangle (pixels from the top left corner, no crop when crop_width is 0) and
+    // the tiles where the dirty objects (indices in the scene's list) show up are rendered
+    // The rest of the views comes from the accumulation file when it exists, which is then updated
+    int crop_x = 0;
+    int crop_y = 0;
+    int crop_width = 0;
+    int crop_height = 0;
+    std::vector<int> dirty_objects;
+    std::string accumulation_file;
+
+    // Camera ray hits of every sample kept in this file, replayed while the cameras and the geometry stay the same
+    std::string first_hit_file;
+
+    int image_height() const { return static_cast<int>(image_width / aspect_ratio); }
+    bool need_aovs() const { return denoise || write_aovs; }
+};
+
+inline void print_usage(const char* program_name)
+{
+    std::cerr << "Usage : " << program_name << " [options]\n"
+              << "  --width <pixels>         image width, height follows the 16:9 aspect ratio\n"
+              << "  --spp <samples>          samples per pixel\n"
+              << "  --threads <count>        number of render threads, defaults to the hardware threads\n"
+              << "  --no-smt                 at most one render thread per physical core\n"
+              << "  --no-pin                 let the OS move the render threads around\n"
+              << "  --max-depth <bounces>    ray bounce limit\n"
+              << "  --time-budget <seconds>  render progressive passes until the budget is spent instead of --spp\n"
+              << "  --scene <name>           random or lights\n"
+              << "  --sampler <name>         independent, stratified, sobol (default) or bluenoise\n"
+              << "  --views <file>           render every view listed in the file, one image each\n"
+              << "  --turntable <count>      render count views turning around the scene\n"
+              << "  --ao                     render ambient occlusion instead of path tracing\n"
+              << "  --ao-distance <length>   occlusion ray length, 1 by default\n"
+              << "  --wavefront              trace the paths in batches, sorting the rays of each bounce for coherence\n"
+              << "  --wavefront-batch <n>    paths per wavefront batch\n"
+              << "  --png <level>            png compression, store, fast or normal (default)\n"
+              << "  --preview                write the image after every progressive pass\n"
+              << "  --denoise                filter the image guided by the first hit albedo and normal\n"
+              << "  --denoise-iterations <n> number of a-trous passes, each one doubles the filter footprint\n"
+              << "  --aovs                   also write the albedo and normal buffers\n"
+              << "  --bvh-optimize <seconds> improve the BVH with rotations and reinsertions for at most this long\n"
+              << "  --lazy-bvh <levels>      only build the top levels of the BVH up front, the rest when rays reach it\n"
+              << "  --compressed-bvh         trace against a quantized copy of the BVH that takes less memory\n"
+              << "  --grid <kind>            trace against a grid instead of a BVH, uniform or two-level\n"
+              << "  --bvh-report             print the BVH quality (SAH cost, depth, leaf sizes, overlap)\n"
+              << "  --progress-interval <s>  seconds between progress lines, 1 by default\n"
+              << "  --progress-file <file>   keep the progress in a JSON file, rewritten with every progress line\n"
+              << "  --crop <x,y,w,h>         only render this rectangle of the image, from the top left corner\n"
+              << "  --dirty <i,j,...>        only render the tiles where these objects of the scene show up, and where they or any\n"
+              << "                           object that moved since the --accumulation file showed up before\n"
+              << "  --accumulation <file>    take the pixels left out by --crop or --dirty from this file, then save the render to it\n"
+              << "  --first-hit-cache <file> replay the camera ray hits kept in the file, record them when it is missing or outdated\n"
+              << "  --trace <file>           write a timeline of the rows rendered by each thread, for chrome://tracing or Perfetto\n"
+              << "  --help                   print this message\n";
+}
+
+inline render_options parse_options(int argc, char* argv[])
+{
+    render_options options;
+
+    auto next_int = [&](int& arg_idx)
+    {
+        if (arg_idx + 1 >= argc)
+        {
+            throw std::runtime_error(std::string("Missing value for option ") + argv[arg_idx]);
+        }
+        ++arg_idx;
+        auto value = std::atoi(argv[arg_idx]);
+        if (value <= 0)
+        {
+            throw std::runtime_error(std::string("Invalid value for option ") + argv[arg_idx - 1] + " : " + argv[arg_idx]);
+        }
+        return value;
+    };
+
+    auto next_string = [&](int& arg_idx)
+    {
+        if (arg_idx + 1 >= argc)
+        {
+            throw std::runtime_error(std::string("Missing value for option ") + argv[arg_idx]);
+        }
+        ++arg_idx;
+        return std::string(argv[arg_idx]);
+    };
+
+    for (int arg_idx = 1; arg_idx < argc; ++arg_idx)
+    {
+        std::string arg = argv[arg_idx];
+        if (arg == "--width")
+        {
+            options.image_width = next_int(arg_idx);
+        }
+        else if (arg == "--spp")
+        {
+            options.samples_per_pixel = next_int(arg_idx);
+        }
+        else if (arg == "--threads")
+        {
+            options.num_threads = next_int(arg_idx);
+        }
+        else if (arg == "--no-smt")
+        {
+            options.use_smt = false;
+        }
+        else if (arg == "--no-pin")
+        {
+            options.pin_threads = false;
+        }
+        else if (arg == "--time-budget")
+        {
+            auto value = next_string(arg_idx);
+            options.time_budget = std::atof(value.c_str());
+            if (options.time_budget <= 0.0)
+            {
+                throw std::runtime_error("Invalid value for option --time-budget : " + value);
+            }
+        }
+        else if (arg == "--max-depth")
+        {
+            options.max_depth = next_int(arg_idx);
+        }
+        else if (arg == "--scene")
+        {
+            options.scene_name = next_string(arg_idx);
+        }
+        else if (arg == "--sampler")
+        {
+            options.sampler_name = next_string(arg_idx);
+        }
+        else if (arg == "--views")
+        {
+            options.views_file = next_string(arg_idx);
+        }
+        else if (arg == "--turntable")
+        {
+            options.turntable = next_int(arg_idx);
+        }
+        else if (arg == "--ao")
+        {
+            options.ambient_occlusion = true;
+        }
+        else if (arg == "--ao-distance")
+        {
+            auto value = next_string(arg_idx);
+            options.ao_distance = std::atof(value.c_str());
+            if (options.ao_distance <= 0.0)
+            {
+                throw std::runtime_error("Invalid value for option --ao-distance : " + value);
+            }
+        }
+        else if (arg == "--wavefront")
+        {
+            options.wavefront = true;
+        }
+        else if (arg == "--wavefront-batch")
+        {
+            options.wavefront_batch_size = next_int(arg_idx);
+        }
+        else if (arg == "--png")
+        {
+            auto value = next_string(arg_idx);
+            if (value == "store")
+            {
+                options.compression = png_compression::store;
+            }
+            else if (value == "fast")
+            {
+                options.compression = png_compression::fast;
+            }
+            else if (value == "normal")
+            {
+                options.compression = png_compression::normal;
+            }
+            else
+            {
+                throw std::runtime_error("Invalid value for option --png : " + value);
+            }
+        }
+        else if (arg == "--preview")
+        {
+            options.preview = true;
+        }
+        else if (arg == "--denoise")
+        {
+            options.denoise = true;
+        }
+        else if (arg == "--denoise-iterations")
+        {
+            options.denoise_iterations = next_int(arg_idx);
+        }
+        else if (arg == "--aovs")
+        {
+            options.write_aovs = true;
+        }
+        else if (arg == "--bvh-optimize")
+        {
+            auto value = next_string(arg_idx);
+            options.bvh_optimize_budget = std::atof(value.c_str());
+            if (options.bvh_optimize_budget <= 0.0)
+            {
+                throw std::runtime_error("Invalid value for option --bvh-optimize : " + value);
+            }
+        }
+        else if (arg == "--bvh-report")
+        {
+            options.bvh_report = true;
+        }
+        else if (arg == "--compressed-bvh")
+        {
+            options.compressed_bvh = true;
+        }
+        else if (arg == "--grid")
+        {
+            auto value = next_string(arg_idx);
+            if (value == "uniform")
+            {
+                options.grid = grid_kind::uniform;
+            }
+            else if (value == "two-level")
+            {
+                options.grid = grid_kind::two_level;
+            }
+            else
+            {
+                throw std::runtime_error("Invalid value for option --grid : " + value);
+            }
+            options.use_grid = true;
+        }
+        else if (arg == "--lazy-bvh")
+        {
+            options.lazy_bvh_depth = next_int(arg_idx);
+        }
+        else if (arg == "--progress-interval")
+        {
+            auto value = next_string(arg_idx);
+            options.progress_interval = std::atof(value.c_str());
+            if (options.progress_interval <= 0.0)
+            {
+                throw std::runtime_error("Invalid value for option --progress-interval : " + value);
+            }
+        }
+        else if (arg == "--progress-file")
+        {
+            options.progress_file = next_string(arg_idx);
+        }
+        else if (arg == "--crop")
+        {
+            auto value = next_string(arg_idx);
+            char extra;
+            if (std::sscanf(value.c_str(), "%d,%d,%d,%d%c", &options.crop_x, &options.crop_y, &options.crop_width, &options.crop_height, &extra) != 4
+                || options.crop_x < 0 || options.crop_y < 0 || options.crop_width <= 0 || options.crop_height <= 0)
+            {
+                throw std::runtime_error("Invalid value for option --crop : " + value);
+            }
+        }
+        else if (arg == "--dirty")
+        {
+            auto value = next_string(arg_idx);
+            std::istringstream stream(value);
+            for (std::string token; std::getline(stream, token, ','); )
+            {
+                char* end = nullptr;
+                auto index = std::strtol(token.c_str(), &end, 10);
+                if (token.empty() || *end != '\0' || index < 0)
+                {
+                    throw std::runtime_error("Invalid value for option --dirty : " + value);
+                }
+                options.dirty_objects.push_back(static_cast<int>(index));
+            }
+        }
+        else if (arg == "--accumulation")
+        {
+            options.accumulation_file = next_string(arg_idx);
+        }
+        else if (arg == "--first-hit-cache")
+        {
+            options.first_hit_file = next_string(arg_idx);
+        }
+        else if (arg == "--trace")
+        {
+            options.trace_file = next_string(arg_idx);
+        }
+        else if (arg == "--help")
+        {
+            print_usage(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        }
+        else
+        {
+            print_usage(argv[0]);
+            throw std::runtime_error("Unknown option : " + arg);
+        }
+    }
+
+    if (options.lazy_bvh_depth > 0 && (options.bvh_optimize_budget > 0.0 || options.bvh_report || options.compressed_bvh))
+    {
+        throw std::runtime_error("--lazy-bvh cannot be combined with --bvh-optimize, --bvh-report or --compressed-bvh");
+    }
+
+    if (options.use_grid && (options.lazy_bvh_depth > 0 || options.bvh_optimize_budget > 0.0 || options.bvh_report || options.compressed_bvh))
+    {
+        throw std::runtime_error("--grid cannot be combined with --lazy-bvh, --bvh-optimize, --bvh-report or --compressed-bvh");
+    }
+
+    if (!options.first_hit_file.empty() && (options.time_budget > 0.0 || options.wavefront || options.ambient_occlusion))
+    {
+        throw std::runtime_error("--first-hit-cache cannot be combined with --time-budget, --wavefront or --ao");
+    }
+
+    // The file keeps the plain averages, denoising them would filter the pixels again on every update
+    if (!options.accumulation_file.empty() && options.denoise)
+    {
+        throw std::runtime_error("--accumulation cannot be combined with --denoise");
+    }
+
+    // Without an accumulation the pixels outside the region stay black, the denoiser would blur them into it
+    if ((!options.dirty_objects.empty() || options.crop_width > 0) && options.denoise)
+    {
+        throw std::runtime_error("--dirty and --crop cannot be combined with --denoise");
+    }
+
+    return options;
+}
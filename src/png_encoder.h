@@ -0,0 +1,807 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <queue>
+#include <vector>
+
+#include "thread_pool.h"
+
+// PNG writer whose deflate stream is compressed in parallel
+// The filtered image is cut in chunks of rows that are deflated independently, as pigz does: every chunk but the
+// last ends on an empty stored block so that it stops on a byte boundary, the chunks are then simply
+// concatenated and the zlib checksum is combined from the chunks' checksums. Matches cannot reach into the
+// previous chunk, which costs a little compression on large chunks.
+
+enum class png_compression
+{
+    // Stored blocks, no filtering, as fast as a copy
+    store,
+    // Short match search and fixed Huffman codes
+    fast,
+    // Longer match search with lazy matching and per block Huffman codes
+    normal,
+};
+
+// Checksums
+
+inline uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t size)
+{
+    static const auto table = []()
+    {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t idx = 0; idx < size; ++idx)
+    {
+        crc = table[(crc ^ data[idx]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static constexpr const uint32_t adler_base = 65521;
+
+inline uint32_t adler32_update(uint32_t adler, const uint8_t* data, size_t size)
+{
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (size > 0)
+    {
+        // Largest run that cannot overflow b before the modulo
+        auto run = std::min<size_t>(size, 5552);
+        for (size_t idx = 0; idx < run; ++idx)
+        {
+            a += data[idx];
+            b += a;
+        }
+        a %= adler_base;
+        b %= adler_base;
+        data += run;
+        size -= run;
+    }
+    return (b << 16) | a;
+}
+
+// Checksum of the concatenation of two buffers from their checksums, adler2 covering size2 bytes, as in zlib
+inline uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    uint32_t rem = static_cast<uint32_t>(size2 % adler_base);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = (rem * sum1) % adler_base;
+    sum1 += (adler2 & 0xffff) + adler_base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + adler_base - rem;
+    sum1 %= adler_base;
+    sum2 %= adler_base;
+    return sum1 | (sum2 << 16);
+}
+
+// Deflate, see RFC 1951
+
+// LSB first bit packing
+class deflate_bit_writer
+{
+public:
+    deflate_bit_writer(std::vector<uint8_t>& o) : out(o) {}
+
+    void put_bits(uint32_t value, int count)
+    {
+        bits |= static_cast<uint64_t>(value) << num_bits;
+        num_bits += count;
+        while (num_bits >= 8)
+        {
+            out.push_back(static_cast<uint8_t>(bits));
+            bits >>= 8;
+            num_bits -= 8;
+        }
+    }
+
+    void align_to_byte()
+    {
+        if (num_bits > 0)
+        {
+            put_bits(0, 8 - num_bits);
+        }
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    uint64_t bits = 0;
+    int num_bits = 0;
+};
+
+// Codes are stored bit reversed, ready for put_bits
+struct huffman_code
+{
+    std::vector<uint16_t> codes;
+    std::vector<uint8_t> lengths;
+
+    void put(deflate_bit_writer& writer, size_t symbol) const
+    {
+        writer.put_bits(codes[symbol], lengths[symbol]);
+    }
+};
+
+inline uint16_t reverse_bits(uint32_t code, int length)
+{
+    uint32_t result = 0;
+    for (int bit = 0; bit < length; ++bit)
+    {
+        result = (result << 1) | ((code >> bit) & 1);
+    }
+    return static_cast<uint16_t>(result);
+}
+
+// Canonical codes from code lengths
+inline huffman_code canonical_code(const std::vector<uint8_t>& lengths)
+{
+    static constexpr const int max_length = 15;
+
+    huffman_code result;
+    result.lengths = lengths;
+    result.codes.assign(lengths.size(), 0);
+
+    uint32_t length_counts[max_length + 1] = {};
+    for (auto length : lengths)
+    {
+        ++length_counts[length];
+    }
+    length_counts[0] = 0;
+
+    uint32_t next_code[max_length + 1] = {};
+    uint32_t code = 0;
+    for (int length = 1; length <= max_length; ++length)
+    {
+        code = (code + length_counts[length - 1]) << 1;
+        next_code[length] = code;
+    }
+
+    for (size_t symbol = 0; symbol < lengths.size(); ++symbol)
+    {
+        if (lengths[symbol] != 0)
+        {
+            result.codes[symbol] = reverse_bits(next_code[lengths[symbol]]++, lengths[symbol]);
+        }
+    }
+    return result;
+}
+
+// Complete Huffman code lengths of at most max_length bits, at least two symbols always get a code
+inline std::vector<uint8_t> huffman_lengths(std::vector<uint32_t> frequencies, int max_length)
+{
+    auto num_symbols = frequencies.size();
+    std::vector<uint8_t> lengths(num_symbols, 0);
+
+    int used = static_cast<int>(std::count_if(frequencies.begin(), frequencies.end(), [](uint32_t f) { return f > 0; }));
+    for (size_t symbol = 0; symbol < num_symbols && used < 2; ++symbol)
+    {
+        if (frequencies[symbol] == 0)
+        {
+            frequencies[symbol] = 1;
+            ++used;
+        }
+    }
+
+    // Plain Huffman tree, leaves are 0..num_symbols-1 and internal nodes follow
+    std::vector<int> parent(2 * num_symbols, -1);
+    using entry = std::pair<uint64_t, int>;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry>> queue;
+    for (size_t symbol = 0; symbol < num_symbols; ++symbol)
+    {
+        if (frequencies[symbol] > 0)
+        {
+            queue.push({frequencies[symbol], static_cast<int>(symbol)});
+        }
+    }
+    int next_node = static_cast<int>(num_symbols);
+    while (queue.size() > 1)
+    {
+        auto a = queue.top();
+        queue.pop();
+        auto b = queue.top();
+        queue.pop();
+        parent[static_cast<size_t>(a.second)] = next_node;
+        parent[static_cast<size_t>(b.second)] = next_node;
+        queue.push({a.first + b.first, next_node++});
+    }
+
+    for (size_t symbol = 0; symbol < num_symbols; ++symbol)
+    {
+        if (frequencies[symbol] > 0)
+        {
+            int depth = 0;
+            for (auto node = symbol; parent[node] >= 0; node = static_cast<size_t>(parent[node]))
+            {
+                ++depth;
+            }
+            lengths[symbol] = static_cast<uint8_t>(std::min(depth, max_length));
+        }
+    }
+
+    // Clamping broke the Kraft inequality, lengthen the longest codes still below the limit until it holds again
+    auto kraft = [&]()
+    {
+        uint64_t sum = 0;
+        for (auto length : lengths)
+        {
+            if (length)
+            {
+                sum += uint64_t(1) << (max_length - length);
+            }
+        }
+        return sum;
+    };
+    while (kraft() > (uint64_t(1) << max_length))
+    {
+        auto best = num_symbols;
+        for (size_t symbol = 0; symbol < num_symbols; ++symbol)
+        {
+            if (lengths[symbol] && lengths[symbol] < max_length && (best == num_symbols || lengths[symbol] > lengths[best]))
+            {
+                best = symbol;
+            }
+        }
+        ++lengths[best];
+    }
+
+    // Inflaters reject incomplete codes, shorten the longest codes while there is room left
+    while (kraft() < (uint64_t(1) << max_length))
+    {
+        size_t longest = 0;
+        for (size_t symbol = 0; symbol < num_symbols; ++symbol)
+        {
+            if (lengths[symbol] > lengths[longest])
+            {
+                longest = symbol;
+            }
+        }
+        --lengths[longest];
+    }
+
+    return lengths;
+}
+
+// A literal when distance is 0, a match otherwise
+struct lz77_token
+{
+    uint16_t length_or_literal;
+    uint16_t distance;
+};
+
+static constexpr const int deflate_min_match = 3;
+static constexpr const int deflate_max_match = 258;
+static constexpr const int deflate_window = 32768;
+
+static constexpr const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static constexpr const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static constexpr const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+    6145, 8193, 12289, 16385, 24577};
+static constexpr const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+inline size_t length_symbol_index(int length)
+{
+    size_t idx = 28;
+    while (length_base[idx] > length)
+    {
+        --idx;
+    }
+    return idx;
+}
+
+inline size_t distance_symbol(int distance)
+{
+    size_t idx = 29;
+    while (distance_base[idx] > distance)
+    {
+        --idx;
+    }
+    return idx;
+}
+
+// Hash chain match finder over one chunk
+inline void lz77_parse(const uint8_t* data, size_t size, png_compression level, std::vector<lz77_token>& tokens)
+{
+    static constexpr const int hash_bits = 15;
+    static constexpr const uint32_t hash_mask = (1u << hash_bits) - 1;
+
+    const int max_chain = level == png_compression::fast ? 4 : 64;
+    const bool lazy = level == png_compression::normal;
+
+    std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+    std::vector<int32_t> prev(deflate_window, -1);
+
+    auto hash_at = [&](size_t pos)
+    {
+        return ((static_cast<uint32_t>(data[pos]) << 10) ^ (static_cast<uint32_t>(data[pos + 1]) << 5) ^ data[pos + 2]) & hash_mask;
+    };
+
+    auto insert = [&](size_t pos)
+    {
+        if (pos + deflate_min_match <= size)
+        {
+            auto h = hash_at(pos);
+            prev[pos % deflate_window] = head[h];
+            head[h] = static_cast<int32_t>(pos);
+        }
+    };
+
+    auto find_match = [&](size_t pos, int& best_distance)
+    {
+        int best_length = 0;
+        if (pos + deflate_min_match > size)
+        {
+            return 0;
+        }
+        auto max_length = static_cast<int>(std::min<size_t>(deflate_max_match, size - pos));
+        auto candidate = head[hash_at(pos)];
+        for (int chain = 0; chain < max_chain && candidate >= 0; ++chain)
+        {
+            auto from = static_cast<size_t>(candidate);
+            auto distance = static_cast<int>(pos - from);
+            if (distance > deflate_window)
+            {
+                break;
+            }
+            const auto* match = data + from;
+            const auto* current = data + pos;
+            // The byte past the current best decides whether this candidate can do better
+            if (match[best_length] == current[best_length])
+            {
+                int length = 0;
+                while (length < max_length && match[length] == current[length])
+                {
+                    ++length;
+                }
+                if (length > best_length)
+                {
+                    best_length = length;
+                    best_distance = distance;
+                    if (length == max_length)
+                    {
+                        break;
+                    }
+                }
+            }
+            auto next = prev[from % deflate_window];
+            // Older entries of the ring buffer were overwritten by newer positions
+            if (next >= candidate)
+            {
+                break;
+            }
+            candidate = next;
+        }
+        return best_length >= deflate_min_match ? best_length : 0;
+    };
+
+    size_t pos = 0;
+    while (pos < size)
+    {
+        int distance = 0;
+        auto length = find_match(pos, distance);
+
+        if (length && lazy && length < 32)
+        {
+            insert(pos);
+            int next_distance = 0;
+            auto next_length = find_match(pos + 1, next_distance);
+            if (next_length > length)
+            {
+                tokens.push_back(lz77_token{data[pos], 0});
+                ++pos;
+                length = next_length;
+                distance = next_distance;
+            }
+            else
+            {
+                // pos is already in the chains
+                tokens.push_back(lz77_token{static_cast<uint16_t>(length), static_cast<uint16_t>(distance)});
+                auto match_end = pos + static_cast<size_t>(length);
+                for (size_t idx = pos + 1; idx < match_end; ++idx)
+                {
+                    insert(idx);
+                }
+                pos = match_end;
+                continue;
+            }
+        }
+
+        if (length)
+        {
+            tokens.push_back(lz77_token{static_cast<uint16_t>(length), static_cast<uint16_t>(distance)});
+            // The fast level does not index the inside of long matches
+            auto indexed = static_cast<size_t>(level == png_compression::fast ? std::min(length, 8) : length);
+            for (size_t idx = pos; idx < pos + indexed; ++idx)
+            {
+                insert(idx);
+            }
+            pos += static_cast<size_t>(length);
+        }
+        else
+        {
+            insert(pos);
+            tokens.push_back(lz77_token{data[pos], 0});
+            ++pos;
+        }
+    }
+}
+
+inline void write_tokens(deflate_bit_writer& writer, const lz77_token* tokens, size_t count, const huffman_code& literals, const huffman_code& distances)
+{
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        const auto& token = tokens[idx];
+        if (token.distance == 0)
+        {
+            literals.put(writer, token.length_or_literal);
+            continue;
+        }
+        auto length_idx = length_symbol_index(token.length_or_literal);
+        literals.put(writer, 257 + length_idx);
+        writer.put_bits(token.length_or_literal - length_base[length_idx], length_extra[length_idx]);
+
+        auto distance_idx = distance_symbol(token.distance);
+        distances.put(writer, distance_idx);
+        writer.put_bits(token.distance - distance_base[distance_idx], distance_extra[distance_idx]);
+    }
+    literals.put(writer, 256);
+}
+
+inline void write_fixed_block(deflate_bit_writer& writer, const lz77_token* tokens, size_t count, bool final)
+{
+    static const auto literals = []()
+    {
+        std::vector<uint8_t> lengths(288);
+        std::fill(lengths.begin(), lengths.begin() + 144, uint8_t(8));
+        std::fill(lengths.begin() + 144, lengths.begin() + 256, uint8_t(9));
+        std::fill(lengths.begin() + 256, lengths.begin() + 280, uint8_t(7));
+        std::fill(lengths.begin() + 280, lengths.end(), uint8_t(8));
+        return canonical_code(lengths);
+    }();
+    static const auto distances = canonical_code(std::vector<uint8_t>(30, 5));
+
+    writer.put_bits(final ? 1 : 0, 1);
+    writer.put_bits(1, 2);
+    write_tokens(writer, tokens, count, literals, distances);
+}
+
+inline void write_dynamic_block(deflate_bit_writer& writer, const lz77_token* tokens, size_t count, bool final)
+{
+    std::vector<uint32_t> literal_frequencies(286, 0);
+    std::vector<uint32_t> distance_frequencies(30, 0);
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        const auto& token = tokens[idx];
+        if (token.distance == 0)
+        {
+            ++literal_frequencies[token.length_or_literal];
+        }
+        else
+        {
+            ++literal_frequencies[257 + length_symbol_index(token.length_or_literal)];
+            ++distance_frequencies[distance_symbol(token.distance)];
+        }
+    }
+    literal_frequencies[256] = 1;
+
+    auto literal_lengths = huffman_lengths(literal_frequencies, 15);
+    auto distance_lengths = huffman_lengths(distance_frequencies, 15);
+
+    int num_literals = 286;
+    while (num_literals > 257 && literal_lengths[static_cast<size_t>(num_literals - 1)] == 0)
+    {
+        --num_literals;
+    }
+    int num_distances = 30;
+    while (num_distances > 1 && distance_lengths[static_cast<size_t>(num_distances - 1)] == 0)
+    {
+        --num_distances;
+    }
+
+    // Both length sequences are sent as one, run length encoded with symbols 16 (repeat previous), 17 and 18
+    // (runs of zeros)
+    std::vector<uint8_t> all_lengths(literal_lengths.begin(), literal_lengths.begin() + num_literals);
+    all_lengths.insert(all_lengths.end(), distance_lengths.begin(), distance_lengths.begin() + num_distances);
+
+    struct rle_symbol
+    {
+        uint8_t symbol;
+        uint8_t extra;
+    };
+    std::vector<rle_symbol> rle;
+    for (size_t idx = 0; idx < all_lengths.size(); )
+    {
+        auto length = all_lengths[idx];
+        size_t run = 1;
+        while (idx + run < all_lengths.size() && all_lengths[idx + run] == length)
+        {
+            ++run;
+        }
+
+        if (length == 0 && run >= 3)
+        {
+            auto taken = std::min<size_t>(run, 138);
+            if (taken >= 11)
+            {
+                rle.push_back(rle_symbol{18, static_cast<uint8_t>(taken - 11)});
+            }
+            else
+            {
+                rle.push_back(rle_symbol{17, static_cast<uint8_t>(taken - 3)});
+            }
+            idx += taken;
+        }
+        else if (length != 0 && run >= 4)
+        {
+            rle.push_back(rle_symbol{length, 0});
+            auto taken = std::min<size_t>(run - 1, 6);
+            rle.push_back(rle_symbol{16, static_cast<uint8_t>(taken - 3)});
+            idx += taken + 1;
+        }
+        else
+        {
+            rle.push_back(rle_symbol{length, 0});
+            ++idx;
+        }
+    }
+
+    std::vector<uint32_t> length_frequencies(19, 0);
+    for (const auto& entry : rle)
+    {
+        ++length_frequencies[entry.symbol];
+    }
+    auto length_code = canonical_code(huffman_lengths(length_frequencies, 7));
+
+    static constexpr const uint8_t length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    int num_length_codes = 19;
+    while (num_length_codes > 4 && length_code.lengths[length_order[num_length_codes - 1]] == 0)
+    {
+        --num_length_codes;
+    }
+
+    writer.put_bits(final ? 1 : 0, 1);
+    writer.put_bits(2, 2);
+    writer.put_bits(static_cast<uint32_t>(num_literals - 257), 5);
+    writer.put_bits(static_cast<uint32_t>(num_distances - 1), 5);
+    writer.put_bits(static_cast<uint32_t>(num_length_codes - 4), 4);
+    for (int idx = 0; idx < num_length_codes; ++idx)
+    {
+        writer.put_bits(length_code.lengths[length_order[idx]], 3);
+    }
+    for (const auto& entry : rle)
+    {
+        length_code.put(writer, entry.symbol);
+        if (entry.symbol == 16)
+        {
+            writer.put_bits(entry.extra, 2);
+        }
+        else if (entry.symbol == 17)
+        {
+            writer.put_bits(entry.extra, 3);
+        }
+        else if (entry.symbol == 18)
+        {
+            writer.put_bits(entry.extra, 7);
+        }
+    }
+
+    write_tokens(writer, tokens, count, canonical_code(literal_lengths), canonical_code(distance_lengths));
+}
+
+// Raw deflate blocks of one chunk, appended to out, the stream is left on a byte boundary
+// Only the last chunk of a stream is final
+inline void deflate_chunk(const uint8_t* data, size_t size, png_compression level, bool final, std::vector<uint8_t>& out)
+{
+    deflate_bit_writer writer(out);
+
+    if (level == png_compression::store)
+    {
+        static constexpr const size_t max_stored = 65535;
+        size_t pos = 0;
+        do
+        {
+            auto block = std::min(max_stored, size - pos);
+            auto last = final && pos + block == size;
+            writer.put_bits(last ? 1 : 0, 1);
+            writer.put_bits(0, 2);
+            writer.align_to_byte();
+            writer.put_bits(static_cast<uint32_t>(block), 16);
+            writer.put_bits(static_cast<uint32_t>(~block & 0xffff), 16);
+            out.insert(out.end(), data + pos, data + pos + block);
+            pos += block;
+        } while (pos < size);
+        return;
+    }
+
+    std::vector<lz77_token> tokens;
+    tokens.reserve(size / 2);
+    lz77_parse(data, size, level, tokens);
+
+    // Huffman codes adapt to each block of tokens
+    static constexpr const size_t tokens_per_block = 1 << 15;
+    size_t first = 0;
+    do
+    {
+        auto count = std::min(tokens_per_block, tokens.size() - first);
+        auto last = final && first + count == tokens.size();
+        if (level == png_compression::fast)
+        {
+            write_fixed_block(writer, tokens.data() + first, count, last);
+        }
+        else
+        {
+            write_dynamic_block(writer, tokens.data() + first, count, last);
+        }
+        first += count;
+    } while (first < tokens.size());
+
+    if (!final)
+    {
+        // Empty stored block, ends the chunk on a byte boundary
+        writer.put_bits(0, 3);
+        writer.align_to_byte();
+        writer.put_bits(0x0000, 16);
+        writer.put_bits(0xffff, 16);
+    }
+    writer.align_to_byte();
+}
+
+// PNG
+
+// Filters one row in place into out (filter byte then the filtered bytes), picks the filter with the smallest
+// sum of absolute signed values, the usual heuristic
+inline void filter_row(const uint8_t* row, const uint8_t* previous, size_t row_size, int bytes_per_pixel, bool adaptive, uint8_t* out)
+{
+    auto paeth = [](int a, int b, int c)
+    {
+        auto p = a + b - c;
+        auto pa = std::abs(p - a);
+        auto pb = std::abs(p - b);
+        auto pc = std::abs(p - c);
+        if (pa <= pb && pa <= pc)
+        {
+            return a;
+        }
+        return pb <= pc ? b : c;
+    };
+
+    auto pixel_size = static_cast<size_t>(bytes_per_pixel);
+    auto filtered = [&](int filter, size_t idx)
+    {
+        int a = idx >= pixel_size ? row[idx - pixel_size] : 0;
+        int b = previous ? previous[idx] : 0;
+        int c = previous && idx >= pixel_size ? previous[idx - pixel_size] : 0;
+        int x = row[idx];
+        switch (filter)
+        {
+        case 1: return static_cast<uint8_t>(x - a);
+        case 2: return static_cast<uint8_t>(x - b);
+        case 3: return static_cast<uint8_t>(x - ((a + b) >> 1));
+        case 4: return static_cast<uint8_t>(x - paeth(a, b, c));
+        default: return static_cast<uint8_t>(x);
+        }
+    };
+
+    int best_filter = 0;
+    if (adaptive)
+    {
+        uint64_t best_score = ~uint64_t(0);
+        for (int filter = 0; filter < 5; ++filter)
+        {
+            uint64_t score = 0;
+            for (size_t idx = 0; idx < row_size; ++idx)
+            {
+                score += static_cast<uint64_t>(std::abs(static_cast<int8_t>(filtered(filter, idx))));
+            }
+            if (score < best_score)
+            {
+                best_score = score;
+                best_filter = filter;
+            }
+        }
+    }
+
+    out[0] = static_cast<uint8_t>(best_filter);
+    for (size_t idx = 0; idx < row_size; ++idx)
+    {
+        out[idx + 1] = filtered(best_filter, idx);
+    }
+}
+
+inline void put_be32(std::vector<uint8_t>& out, uint32_t value)
+{
+    out.push_back(static_cast<uint8_t>(value >> 24));
+    out.push_back(static_cast<uint8_t>(value >> 16));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+inline void put_png_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size)
+{
+    put_be32(out, static_cast<uint32_t>(size));
+    auto type_start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_be32(out, crc32_update(0, out.data() + type_start, size + 4));
+}
+
+// 8 bit RGB image, rows top to bottom, chunks of rows are filtered and deflated in parallel on pool
+inline std::vector<uint8_t> encode_png(const uint8_t* rgb, int width, int height, png_compression level, thread_pool& pool)
+{
+    static constexpr const int bytes_per_pixel = 3;
+    // Below this many raw bytes per chunk the chunks' dictionary resets cost more than the parallelism brings
+    static constexpr const size_t min_chunk_bytes = 128 * 1024;
+
+    auto row_size = static_cast<size_t>(width) * bytes_per_pixel;
+    auto rows_per_chunk = std::max<size_t>(1, min_chunk_bytes / (row_size + 1));
+    auto max_chunks = static_cast<size_t>(std::max(1, pool.size() * 4));
+    rows_per_chunk = std::max(rows_per_chunk, (static_cast<size_t>(height) + max_chunks - 1) / max_chunks);
+    auto num_chunks = static_cast<int>((static_cast<size_t>(height) + rows_per_chunk - 1) / rows_per_chunk);
+
+    struct chunk_output
+    {
+        std::vector<uint8_t> deflated;
+        uint32_t adler;
+        size_t raw_size;
+    };
+    std::vector<chunk_output> chunks(static_cast<size_t>(num_chunks));
+
+    pool.parallel_for(num_chunks, [&](int chunk, int /*worker*/)
+    {
+        auto first_row = static_cast<size_t>(chunk) * rows_per_chunk;
+        auto last_row = std::min(static_cast<size_t>(height), first_row + rows_per_chunk);
+
+        std::vector<uint8_t> filtered((last_row - first_row) * (row_size + 1));
+        for (auto row = first_row; row < last_row; ++row)
+        {
+            // Filters read the previous row of the image, even across chunks, only matches stay inside the chunk
+            const uint8_t* previous = row > 0 ? rgb + (row - 1) * row_size : nullptr;
+            filter_row(rgb + row * row_size, previous, row_size, bytes_per_pixel, level != png_compression::store,
+                &filtered[(row - first_row) * (row_size + 1)]);
+        }
+
+        auto& output = chunks[static_cast<size_t>(chunk)];
+        output.raw_size = filtered.size();
+        output.adler = adler32_update(1, filtered.data(), filtered.size());
+        deflate_chunk(filtered.data(), filtered.size(), level, chunk == num_chunks - 1, output.deflated);
+    });
+
+    // zlib stream : header, the concatenated chunks, adler32 of the whole filtered image
+    std::vector<uint8_t> zlib;
+    zlib.push_back(0x78);
+    zlib.push_back(level == png_compression::normal ? 0x9c : 0x01);
+    uint32_t adler = 1;
+    for (const auto& chunk : chunks)
+    {
+        zlib.insert(zlib.end(), chunk.deflated.begin(), chunk.deflated.end());
+        adler = adler32_combine(adler, chunk.adler, chunk.raw_size);
+    }
+    put_be32(zlib, adler);
+
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    std::vector<uint8_t> header;
+    put_be32(header, static_cast<uint32_t>(width));
+    put_be32(header, static_cast<uint32_t>(height));
+    // 8 bits per channel, RGB, deflate, adaptive filtering, no interlacing
+    header.insert(header.end(), {8, 2, 0, 0, 0});
+    put_png_chunk(png, "IHDR", header.data(), header.size());
+    put_png_chunk(png, "IDAT", zlib.data(), zlib.size());
+    put_png_chunk(png, "IEND", nullptr, 0);
+
+    return png;
+}
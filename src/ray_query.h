@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "ray.h"
+#include "renderer.h"
+#include "thread_pool.h"
+#include "vec3.h"
+
+// Rays handed over as separate arrays, entry i of every array belongs to ray i
+// The directions do not need to be normalized, the distances are then in units of the direction's length
+struct ray_batch
+{
+    size_t count = 0;
+    const double* origin_x = nullptr;
+    const double* origin_y = nullptr;
+    const double* origin_z = nullptr;
+    const double* direction_x = nullptr;
+    const double* direction_y = nullptr;
+    const double* direction_z = nullptr;
+    // Optional, time 0 and the range [0, infinity) when left null
+    const double* time = nullptr;
+    const double* t_min = nullptr;
+    const double* t_max = nullptr;
+};
+
+// Arrays of the caller, at least ray_batch::count entries each, written by ray_query
+struct hit_batch
+{
+    // infinity on a miss
+    double* t = nullptr;
+    // Index of the object hit in prepared_scene::scn.world, ray_query::no_primitive on a miss
+    // Building the BVH reorders that list, the indices are those of the prepared scene, not of the scene as made
+    uint32_t* primitive = nullptr;
+    // Optional, the normal at the hit point turned against the ray, left untouched on a miss
+    double* normal_x = nullptr;
+    double* normal_y = nullptr;
+    double* normal_z = nullptr;
+};
+
+// Batched queries against a prepared scene, for programs that want the scene and its BVH without the renderer,
+// visibility or sensor simulations for instance
+// The rays are split in chunks handed to the pool, every ray goes through the same traversal as the renderer's
+// (the four child boxes of a compressed BVH node are tested at once), nothing is allocated per ray.
+// Can run while renders are going on, the chunks are queued on the pool like the rows of a render.
+class ray_query
+{
+public:
+    static constexpr const uint32_t no_primitive = 0xffffffff;
+    // Rays per job handed to the pool
+    static constexpr const size_t chunk_size = 1024;
+
+    ray_query(thread_pool& p, std::shared_ptr<const prepared_scene> s);
+
+    // Closest hit of every ray, returns once the whole batch is done
+    void intersect(const ray_batch& rays, const hit_batch& hits, int priority = 0) const;
+    // blocked[i] is 1 when anything lies on ray i between its t_min and t_max, 0 otherwise
+    void occluded(const ray_batch& rays, uint8_t* blocked, int priority = 0) const;
+
+private:
+    ray make_ray(const ray_batch& rays, size_t idx) const
+    {
+        return ray(
+            point3(rays.origin_x[idx], rays.origin_y[idx], rays.origin_z[idx]),
+            vec3(rays.direction_x[idx], rays.direction_y[idx], rays.direction_z[idx]),
+            rays.time ? rays.time[idx] : 0.0);
+    }
+
+    double t_min(const ray_batch& rays, size_t idx) const { return rays.t_min ? rays.t_min[idx] : 0.0; }
+    double t_max(const ray_batch& rays, size_t idx) const { return rays.t_max ? rays.t_max[idx] : infinity; }
+
+    void check(const ray_batch& rays) const;
+
+    // Calls fn(first, last) for every chunk of count rays, on the pool
+    template<typename Function>
+    void for_each_chunk(size_t count, int priority, const Function& fn) const;
+
+private:
+    thread_pool& pool;
+    std::shared_ptr<const prepared_scene> prepared;
+    // Indices of the objects of the prepared scene's world, what the BVH leaves point to
+    std::unordered_map<const hittable*, uint32_t> primitive_ids;
+};
+
+inline ray_query::ray_query(thread_pool& p, std::shared_ptr<const prepared_scene> s) : pool(p), prepared(std::move(s))
+{
+    const auto& objects = prepared->scn.world.objects;
+    primitive_ids.reserve(objects.size());
+    for (size_t idx = 0; idx < objects.size(); ++idx)
+    {
+        primitive_ids.emplace(objects[idx].get(), static_cast<uint32_t>(idx));
+    }
+}
+
+inline void ray_query::check(const ray_batch& rays) const
+{
+    if (rays.count > 0 && (!rays.origin_x || !rays.origin_y || !rays.origin_z || !rays.direction_x || !rays.direction_y || !rays.direction_z))
+    {
+        throw std::runtime_error("A ray batch needs its origins and directions");
+    }
+}
+
+template<typename Function>
+void ray_query::for_each_chunk(size_t count, int priority, const Function& fn) const
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    std::atomic<int> job_priority{priority};
+    auto num_chunks = static_cast<int>((count + chunk_size - 1) / chunk_size);
+    pool.parallel_for(num_chunks, [&](int chunk, int /*worker*/)
+    {
+        auto first = static_cast<size_t>(chunk) * chunk_size;
+        fn(first, std::min(first + chunk_size, count));
+    }, &job_priority);
+}
+
+inline void ray_query::intersect(const ray_batch& rays, const hit_batch& hits, int priority) const
+{
+    check(rays);
+    if (rays.count > 0 && (!hits.t || !hits.primitive))
+    {
+        throw std::runtime_error("A hit batch needs its distances and primitives");
+    }
+    bool want_normals = hits.normal_x && hits.normal_y && hits.normal_z;
+
+    for_each_chunk(rays.count, priority, [&](size_t first, size_t last)
+    {
+        // One record for the whole chunk, only filled when the normals are asked for
+        hit_record rec;
+        for (size_t idx = first; idx < last; ++idx)
+        {
+            auto r = make_ray(rays, idx);
+            surface_hit closest;
+            if (!prepared->world->intersect(r, t_min(rays, idx), t_max(rays, idx), closest))
+            {
+                hits.t[idx] = infinity;
+                hits.primitive[idx] = no_primitive;
+                continue;
+            }
+
+            hits.t[idx] = closest.t;
+            auto id = primitive_ids.find(closest.primitive);
+            hits.primitive[idx] = id != primitive_ids.end() ? id->second : no_primitive;
+
+            if (want_normals)
+            {
+                closest.primitive->surface_interaction(r, closest, rec);
+                hits.normal_x[idx] = rec.normal.x();
+                hits.normal_y[idx] = rec.normal.y();
+                hits.normal_z[idx] = rec.normal.z();
+            }
+        }
+    });
+}
+
+inline void ray_query::occluded(const ray_batch& rays, uint8_t* blocked, int priority) const
+{
+    check(rays);
+    if (rays.count > 0 && !blocked)
+    {
+        throw std::runtime_error("An occlusion query needs its result array");
+    }
+
+    for_each_chunk(rays.count, priority, [&](size_t first, size_t last)
+    {
+        for (size_t idx = first; idx < last; ++idx)
+        {
+            blocked[idx] = prepared->world->occluded(make_ray(rays, idx), t_min(rays, idx), t_max(rays, idx)) ? 1 : 0;
+        }
+    });
+}
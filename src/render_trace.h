@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Timeline of a render, rows traced by each worker and the passes and denoising run by the thread driving the
+// render, exported in the Chrome trace event format that chrome://tracing and Perfetto open
+// Every thread records into its own ring buffer, no lock nor atomic on the way, once a ring is full its oldest
+// events are overwritten. Rings are only read once the render is over.
+class render_trace
+{
+public:
+    enum class event_kind
+    {
+        row,
+        pass,
+        denoise
+    };
+
+    struct event
+    {
+        event_kind kind;
+        int64_t start_ns;
+        int64_t end_ns;
+        // Row of the view for rows, pass number or view for the others
+        int index;
+        int view;
+        long long samples;
+        long long rays;
+    };
+
+    using trace_clock = std::chrono::steady_clock;
+
+    // One ring per worker and one more, the last one, for the driving thread
+    render_trace(int num_workers, size_t events_per_thread = 1 << 16);
+
+    int driver_thread() const { return static_cast<int>(rings.size()) - 1; }
+
+    int64_t now() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(trace_clock::now() - epoch).count(); }
+
+    // Only ever called by the thread that owns the ring
+    void record(int thread, const event& e)
+    {
+        auto& thread_ring = rings[static_cast<size_t>(thread)];
+        thread_ring.events[thread_ring.next % thread_ring.events.size()] = e;
+        ++thread_ring.next;
+    }
+
+    // thread_names[thread] labels the timeline rows, the workers' CPUs for instance
+    void write_chrome_trace(const std::string& filename, const std::vector<std::string>& thread_names) const;
+
+private:
+    struct ring
+    {
+        std::vector<event> events;
+        size_t next = 0;
+    };
+
+    // Keeps the events of two threads out of the same cache line
+    struct alignas(64) padded_ring : ring {};
+
+    trace_clock::time_point epoch;
+    std::vector<padded_ring> rings;
+};
+
+inline render_trace::render_trace(int num_workers, size_t events_per_thread) : epoch(trace_clock::now()), rings(static_cast<size_t>(num_workers) + 1)
+{
+    for (auto& thread_ring : rings)
+    {
+        thread_ring.events.resize(std::max<size_t>(events_per_thread, 1));
+    }
+}
+
+// Names are free text, quotes, backslashes and control characters would end the JSON string
+inline std::string json_escape(const std::string& text)
+{
+    std::string escaped;
+    for (auto c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(static_cast<unsigned char>(c)));
+            escaped += code;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+inline void render_trace::write_chrome_trace(const std::string& filename, const std::vector<std::string>& thread_names) const
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        throw std::runtime_error("Unable to write trace " + filename);
+    }
+
+    file << std::fixed << std::setprecision(3);
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    auto separator = [&]() -> const char*
+    {
+        auto text = first ? "" : ",\n";
+        first = false;
+        return text;
+    };
+
+    for (size_t thread = 0; thread < rings.size() && thread < thread_names.size(); ++thread)
+    {
+        file << separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+             << ",\"args\":{\"name\":\"" << json_escape(thread_names[thread]) << "\"}}";
+    }
+
+    // Timestamps in microseconds, durations as complete events
+    for (size_t thread = 0; thread < rings.size(); ++thread)
+    {
+        const auto& thread_ring = rings[thread];
+        auto count = std::min(thread_ring.next, thread_ring.events.size());
+        for (size_t idx = thread_ring.next - count; idx < thread_ring.next; ++idx)
+        {
+            const auto& e = thread_ring.events[idx % thread_ring.events.size()];
+            file << separator() << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+                 << ",\"ts\":" << static_cast<double>(e.start_ns) / 1000.0 << ",\"dur\":" << static_cast<double>(e.end_ns - e.start_ns) / 1000.0;
+            switch (e.kind)
+            {
+            case event_kind::row:
+                file << ",\"name\":\"row\",\"cat\":\"render\",\"args\":{\"view\":" << e.view << ",\"row\":" << e.index
+                     << ",\"samples\":" << e.samples << ",\"rays\":" << e.rays << "}}";
+                break;
+            case event_kind::pass:
+                file << ",\"name\":\"pass " << e.index << "\",\"cat\":\"schedule\",\"args\":{\"samples\":" << e.samples
+                     << ",\"rays\":" << e.rays << "}}";
+                break;
+            case event_kind::denoise:
+                file << ",\"name\":\"denoise\",\"cat\":\"schedule\",\"args\":{\"view\":" << e.view << "}}";
+                break;
+            }
+        }
+    }
+
+    file << "\n]}\n";
+}
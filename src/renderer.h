@@ -0,0 +1,866 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "bvh_optimizer.h"
+#include "camera.h"
+#include "color.h"
+#include "compressed_bvh.h"
+#include "denoiser.h"
+#include "first_hit_cache.h"
+#include "grid.h"
+#include "integrator.h"
+#include "lazy_bvh.h"
+#include "options.h"
+#include "ray.h"
+#include "render_trace.h"
+#include "sampler.h"
+#include "scene.h"
+#include "thread_pool.h"
+#include "vec3.h"
+#include "views.h"
+#include "wavefront.h"
+
+// A scene and its BVH, built once then shared by every render of the scene
+class prepared_scene
+{
+public:
+    // lazy_depth > 0 only builds that many levels of the BVH up front, see lazy_bvh_node
+    explicit prepared_scene(scene s, int lazy_depth = 0);
+    // Traces against a grid instead, built on the pool, see grid_accelerator
+    prepared_scene(scene s, grid_kind kind, thread_pool& pool);
+
+    // Improves the BVH for at most budget and returns the number of changes, see bvh_optimizer
+    // Only for a BVH built up front, not while the scene is being rendered
+    int optimize_bvh(std::chrono::duration<double> budget);
+
+    // Replaces the BVH built up front by its compressed copy and frees it, see compressed_bvh
+    const compressed_bvh& compress_bvh();
+
+public:
+    scene scn;
+    // What the rays are traced against and its bounds
+    std::shared_ptr<hittable> world;
+    aabb bounds;
+    // The same tree when it is built up front, null for a lazy or a compressed one
+    std::shared_ptr<bvh_node> bvh;
+    // The same grid when there is one
+    std::shared_ptr<grid_accelerator> grid;
+};
+
+// Part of a view that just got new samples, pixels holds its width * height averaged values row by row and is only
+// valid during the callback
+struct render_tile
+{
+    int view;
+    int x;
+    int y;
+    int width;
+    int height;
+    const color* pixels;
+};
+
+struct render_progress
+{
+    // Passes done so far, a render with a fixed sample count has a single pass
+    int pass;
+    double samples_per_pixel;
+    // Share of the samples or of the time budget done
+    double fraction;
+    double elapsed_seconds;
+    // Rays traced against the scene, camera, bounce, shadow and occlusion rays
+    long long rays;
+    double rays_per_second;
+    // Extrapolated from the throughput so far, the time left with a time budget, denoising not included
+    double eta_seconds;
+};
+
+// on_tile is called by the pool workers, several at once for different tiles of the render
+// on_progress is called after each pass, while no tile of the render is in flight
+struct render_callbacks
+{
+    std::function<void(const render_tile&)> on_tile;
+    std::function<void(const render_progress&)> on_progress;
+};
+
+struct rendered_view
+{
+    // Averaged values, rows top to bottom, denoised when the options ask for it
+    std::vector<color> image;
+    // Only filled when the options need the AOVs
+    std::vector<color> albedo;
+    std::vector<vec3> normal;
+};
+
+struct render_result
+{
+    int width = 0;
+    int height = 0;
+    std::vector<rendered_view> views;
+    // A cancelled render still hands back what it got, pixels without any sample are black
+    bool cancelled = false;
+    double render_seconds = 0.0;
+    // Time to the first complete row, how long the first pixels take to show up
+    double first_row_seconds = 0.0;
+    double denoise_seconds = 0.0;
+    long long total_samples = 0;
+    long long total_rays = 0;
+    int min_samples = 0;
+    int max_samples = 0;
+    // Timeline of the render when the options ask for one
+    std::shared_ptr<const render_trace> trace;
+};
+
+// Shared by a render and its handles
+struct render_control
+{
+    using render_clock = std::chrono::steady_clock;
+
+    std::atomic<bool> cancelled{false};
+    std::atomic<int> priority{0};
+
+    // Set before the render starts, times are counted from the call to renderer::render
+    render_clock::time_point start;
+    double num_pixels = 0.0;
+    // 0 with a time budget
+    int target_samples_per_pixel = 0;
+    double time_budget = 0.0;
+
+    // Counted as the rows complete
+    std::atomic<long long> samples_done{0};
+    std::atomic<long long> rays_done{0};
+    std::atomic<int> passes_done{0};
+
+    render_progress progress() const;
+};
+
+// Handle to a render in flight, copies refer to the same render
+// Like any std::async result, the last handle waits for the render when destroyed, cancel it first to not wait long
+class render_job
+{
+public:
+    // The workers stop at the next pixel and the result comes back early with cancelled set
+    void cancel() { control->cancelled = true; }
+    // Rows of higher priority renders are served first, see thread_pool::parallel_for
+    void set_priority(int priority) { control->priority = priority; }
+    bool done() const { return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+    // Can be polled from any thread while the render runs
+    render_progress progress() const { return control->progress(); }
+    // Waits for the render, rethrows what stopped it if it failed
+    const render_result& get() const { return result.get(); }
+
+public:
+    std::shared_future<render_result> result;
+    std::shared_ptr<render_control> control;
+};
+
+// Runs renders of prepared scenes on a shared pool, each render drives its passes from its own thread and the pool
+// interleaves the rows of every render in flight
+class renderer
+{
+public:
+    explicit renderer(thread_pool& p) : pool(p) {}
+
+    // Starts rendering the views and returns right away
+    // options gives the image size, sampling, integrator and denoising settings, the thread and output ones are ignored
+    render_job render(
+        std::shared_ptr<const prepared_scene> prepared, std::vector<view_spec> views, const render_options& options,
+        render_callbacks callbacks = render_callbacks(), int priority = 0);
+
+private:
+    thread_pool& pool;
+};
+
+// One render, from the allocation of its buffers to the averaged images
+class render_task
+{
+public:
+    render_task(
+        thread_pool& p, std::shared_ptr<const prepared_scene> s, std::vector<view_spec> v, const render_options& o,
+        render_callbacks c, std::shared_ptr<render_control> ctrl);
+
+    render_result run();
+
+private:
+    using render_clock = std::chrono::steady_clock;
+    static constexpr const auto no_deadline = render_clock::time_point::max();
+
+    bool should_stop(render_clock::time_point deadline) const;
+    ray camera_ray(int i, int row, int s, sampler& smp) const;
+    color integrate(const ray& r, sampler& smp, first_hit_aov* aov, long long& rays, surface_hit* first_hit, bool replay_first_hit) const;
+    // Samples and rays of a row
+    struct row_work
+    {
+        long long samples = 0;
+        long long rays = 0;
+    };
+
+    const view_spec& row_view(int row) const { return views[static_cast<size_t>(row / image_height)]; }
+
+    // Columns of the row to render, see view_spec::region
+    const std::vector<std::pair<int, int>>& row_spans(int row) const
+    {
+        const auto& region = row_view(row).region;
+        return region.whole() ? full_row : region.rows[static_cast<size_t>(row % image_height)];
+    }
+
+    // Pixel i of a row in the buffers, or of row y of a view in its slices
+    size_t buffer_index(int row, int i) const
+    {
+        return static_cast<size_t>(row) * static_cast<size_t>(image_width) + static_cast<size_t>(i);
+    }
+
+    row_work process_row(int row, int worker, int pass_samples, render_clock::time_point deadline);
+    row_work process_row_wavefront(int row, int worker, int pass_samples, render_clock::time_point deadline);
+    void report_tile(int row, int worker);
+    void render_pass(int pass_samples, render_clock::time_point deadline);
+    void report_progress();
+    render_result gather_result();
+
+private:
+    thread_pool& pool;
+    std::shared_ptr<const prepared_scene> prepared;
+    std::vector<view_spec> views;
+    render_options options;
+    render_callbacks callbacks;
+    std::shared_ptr<render_control> control;
+
+    std::vector<camera> cameras;
+    std::vector<std::pair<int, int>> full_row;
+    // Indices of the objects of the prepared scene, only filled to record first hits
+    std::unordered_map<const hittable*, uint32_t> primitive_ids;
+    int image_width;
+    int image_height;
+    int num_views;
+    int num_rows;
+    size_t pixels_per_view;
+    bool need_aovs;
+
+    // Sums of the pixel samples, kept in floating point so that the denoiser can work on them, every pixel has
+    // its own sample count as a time budget or a cancellation can stop a pass anywhere
+    // The views are stored one after the other, row r of the buffers is row r % image_height of view r / image_height
+    // Rows are first touched by the workers that render them, so that they live on those workers' node
+    first_touch_array<color> accumulation;
+    first_touch_array<color> albedo_buffer;
+    first_touch_array<vec3> normal_buffer;
+    first_touch_array<int> sample_counts;
+
+    // Per worker
+    std::vector<std::unique_ptr<sampler>> samplers;
+    std::vector<wavefront_batch> batches;
+    std::vector<std::vector<color>> tile_pixels;
+
+    std::shared_ptr<render_trace> trace;
+
+    render_clock::time_point start;
+    std::atomic<bool> first_row_done{false};
+    double first_row_seconds = 0.0;
+};
+
+inline prepared_scene::prepared_scene(scene s, int lazy_depth) : scn(std::move(s))
+{
+    if (lazy_depth > 0)
+    {
+        world = std::make_shared<lazy_bvh_node>(scn.world, scn.time0, scn.time1, lazy_depth);
+    }
+    else
+    {
+        bvh = std::make_shared<bvh_node>(scn.world, scn.time0, scn.time1);
+        world = bvh;
+    }
+    world->bounding_box(scn.time0, scn.time1, bounds);
+}
+
+inline prepared_scene::prepared_scene(scene s, grid_kind kind, thread_pool& pool) : scn(std::move(s))
+{
+    grid = std::make_shared<grid_accelerator>(scn.world, scn.time0, scn.time1, kind, pool);
+    world = grid;
+    world->bounding_box(scn.time0, scn.time1, bounds);
+}
+
+inline int prepared_scene::optimize_bvh(std::chrono::duration<double> budget)
+{
+    if (!bvh)
+    {
+        throw std::runtime_error("Only a BVH built up front can be optimized");
+    }
+    bvh_optimizer optimizer(*bvh, scn.time0, scn.time1);
+    return optimizer.optimize(budget);
+}
+
+inline const compressed_bvh& prepared_scene::compress_bvh()
+{
+    if (!bvh)
+    {
+        throw std::runtime_error("Only a BVH built up front can be compressed");
+    }
+    auto compressed = std::make_shared<compressed_bvh>(*bvh, scn.time0, scn.time1);
+    world = compressed;
+    bvh.reset();
+    return *compressed;
+}
+
+inline render_job renderer::render(
+    std::shared_ptr<const prepared_scene> prepared, std::vector<view_spec> views, const render_options& options,
+    render_callbacks callbacks, int priority)
+{
+    render_job job;
+    job.control = std::make_shared<render_control>();
+    job.control->priority = priority;
+    job.control->start = render_control::render_clock::now();
+    job.control->num_pixels = 0.0;
+    for (const auto& view : views)
+    {
+        job.control->num_pixels += static_cast<double>(view.region.num_pixels(options.image_width, options.image_height()));
+    }
+    job.control->target_samples_per_pixel = options.time_budget > 0.0 ? 0 : options.samples_per_pixel;
+    job.control->time_budget = options.time_budget;
+
+    auto task = std::make_shared<render_task>(pool, std::move(prepared), std::move(views), options, std::move(callbacks), job.control);
+    job.result = std::async(std::launch::async, [task]() { return task->run(); }).share();
+    return job;
+}
+
+inline render_task::render_task(
+    thread_pool& p, std::shared_ptr<const prepared_scene> s, std::vector<view_spec> v, const render_options& o,
+    render_callbacks c, std::shared_ptr<render_control> ctrl)
+    : pool(p), prepared(std::move(s)), views(std::move(v)), options(o), callbacks(std::move(c)), control(std::move(ctrl))
+{
+    image_width = options.image_width;
+    image_height = options.image_height();
+    num_views = static_cast<int>(views.size());
+    num_rows = num_views * image_height;
+    pixels_per_view = static_cast<size_t>(image_width) * static_cast<size_t>(image_height);
+    need_aovs = options.need_aovs();
+    full_row.emplace_back(0, image_width);
+
+    for (const auto& view : views)
+    {
+        cameras.push_back(view.make_camera(prepared->scn, options.aspect_ratio));
+
+        if (!view.region.whole() && static_cast<int>(view.region.rows.size()) != image_height)
+        {
+            throw std::runtime_error("The region of view " + view.name + " does not match the image height");
+        }
+        if (!view.region.whole() && !view.base && options.denoise)
+        {
+            throw std::runtime_error("View " + view.name + " leaves pixels out of its region and has no base to take them from, denoising would blur them in");
+        }
+        if (view.first_hits)
+        {
+            const auto& cache = *view.first_hits;
+            if (cache.width != image_width || cache.height != image_height || cache.samples_per_pixel != options.samples_per_pixel)
+            {
+                throw std::runtime_error("The first hit cache of view " + view.name + " does not match the render");
+            }
+            if (options.time_budget > 0.0 || options.wavefront || options.ambient_occlusion)
+            {
+                throw std::runtime_error("First hits are only cached by the path tracer with a fixed sample count and no wavefront");
+            }
+            if (!cache.recorded && !view.region.whole())
+            {
+                throw std::runtime_error("First hits can only be recorded over whole views");
+            }
+            if (cache.t.size() != cache.sample_count() || cache.primitive.size() != cache.sample_count())
+            {
+                throw std::runtime_error("The first hit cache of view " + view.name + " does not hold a hit per sample");
+            }
+            // Replayed ids index the scene's list, a corrupt file must not reach past it
+            if (cache.recorded)
+            {
+                auto num_objects = prepared->scn.world.objects.size();
+                for (auto id : cache.primitive)
+                {
+                    if (id != first_hit_cache::miss && id >= num_objects)
+                    {
+                        throw std::runtime_error("The first hit cache of view " + view.name + " refers to object " + std::to_string(id)
+                                                 + ", the scene has " + std::to_string(num_objects));
+                    }
+                }
+            }
+            if (!cache.recorded && primitive_ids.empty())
+            {
+                const auto& objects = prepared->scn.world.objects;
+                for (size_t idx = 0; idx < objects.size(); ++idx)
+                {
+                    primitive_ids.emplace(objects[idx].get(), static_cast<uint32_t>(idx));
+                }
+            }
+        }
+        if (view.base && (view.base->image.size() != pixels_per_view || (need_aovs && (view.base->albedo.size() != pixels_per_view || view.base->normal.size() != pixels_per_view))))
+        {
+            throw std::runtime_error("The base image of view " + view.name + " does not match the render");
+        }
+    }
+}
+
+inline render_progress render_control::progress() const
+{
+    render_progress current;
+    current.pass = passes_done.load();
+    current.elapsed_seconds = std::chrono::duration<double>(render_clock::now() - start).count();
+    current.samples_per_pixel = num_pixels > 0.0 ? static_cast<double>(samples_done.load()) / num_pixels : 0.0;
+    current.rays = rays_done.load();
+    current.rays_per_second = static_cast<double>(current.rays) / std::max(current.elapsed_seconds, 1e-6);
+
+    if (target_samples_per_pixel > 0)
+    {
+        current.fraction = std::min(current.samples_per_pixel / target_samples_per_pixel, 1.0);
+        current.eta_seconds = current.fraction > 0.0 ? current.elapsed_seconds * (1.0 - current.fraction) / current.fraction : 0.0;
+    }
+    else
+    {
+        current.fraction = std::min(current.elapsed_seconds / time_budget, 1.0);
+        current.eta_seconds = std::max(time_budget - current.elapsed_seconds, 0.0);
+    }
+    return current;
+}
+
+inline bool render_task::should_stop(render_clock::time_point deadline) const
+{
+    if (control->cancelled.load(std::memory_order_relaxed))
+    {
+        return true;
+    }
+    return deadline != no_deadline && render_clock::now() >= deadline;
+}
+
+// Camera ray of sample s of pixel (i, row), leaves the sampler on that pixel sample
+// The sampler sees the global row so that the views do not all get the same sample patterns
+inline ray render_task::camera_ray(int i, int row, int s, sampler& smp) const
+{
+    auto j = row % image_height;
+    const auto& cam = cameras[static_cast<size_t>(row / image_height)];
+
+    smp.start_pixel_sample(i, row, s);
+    auto pixel_u = smp.get_2d();
+    auto lens_u = smp.get_2d();
+    auto time_u = smp.get_1d();
+
+    auto u = (i + pixel_u.x) / (image_width - 1);
+    // Axis y is inverted in conventional images (a png is written below), invert j
+    auto inverted_j = image_height - 1 - j;
+    auto v = (inverted_j + pixel_u.y) / (image_height - 1);
+    return cam.get_ray(u, v, lens_u.x, lens_u.y, time_u);
+}
+
+// Radiance carried by a camera ray, with the selected integrator
+inline color render_task::integrate(
+    const ray& r, sampler& smp, first_hit_aov* aov, long long& rays, surface_hit* first_hit, bool replay_first_hit) const
+{
+    if (options.ambient_occlusion)
+    {
+        return ambient_occlusion(r, *prepared->world, options.ao_distance, smp, aov, &rays);
+    }
+    return ray_color(r, *prepared->world, prepared->scn, options.max_depth, smp, aov, &rays, first_hit, replay_first_hit);
+}
+
+// Adds pass_samples samples to every pixel of the row, stops at the first pixel reached after the deadline
+// Pixels are only updated once all their samples are done so the counts always match the sums
+inline render_task::row_work render_task::process_row(int row, int worker, int pass_samples, render_clock::time_point deadline)
+{
+    auto& smp = samplers[static_cast<size_t>(worker)];
+    auto* first_hits = row_view(row).first_hits.get();
+    bool replay = first_hits && first_hits->recorded;
+    auto j = row % image_height;
+
+    row_work work;
+    for (const auto& span : row_spans(row))
+    {
+        for (int i = span.first; i < span.second; ++i)
+        {
+            if (should_stop(deadline))
+            {
+                return work;
+            }
+
+            auto pixel_index = buffer_index(row, i);
+            auto first_sample = sample_counts[pixel_index];
+
+            color pixel_color(0, 0, 0);
+            first_hit_aov pixel_aov{color(0, 0, 0), vec3(0, 0, 0)};
+            for (int s = first_sample; s < first_sample + pass_samples; ++s)
+            {
+                ray r = camera_ray(i, row, s, *smp);
+
+                surface_hit first_hit{infinity, nullptr};
+                if (replay)
+                {
+                    auto id = first_hits->primitive[first_hits->index(i, j, s)];
+                    first_hit.t = first_hits->t[first_hits->index(i, j, s)];
+                    first_hit.primitive = id != first_hit_cache::miss ? prepared->scn.world.objects[id].get() : nullptr;
+                }
+
+                if (need_aovs)
+                {
+                    first_hit_aov sample_aov;
+                    pixel_color += integrate(r, *smp, &sample_aov, work.rays, first_hits ? &first_hit : nullptr, replay);
+                    pixel_aov.albedo += sample_aov.albedo;
+                    pixel_aov.normal += sample_aov.normal;
+                }
+                else
+                {
+                    pixel_color += integrate(r, *smp, nullptr, work.rays, first_hits ? &first_hit : nullptr, replay);
+                }
+
+                if (first_hits && !replay)
+                {
+                    first_hits->t[first_hits->index(i, j, s)] = first_hit.t;
+                    first_hits->primitive[first_hits->index(i, j, s)] = first_hit.primitive ? primitive_ids.at(first_hit.primitive) : first_hit_cache::miss;
+                }
+            }
+
+            accumulation[pixel_index] += pixel_color;
+            if (need_aovs)
+            {
+                albedo_buffer[pixel_index] += pixel_aov.albedo;
+                normal_buffer[pixel_index] += pixel_aov.normal;
+            }
+            sample_counts[pixel_index] += pass_samples;
+            work.samples += pass_samples;
+        }
+    }
+    return work;
+}
+
+// Same as process_row with the paths traced in sorted batches, see wavefront.h
+// A batch holds a few samples of every pixel of the row, the deadline is checked between batches
+// Only the path tracer has a wavefront version
+inline render_task::row_work render_task::process_row_wavefront(int row, int worker, int pass_samples, render_clock::time_point deadline)
+{
+    auto& smp = samplers[static_cast<size_t>(worker)];
+    auto& batch = batches[static_cast<size_t>(worker)];
+    const auto& spans = row_spans(row);
+
+    int row_pixels = 0;
+    for (const auto& span : spans)
+    {
+        row_pixels += span.second - span.first;
+    }
+    if (row_pixels == 0)
+    {
+        return row_work();
+    }
+    auto batch_samples = std::max(1, options.wavefront_batch_size / row_pixels);
+
+    row_work work;
+    auto rays_before = batch.rays;
+    for (int done = 0; done < pass_samples; done += batch_samples)
+    {
+        if (should_stop(deadline))
+        {
+            break;
+        }
+
+        auto num_samples = std::min(batch_samples, pass_samples - done);
+        batch.clear();
+        for (const auto& span : spans)
+        {
+            for (int i = span.first; i < span.second; ++i)
+            {
+                auto first_sample = sample_counts[buffer_index(row, i)];
+                for (int s = first_sample; s < first_sample + num_samples; ++s)
+                {
+                    batch.add_path(camera_ray(i, row, s, *smp), i, row, s);
+                }
+            }
+        }
+
+        batch.trace(*prepared->world, prepared->bounds, prepared->scn, options.max_depth, *smp, need_aovs);
+
+        // The paths of the k-th pixel of the spans are k * num_samples onwards
+        size_t path = 0;
+        for (const auto& span : spans)
+        {
+            for (int i = span.first; i < span.second; ++i)
+            {
+                auto pixel_index = buffer_index(row, i);
+                for (int sample = 0; sample < num_samples; ++sample, ++path)
+                {
+                    accumulation[pixel_index] += batch.paths[path].radiance;
+                    if (need_aovs)
+                    {
+                        albedo_buffer[pixel_index] += batch.aovs[path].albedo;
+                        normal_buffer[pixel_index] += batch.aovs[path].normal;
+                    }
+                }
+                sample_counts[pixel_index] += num_samples;
+            }
+        }
+        work.samples += static_cast<long long>(num_samples) * row_pixels;
+    }
+    work.rays = batch.rays - rays_before;
+    return work;
+}
+
+// Hands the current average of a row that was just rendered to on_tile
+inline void render_task::report_tile(int row, int worker)
+{
+    auto& pixels = tile_pixels[static_cast<size_t>(worker)];
+    for (int i = 0; i < image_width; ++i)
+    {
+        auto pixel_index = buffer_index(row, i);
+        auto count = sample_counts[pixel_index];
+        pixels[static_cast<size_t>(i)] = count > 0 ? accumulation[pixel_index] / count : color(0, 0, 0);
+    }
+    callbacks.on_tile(render_tile{row / image_height, 0, row % image_height, image_width, 1, pixels.data()});
+}
+
+inline void render_task::render_pass(int pass_samples, render_clock::time_point deadline)
+{
+    auto pass_start = trace ? trace->now() : 0;
+    auto samples_before = control->samples_done.load();
+    auto rays_before = control->rays_done.load();
+
+    pool.parallel_for(num_rows, [&](int row, int worker)
+    {
+        auto row_start = trace ? trace->now() : 0;
+
+        auto work = (options.wavefront && !options.ambient_occlusion)
+            ? process_row_wavefront(row, worker, pass_samples, deadline)
+            : process_row(row, worker, pass_samples, deadline);
+        control->samples_done.fetch_add(work.samples, std::memory_order_relaxed);
+        control->rays_done.fetch_add(work.rays, std::memory_order_relaxed);
+
+        if (trace)
+        {
+            trace->record(worker, render_trace::event{
+                render_trace::event_kind::row, row_start, trace->now(), row % image_height, row / image_height, work.samples, work.rays});
+        }
+
+        if (!first_row_done.load(std::memory_order_relaxed) && !first_row_done.exchange(true))
+        {
+            first_row_seconds = std::chrono::duration<double>(render_clock::now() - start).count();
+        }
+
+        if (callbacks.on_tile && !row_spans(row).empty())
+        {
+            report_tile(row, worker);
+        }
+    }, &control->priority);
+
+    auto pass_number = ++control->passes_done;
+    if (trace)
+    {
+        trace->record(trace->driver_thread(), render_trace::event{
+            render_trace::event_kind::pass, pass_start, trace->now(), pass_number, 0,
+            control->samples_done.load() - samples_before, control->rays_done.load() - rays_before});
+    }
+}
+
+inline void render_task::report_progress()
+{
+    if (callbacks.on_progress)
+    {
+        callbacks.on_progress(control->progress());
+    }
+}
+
+inline render_result render_task::run()
+{
+    auto num_pixels = views.size() * pixels_per_view;
+    accumulation = first_touch_array<color>(num_pixels);
+    albedo_buffer = first_touch_array<color>(need_aovs ? num_pixels : 0);
+    normal_buffer = first_touch_array<vec3>(need_aovs ? num_pixels : 0);
+    sample_counts = first_touch_array<int>(num_pixels);
+    accumulation.construct(pool, num_rows);
+    sample_counts.construct(pool, num_rows);
+    albedo_buffer.construct(pool, num_rows);
+    normal_buffer.construct(pool, num_rows);
+
+    for (int worker = 0; worker < pool.size(); ++worker)
+    {
+        samplers.push_back(make_sampler(options.sampler_name, options.samples_per_pixel));
+    }
+    auto num_workers = static_cast<size_t>(pool.size());
+    batches.resize(options.wavefront ? num_workers : 0);
+    tile_pixels.assign(callbacks.on_tile ? num_workers : 0, std::vector<color>(static_cast<size_t>(image_width)));
+    if (!options.trace_file.empty())
+    {
+        trace = std::make_shared<render_trace>(pool.size());
+    }
+
+    start = render_clock::now();
+
+    if (options.time_budget <= 0.0)
+    {
+        render_pass(options.samples_per_pixel, no_deadline);
+        report_progress();
+    }
+    else
+    {
+        // Progressive passes over the regions until the budget runs out, each pass is sized from the measured
+        // throughput so that it takes at most a quarter of the remaining time, the last one is cut at the deadline
+        // A pass only costs the pixels of the regions, at least one so that empty regions keep the passes small
+        auto budget = std::chrono::duration_cast<render_clock::duration>(std::chrono::duration<double>(options.time_budget));
+        auto deadline = start + budget;
+        auto pass_pixels = std::max(control->num_pixels, 1.0);
+
+        // The first pass completes unless cancelled so that every pixel has at least one sample
+        render_pass(1, no_deadline);
+        report_progress();
+        int pass_samples = 1;
+
+        while (!control->cancelled)
+        {
+            auto now = render_clock::now();
+            if (now >= deadline)
+            {
+                break;
+            }
+
+            auto elapsed = std::chrono::duration<double>(now - start).count();
+            auto remaining = std::chrono::duration<double>(deadline - now).count();
+            auto samples_per_second = static_cast<double>(control->samples_done.load()) / std::max(elapsed, 1e-6);
+
+            pass_samples *= 2;
+            while (pass_samples > 1 && pass_samples * pass_pixels / samples_per_second > remaining / 4)
+            {
+                pass_samples /= 2;
+            }
+
+            render_pass(pass_samples, deadline);
+            report_progress();
+        }
+
+        if (!control->cancelled && render_clock::now() > deadline + std::chrono::milliseconds(100))
+        {
+            std::cerr << "The first pass alone did not fit in the time budget" << std::endl;
+        }
+    }
+
+    return gather_result();
+}
+
+inline render_result render_task::gather_result()
+{
+    render_result result;
+    result.width = image_width;
+    result.height = image_height;
+    result.cancelled = control->cancelled;
+    result.render_seconds = std::chrono::duration<double>(render_clock::now() - start).count();
+    result.first_row_seconds = first_row_seconds;
+    result.total_rays = control->rays_done.load();
+
+    // Over the pixels that were to be rendered
+    bool first_pixel = true;
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (const auto& span : row_spans(row))
+        {
+            for (int i = span.first; i < span.second; ++i)
+            {
+                auto count = sample_counts[buffer_index(row, i)];
+                result.total_samples += count;
+                result.min_samples = first_pixel ? count : std::min(result.min_samples, count);
+                result.max_samples = first_pixel ? count : std::max(result.max_samples, count);
+                first_pixel = false;
+            }
+        }
+    }
+
+    // From sums to averages, each pixel by its own sample count
+    pool.parallel_for(num_rows, [&](int row, int /*worker*/)
+    {
+        for (int i = 0; i < image_width; ++i)
+        {
+            auto pixel_index = buffer_index(row, i);
+            auto count = sample_counts[pixel_index];
+            auto scale = count > 0 ? 1.0 / count : 0.0;
+            accumulation[pixel_index] *= scale;
+            if (need_aovs)
+            {
+                albedo_buffer[pixel_index] *= scale;
+                normal_buffer[pixel_index] *= scale;
+            }
+        }
+    }, &control->priority);
+
+    for (int view = 0; view < num_views; ++view)
+    {
+        auto view_accumulation = view_slice(accumulation, view, pixels_per_view);
+        auto view_albedo = view_slice(albedo_buffer, view, need_aovs ? pixels_per_view : 0);
+        auto view_normal = view_slice(normal_buffer, view, need_aovs ? pixels_per_view : 0);
+
+        // Pixels left out of the region come from the base
+        const auto& spec = views[static_cast<size_t>(view)];
+        if (spec.base && !spec.region.whole())
+        {
+            for (int y = 0; y < image_height; ++y)
+            {
+                int i = 0;
+                auto copy_base_until = [&](int end)
+                {
+                    for (; i < end; ++i)
+                    {
+                        auto pixel_index = buffer_index(y, i);
+                        view_accumulation[pixel_index] = spec.base->image[pixel_index];
+                        if (need_aovs)
+                        {
+                            view_albedo[pixel_index] = spec.base->albedo[pixel_index];
+                            view_normal[pixel_index] = spec.base->normal[pixel_index];
+                        }
+                    }
+                };
+                for (const auto& span : spec.region.rows[static_cast<size_t>(y)])
+                {
+                    copy_base_until(span.first);
+                    i = span.second;
+                }
+                copy_base_until(image_width);
+            }
+        }
+
+        rendered_view rendered;
+        // The AOVs are handed back as gathered, before they guide the denoiser
+        rendered.albedo.assign(view_albedo.data(), view_albedo.data() + view_albedo.size());
+        rendered.normal.assign(view_normal.data(), view_normal.data() + view_normal.size());
+
+        if (options.denoise)
+        {
+            auto denoise_start = render_clock::now();
+            auto trace_start = trace ? trace->now() : 0;
+
+            atrous_denoiser denoiser(options.denoise_iterations);
+            denoiser.denoise(view_accumulation, view_albedo, view_normal, image_width, image_height, pool);
+
+            result.denoise_seconds += std::chrono::duration<double>(render_clock::now() - denoise_start).count();
+            if (trace)
+            {
+                trace->record(trace->driver_thread(), render_trace::event{
+                    render_trace::event_kind::denoise, trace_start, trace->now(), view, view, 0, 0});
+            }
+        }
+
+        rendered.image.assign(view_accumulation.data(), view_accumulation.data() + view_accumulation.size());
+        result.views.push_back(std::move(rendered));
+    }
+
+    // A cancelled render left samples out
+    if (!result.cancelled)
+    {
+        for (auto& view : views)
+        {
+            if (view.first_hits)
+            {
+                view.first_hits->recorded = true;
+            }
+        }
+    }
+
+    result.trace = trace;
+    return result;
+}
@@ -3,6 +3,8 @@
 #include <limits>
 #include <random>
 
+#include "simd_random.h"
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -15,17 +17,10 @@ inline double degrees_to_radians(double degrees)
     return degrees * pi / 180.0;
 }
 
-// This is not threadsafe, rand() is thread safe depending on implementation
-// I'm not going to fight for this for now
+// Read from the calling thread's buffer, see simd_random.h
 inline double random_double()
 {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    static auto rand_generator = [&]()
-    {
-        return distribution(generator);
-    };
-    return rand_generator();
+    return random_batch::thread_instance().next_double();
 }
 
 inline double random_double(double min, double max)
@@ -0,0 +1,502 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+
+struct point2
+{
+    double x;
+    double y;
+};
+
+// Dimension layout of a path sample
+// The camera draws the pixel (2D), lens (2D) and time (1D) dimensions in that order, then every bounce gets a fixed
+// block of light (2D), bsdf (2D) and lobe (1D) dimensions, whether the material needs them or not. That way a given
+// dimension always feeds the same decision and the low discrepancy samplers stay well distributed.
+static constexpr const int camera_dimensions = 5;
+static constexpr const int bounce_dimensions = 5;
+
+// Generates the sample values of a path, start_pixel_sample must be called before each camera ray
+// Samplers hold per path state, each render thread owns its own
+class sampler
+{
+public:
+    virtual ~sampler() {}
+
+    void start_pixel_sample(int x, int y, int index)
+    {
+        pixel_x = x;
+        pixel_y = y;
+        sample_index = index;
+        dimension = 0;
+    }
+
+    void start_bounce(int bounce)
+    {
+        dimension = camera_dimensions + bounce * bounce_dimensions;
+    }
+
+    double get_1d()
+    {
+        return sample_1d(dimension++);
+    }
+
+    point2 get_2d()
+    {
+        auto result = sample_2d(dimension);
+        dimension += 2;
+        return result;
+    }
+
+protected:
+    virtual double sample_1d(int dim) = 0;
+    virtual point2 sample_2d(int dim) = 0;
+
+protected:
+    int pixel_x = 0;
+    int pixel_y = 0;
+    int sample_index = 0;
+    int dimension = 0;
+};
+
+// Hashing helpers, all samplers but the independent one are stateless functions of (pixel, index, dimension)
+
+inline uint32_t hash_uint32(uint32_t x)
+{
+    // lowbias32 from https://nullprogram.com/blog/2018/07/31/
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t value)
+{
+    return hash_uint32(seed ^ (value + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+inline uint32_t pixel_seed(int x, int y, uint32_t seed)
+{
+    return hash_combine(hash_combine(seed, static_cast<uint32_t>(x)), static_cast<uint32_t>(y));
+}
+
+// [0, 1) double from the 32 bits of x
+inline double uint32_to_unit(uint32_t x)
+{
+    return x * (1.0 / 4294967296.0);
+}
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+    x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+    x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+    x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+    return x;
+}
+
+// Element i of a pseudo random permutation of [0, l) selected by p
+// See Kensler 2013, Correlated Multi-Jittered Sampling
+inline uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;
+        i *= 0xe170893dU;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3fU;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69U;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303U;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3U;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfU;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+// Sobol sequence, first two dimensions, both (0,2) sequences together
+// Results are 0.32 fixed point numbers
+inline uint32_t sobol_dimension_0(uint32_t index)
+{
+    return reverse_bits(index);
+}
+
+inline uint32_t sobol_dimension_1(uint32_t index)
+{
+    uint32_t result = 0;
+    for (uint32_t v = 1U << 31; index; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+        {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+// Owen scrambling through a hash, see Burley 2020, Practical Hash-based Owen Scrambling
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cU;
+    x ^= x * 0xb82f1e52U;
+    x ^= x * 0xc7afe638U;
+    x ^= x * 0x8d22f6e6U;
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x = laine_karras_permutation(x, seed);
+    x = reverse_bits(x);
+    return x;
+}
+
+// Plain Monte Carlo, what process_rows used to do with random_double()
+class independent_sampler : public sampler
+{
+protected:
+    virtual double sample_1d(int /*dim*/) { return random_double(); }
+
+    virtual point2 sample_2d(int /*dim*/)
+    {
+        auto x = random_double();
+        auto y = random_double();
+        return point2{x, y};
+    }
+};
+
+// Jittered strata, each dimension of each pixel visits the strata in its own random order
+// Sample indices past samples_per_pixel start a new round of strata
+class stratified_sampler : public sampler
+{
+public:
+    stratified_sampler(int samples_per_pixel, uint32_t s = 0)
+        : spp(static_cast<uint32_t>(samples_per_pixel)), seed(s)
+    {
+        x_strata = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(spp))));
+        y_strata = (spp + x_strata - 1) / x_strata;
+    }
+
+protected:
+    uint32_t dimension_seed(int dim) const
+    {
+        auto round = static_cast<uint32_t>(sample_index) / spp;
+        return hash_combine(hash_combine(pixel_seed(pixel_x, pixel_y, seed), static_cast<uint32_t>(dim)), round);
+    }
+
+    double jitter(uint32_t dim_seed, uint32_t axis) const
+    {
+        return uint32_to_unit(hash_combine(hash_combine(dim_seed, static_cast<uint32_t>(sample_index)), axis));
+    }
+
+    virtual double sample_1d(int dim)
+    {
+        auto dim_seed = dimension_seed(dim);
+        auto stratum = permute(static_cast<uint32_t>(sample_index) % spp, spp, dim_seed);
+        return (stratum + jitter(dim_seed, 0)) / spp;
+    }
+
+    virtual point2 sample_2d(int dim)
+    {
+        auto dim_seed = dimension_seed(dim);
+        auto num_strata = x_strata * y_strata;
+        // When spp is not a perfect square some strata are left empty, which ones changes per pixel
+        auto stratum = permute(static_cast<uint32_t>(sample_index) % spp, num_strata, dim_seed);
+        auto x = (stratum % x_strata + jitter(dim_seed, 0)) / x_strata;
+        auto y = (stratum / x_strata + jitter(dim_seed, 1)) / y_strata;
+        return point2{x, y};
+    }
+
+private:
+    uint32_t spp;
+    uint32_t seed;
+    uint32_t x_strata;
+    uint32_t y_strata;
+};
+
+// Owen scrambled Sobol points, every 2D dimension pair uses the first two Sobol dimensions with its own
+// scrambling and its own shuffled index order so that the pairs are decorrelated (padding)
+class sobol_sampler : public sampler
+{
+public:
+    sobol_sampler(uint32_t s = 0) : seed(s) {}
+
+protected:
+    uint32_t dimension_seed(int dim) const
+    {
+        return hash_combine(pixel_seed(pixel_x, pixel_y, seed), static_cast<uint32_t>(dim));
+    }
+
+    virtual double sample_1d(int dim)
+    {
+        auto dim_seed = dimension_seed(dim);
+        auto index = nested_uniform_scramble(static_cast<uint32_t>(sample_index), dim_seed);
+        return uint32_to_unit(nested_uniform_scramble(sobol_dimension_0(index), hash_uint32(dim_seed)));
+    }
+
+    virtual point2 sample_2d(int dim)
+    {
+        auto dim_seed = dimension_seed(dim);
+        auto index = nested_uniform_scramble(static_cast<uint32_t>(sample_index), dim_seed);
+        auto x = nested_uniform_scramble(sobol_dimension_0(index), hash_combine(dim_seed, 0));
+        auto y = nested_uniform_scramble(sobol_dimension_1(index), hash_combine(dim_seed, 1));
+        return point2{uint32_to_unit(x), uint32_to_unit(y)};
+    }
+
+private:
+    uint32_t seed;
+};
+
+// Blue noise dither mask built with the void and cluster method, see Ulichney 1993
+// Values are the ranks of the pixels in [0, 1), neighbouring pixels have values far apart
+class blue_noise_texture
+{
+public:
+    static constexpr const int size = 64;
+
+    blue_noise_texture(uint32_t seed = 0);
+
+    double value(int x, int y) const
+    {
+        return values[static_cast<size_t>((y & (size - 1)) * size + (x & (size - 1)))];
+    }
+
+    // Built once and shared by all threads
+    static const blue_noise_texture& instance()
+    {
+        static const blue_noise_texture texture;
+        return texture;
+    }
+
+private:
+    std::vector<double> values;
+};
+
+inline blue_noise_texture::blue_noise_texture(uint32_t seed)
+{
+    static constexpr const size_t num_pixels = size * size;
+    static constexpr const double sigma = 1.5;
+
+    auto pixel_index = [](int x, int y) { return static_cast<size_t>(y * size + x); };
+
+    // Gaussian energy contribution for every toroidal offset
+    std::vector<double> kernel(num_pixels);
+    for (int dy = 0; dy < size; ++dy)
+    {
+        for (int dx = 0; dx < size; ++dx)
+        {
+            auto wrapped_x = std::min(dx, size - dx);
+            auto wrapped_y = std::min(dy, size - dy);
+            kernel[pixel_index(dx, dy)] = std::exp(-(wrapped_x * wrapped_x + wrapped_y * wrapped_y) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<char> pattern(num_pixels, 0);
+    std::vector<double> energy(num_pixels, 0.0);
+
+    auto splat = [&](std::vector<double>& field, size_t idx, double sign)
+    {
+        auto px = static_cast<int>(idx % size);
+        auto py = static_cast<int>(idx / size);
+        for (int y = 0; y < size; ++y)
+        {
+            auto ky = ((y - py) + size) % size;
+            for (int x = 0; x < size; ++x)
+            {
+                auto kx = ((x - px) + size) % size;
+                field[pixel_index(x, y)] += sign * kernel[pixel_index(kx, ky)];
+            }
+        }
+    };
+
+    // Highest energy minority pixel or lowest energy majority pixel
+    auto find = [&](const std::vector<double>& field, char state, bool highest)
+    {
+        auto best = num_pixels;
+        for (size_t idx = 0; idx < num_pixels; ++idx)
+        {
+            if (pattern[idx] != state)
+            {
+                continue;
+            }
+            if (best == num_pixels || (highest ? field[idx] > field[best] : field[idx] < field[best]))
+            {
+                best = idx;
+            }
+        }
+        return best;
+    };
+
+    // Initial binary pattern, a tenth of the pixels
+    std::mt19937 generator(seed);
+    std::uniform_int_distribution<int> distribution(0, static_cast<int>(num_pixels) - 1);
+    size_t num_ones = 0;
+    while (num_ones < num_pixels / 10)
+    {
+        auto idx = static_cast<size_t>(distribution(generator));
+        if (!pattern[idx])
+        {
+            pattern[idx] = 1;
+            splat(energy, idx, 1.0);
+            ++num_ones;
+        }
+    }
+
+    // Move points from the tightest clusters to the largest voids until it converges
+    while (true)
+    {
+        auto cluster = find(energy, 1, true);
+        pattern[cluster] = 0;
+        splat(energy, cluster, -1.0);
+
+        auto void_idx = find(energy, 0, false);
+        pattern[void_idx] = 1;
+        splat(energy, void_idx, 1.0);
+
+        if (void_idx == cluster)
+        {
+            break;
+        }
+    }
+
+    std::vector<size_t> rank(num_pixels, 0);
+    auto prototype = pattern;
+    auto prototype_energy = energy;
+
+    // Phase 1, remove the prototype points cluster first, they get the lowest ranks
+    for (auto r = num_ones; r-- > 0; )
+    {
+        auto cluster = find(energy, 1, true);
+        pattern[cluster] = 0;
+        splat(energy, cluster, -1.0);
+        rank[cluster] = r;
+    }
+
+    // Phase 2, fill the largest voids up to half the pixels
+    pattern = prototype;
+    energy = prototype_energy;
+    auto r = num_ones;
+    for (; r < num_pixels / 2; ++r)
+    {
+        auto void_idx = find(energy, 0, false);
+        pattern[void_idx] = 1;
+        splat(energy, void_idx, 1.0);
+        rank[void_idx] = r;
+    }
+
+    // Phase 3, zeros are now the minority, the tightest cluster of zeros is filled first
+    std::vector<double> zero_energy(num_pixels, 0.0);
+    for (size_t idx = 0; idx < num_pixels; ++idx)
+    {
+        if (!pattern[idx])
+        {
+            splat(zero_energy, idx, 1.0);
+        }
+    }
+    for (; r < num_pixels; ++r)
+    {
+        auto cluster = find(zero_energy, 0, true);
+        pattern[cluster] = 1;
+        splat(zero_energy, cluster, -1.0);
+        rank[cluster] = r;
+    }
+
+    values.resize(num_pixels);
+    for (size_t idx = 0; idx < num_pixels; ++idx)
+    {
+        values[idx] = (static_cast<double>(rank[idx]) + 0.5) / static_cast<double>(num_pixels);
+    }
+}
+
+// Sobol points shared by all pixels, decorrelated per pixel by a Cranley-Patterson rotation read from a blue
+// noise mask, see Georgiev and Fajardo 2016, Blue-noise Dithered Sampling
+// At low sample counts the error is pushed to high frequencies, which the eye and the denoiser handle better
+class blue_noise_sampler : public sampler
+{
+public:
+    blue_noise_sampler(uint32_t s = 0) : seed(s), texture(blue_noise_texture::instance()) {}
+
+protected:
+    // Each dimension reads the mask at its own offset
+    double rotation(int dim) const
+    {
+        auto offset = hash_combine(seed, static_cast<uint32_t>(dim));
+        return texture.value(pixel_x + static_cast<int>(offset & 0xffff), pixel_y + static_cast<int>(offset >> 16));
+    }
+
+    static double wrap(double x)
+    {
+        return x >= 1.0 ? x - 1.0 : x;
+    }
+
+    virtual double sample_1d(int dim)
+    {
+        auto dim_seed = hash_combine(seed, static_cast<uint32_t>(dim));
+        auto index = nested_uniform_scramble(static_cast<uint32_t>(sample_index), dim_seed);
+        auto x = uint32_to_unit(nested_uniform_scramble(sobol_dimension_0(index), hash_uint32(dim_seed)));
+        return wrap(x + rotation(dim));
+    }
+
+    virtual point2 sample_2d(int dim)
+    {
+        auto dim_seed = hash_combine(seed, static_cast<uint32_t>(dim));
+        auto index = nested_uniform_scramble(static_cast<uint32_t>(sample_index), dim_seed);
+        auto x = uint32_to_unit(nested_uniform_scramble(sobol_dimension_0(index), hash_combine(dim_seed, 0)));
+        auto y = uint32_to_unit(nested_uniform_scramble(sobol_dimension_1(index), hash_combine(dim_seed, 1)));
+        return point2{wrap(x + rotation(dim)), wrap(y + rotation(dim + 1))};
+    }
+
+private:
+    uint32_t seed;
+    const blue_noise_texture& texture;
+};
+
+inline std::unique_ptr<sampler> make_sampler(const std::string& name, int samples_per_pixel, uint32_t seed = 0)
+{
+    if (name == "independent")
+    {
+        return std::make_unique<independent_sampler>();
+    }
+    else if (name == "stratified")
+    {
+        return std::make_unique<stratified_sampler>(samples_per_pixel, seed);
+    }
+    else if (name == "sobol")
+    {
+        return std::make_unique<sobol_sampler>(seed);
+    }
+    else if (name == "bluenoise")
+    {
+        return std::make_unique<blue_noise_sampler>(seed);
+    }
+
+    throw std::runtime_error("Unknown sampler : " + name);
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "rtweekend.h"
+
+#include "hittable_list.h"
+#include "material.h"
+#include "moving_sphere.h"
+#include "ray.h"
+#include "sphere.h"
+#include "vec3.h"
+
+// What a scene needs besides its objects, emitters are also listed in lights for next event estimation
+struct scene
+{
+    hittable_list world;
+    hittable_list lights;
+
+    // Sky gradient when true, constant background otherwise
+    bool sky = true;
+    color background = color(0, 0, 0);
+
+    // Camera with exposure time
+    point3 lookfrom = point3(13, 2, 3);
+    point3 lookat = point3(0, 0, 0);
+    vec3 vup = vec3(0, 1, 0);
+    double vfov = 20.0;
+    double dist_to_focus = 10.0;
+    double aperture = 0.0;
+    double time0 = 0.0;
+    double time1 = 1.0;
+
+    color background_color(const ray& r) const
+    {
+        if (!sky)
+        {
+            return background;
+        }
+        vec3 unit_direction = unit_vector(r.direction());
+        auto t = 0.5 * (unit_direction.y() + 1.0);
+        return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+    }
+};
+
+inline void add_random_spheres(hittable_list& world)
+{
+    for (int a = -10; a < 10; a++)
+    {
+        for (int b = -10; b < 10; b++)
+        {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+            if ((center - vec3(4, 0.2, 0)).length() > 0.9)
+            {
+                if (choose_mat < 0.8)
+                {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    world.add(std::make_shared<moving_sphere>(
+                        center, center + vec3(0, random_double(0.0, 0.5), 0.0), 0.0, 1.0, 0.2,
+                        std::make_shared<lambertian>(albedo)));
+                }
+                else if (choose_mat < 0.95)
+                {
+                    // metal
+                    auto albedo = color::random(0.5, 1.0);
+                    auto fuzz = random_double(0.0, 0.5);
+                    world.add(
+                        std::make_shared<sphere>(center, 0.2, std::make_shared<metal>(albedo, fuzz)));
+                }
+                else
+                {
+                    // glass
+                    world.add(std::make_shared<sphere>(center, 0.2, std::make_shared<dielectric>(1.5)));
+                }
+            }
+        }
+    }
+}
+
+inline scene random_scene()
+{
+    scene result;
+    auto& world = result.world;
+
+    world.add(std::make_shared<sphere>(point3(0, -1000, 0), 1000, std::make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+
+    add_random_spheres(world);
+
+    world.add(std::make_shared<sphere>(point3(0, 1, 0), 1.0, std::make_shared<dielectric>(1.5)));
+    world.add(std::make_shared<sphere>(point3(-4, 1, 0), 1.0, std::make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    world.add(std::make_shared<sphere>(point3(4, 1, 0), 1.0, std::make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    return result;
+}
+
+// Same spheres at night, only lit by a few small emitters, the case next event estimation is for
+inline scene lights_scene()
+{
+    scene result;
+    result.sky = false;
+    result.background = color(0, 0, 0);
+
+    auto& world = result.world;
+
+    world.add(std::make_shared<sphere>(point3(0, -1000, 0), 1000, std::make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+
+    add_random_spheres(world);
+
+    world.add(std::make_shared<sphere>(point3(0, 1, 0), 1.0, std::make_shared<dielectric>(1.5)));
+    world.add(std::make_shared<sphere>(point3(-4, 1, 0), 1.0, std::make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    world.add(std::make_shared<sphere>(point3(4, 1, 0), 1.0, std::make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    auto add_light = [&](const point3& center, double radius, const color& emit)
+    {
+        auto light = std::make_shared<sphere>(center, radius, std::make_shared<diffuse_light>(emit));
+        world.add(light);
+        result.lights.add(light);
+    };
+
+    add_light(point3(0, 3.5, 0), 0.25, color(60, 55, 45));
+    add_light(point3(-4, 2.5, 2), 0.15, color(80, 30, 10));
+    add_light(point3(4, 2.5, -2), 0.15, color(10, 30, 80));
+    add_light(point3(8, 1.0, 3), 0.1, color(100, 100, 100));
+
+    return result;
+}
+
+inline scene make_scene(const std::string& name)
+{
+    if (name == "random")
+    {
+        return random_scene();
+    }
+    else if (name == "lights")
+    {
+        return lights_scene();
+    }
+
+    throw std::runtime_error("Unknown scene : " + name);
+}
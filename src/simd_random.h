@@ -0,0 +1,263 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// No warnings from external headers
+#pragma warning(push, 0)
+
+#include <vectorclass.h>
+#include <vectormath_exp.h>
+#include <vectormath_trig.h>
+
+#pragma warning(pop)
+
+// Vectorized random numbers and sampling warps on the vectorclass types
+// Everything here is branch free, four lanes are generated and warped at once and the results are buffered per
+// thread so that the scalar random_* helpers only read memory. The wavefront renderer feeds the sampler's values
+// of a whole bounce through the same warps, see warp_bsdf_samples.
+
+inline uint64_t splitmix64(uint64_t& state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Four independent xoshiro256+ streams, one per lane, see https://prng.di.unimi.it/
+class xoshiro256plus_x4
+{
+public:
+    xoshiro256plus_x4(uint64_t seed)
+    {
+        uint64_t state[4][4];
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            for (int word = 0; word < 4; ++word)
+            {
+                state[word][lane] = splitmix64(seed);
+            }
+        }
+        s0.load(state[0]);
+        s1.load(state[1]);
+        s2.load(state[2]);
+        s3.load(state[3]);
+    }
+
+    Vec4uq next()
+    {
+        Vec4uq result = s0 + s3;
+        Vec4uq t = s1 << 17;
+
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = (s3 << 45) | (s3 >> 19);
+
+        return result;
+    }
+
+    // Uniform in [0, 1), the top 52 bits become the mantissa of a double in [1, 2)
+    Vec4d next_double()
+    {
+        Vec4uq bits = (next() >> 12) | Vec4uq(0x3ff0000000000000ULL);
+        return reinterpret_d(bits) - Vec4d(1.0);
+    }
+
+private:
+    Vec4uq s0, s1, s2, s3;
+};
+
+// Closed form warps of four uniform samples at once
+
+// Concentric mapping of the unit square onto the unit disk, see Shirley and Chiu 1997
+inline void warp_unit_disk(Vec4d u1, Vec4d u2, Vec4d& x, Vec4d& y)
+{
+    static constexpr const double quarter_pi = 0.78539816339744830962;
+    static constexpr const double half_pi = 1.57079632679489661923;
+
+    Vec4d a = u1 * 2.0 - 1.0;
+    Vec4d b = u2 * 2.0 - 1.0;
+    Vec4db a_major = abs(a) > abs(b);
+
+    // The divisors can only be 0 when both a and b are, r is 0 then and theta does not matter
+    Vec4d safe_a = select(a == Vec4d(0.0), Vec4d(1.0), a);
+    Vec4d safe_b = select(b == Vec4d(0.0), Vec4d(1.0), b);
+
+    Vec4d r = select(a_major, a, b);
+    Vec4d theta = select(a_major, quarter_pi * (b / safe_a), half_pi - quarter_pi * (a / safe_b));
+
+    Vec4d cos_theta;
+    Vec4d sin_theta = sincos(&cos_theta, theta);
+    x = r * cos_theta;
+    y = r * sin_theta;
+}
+
+inline void warp_unit_sphere_surface(Vec4d u1, Vec4d u2, Vec4d& x, Vec4d& y, Vec4d& z)
+{
+    static constexpr const double two_pi = 6.28318530717958647692;
+
+    z = 1.0 - 2.0 * u2;
+    Vec4d r = sqrt(max(Vec4d(0.0), 1.0 - z * z));
+    Vec4d cos_phi;
+    Vec4d sin_phi = sincos(&cos_phi, two_pi * u1);
+    x = r * cos_phi;
+    y = r * sin_phi;
+}
+
+// Uniform in the ball, the radius follows the cube root of u3
+inline void warp_in_unit_sphere(Vec4d u1, Vec4d u2, Vec4d u3, Vec4d& x, Vec4d& y, Vec4d& z)
+{
+    warp_unit_sphere_surface(u1, u2, x, y, z);
+    Vec4d radius = cbrt(u3);
+    x *= radius;
+    y *= radius;
+    z *= radius;
+}
+
+// Hemispheres are around +z
+inline void warp_uniform_hemisphere(Vec4d u1, Vec4d u2, Vec4d& x, Vec4d& y, Vec4d& z)
+{
+    static constexpr const double two_pi = 6.28318530717958647692;
+
+    z = u2;
+    Vec4d r = sqrt(max(Vec4d(0.0), 1.0 - z * z));
+    Vec4d cos_phi;
+    Vec4d sin_phi = sincos(&cos_phi, two_pi * u1);
+    x = r * cos_phi;
+    y = r * sin_phi;
+}
+
+// Malley's method, a concentric disk sample lifted onto the hemisphere
+inline void warp_cosine_hemisphere(Vec4d u1, Vec4d u2, Vec4d& x, Vec4d& y, Vec4d& z)
+{
+    warp_unit_disk(u1, u2, x, y);
+    z = sqrt(max(Vec4d(0.0), 1.0 - x * x - y * y));
+}
+
+// Per thread buffers of uniform numbers and warped samples, refilled four lanes at a time
+class random_batch
+{
+public:
+    static constexpr const int batch_size = 256;
+
+    random_batch(uint64_t seed) : generator(seed) {}
+
+    double next_double()
+    {
+        if (uniform_idx == batch_size)
+        {
+            refill_uniforms();
+        }
+        return uniforms[uniform_idx++];
+    }
+
+    void next_unit_vector(double& x, double& y, double& z)
+    {
+        if (sphere_surface_idx == batch_size)
+        {
+            refill_sphere_surface();
+        }
+        x = sphere_surface[0][sphere_surface_idx];
+        y = sphere_surface[1][sphere_surface_idx];
+        z = sphere_surface[2][sphere_surface_idx];
+        ++sphere_surface_idx;
+    }
+
+    void next_in_unit_sphere(double& x, double& y, double& z)
+    {
+        if (ball_idx == batch_size)
+        {
+            refill_ball();
+        }
+        x = ball[0][ball_idx];
+        y = ball[1][ball_idx];
+        z = ball[2][ball_idx];
+        ++ball_idx;
+    }
+
+    void next_in_unit_disk(double& x, double& y)
+    {
+        if (disk_idx == batch_size)
+        {
+            refill_disk();
+        }
+        x = disk[0][disk_idx];
+        y = disk[1][disk_idx];
+        ++disk_idx;
+    }
+
+    // Each thread gets its own streams, seeded in creation order so that single threaded runs are reproducible
+    static random_batch& thread_instance()
+    {
+        static std::atomic<uint64_t> num_instances{0};
+        thread_local random_batch batch(num_instances.fetch_add(1) * 0x9e3779b97f4a7c15ULL);
+        return batch;
+    }
+
+private:
+    void refill_uniforms()
+    {
+        for (int idx = 0; idx < batch_size; idx += 4)
+        {
+            generator.next_double().store_a(&uniforms[idx]);
+        }
+        uniform_idx = 0;
+    }
+
+    void refill_sphere_surface()
+    {
+        for (int idx = 0; idx < batch_size; idx += 4)
+        {
+            Vec4d x, y, z;
+            warp_unit_sphere_surface(generator.next_double(), generator.next_double(), x, y, z);
+            x.store_a(&sphere_surface[0][idx]);
+            y.store_a(&sphere_surface[1][idx]);
+            z.store_a(&sphere_surface[2][idx]);
+        }
+        sphere_surface_idx = 0;
+    }
+
+    void refill_ball()
+    {
+        for (int idx = 0; idx < batch_size; idx += 4)
+        {
+            Vec4d x, y, z;
+            warp_in_unit_sphere(generator.next_double(), generator.next_double(), generator.next_double(), x, y, z);
+            x.store_a(&ball[0][idx]);
+            y.store_a(&ball[1][idx]);
+            z.store_a(&ball[2][idx]);
+        }
+        ball_idx = 0;
+    }
+
+    void refill_disk()
+    {
+        for (int idx = 0; idx < batch_size; idx += 4)
+        {
+            Vec4d x, y;
+            warp_unit_disk(generator.next_double(), generator.next_double(), x, y);
+            x.store_a(&disk[0][idx]);
+            y.store_a(&disk[1][idx]);
+        }
+        disk_idx = 0;
+    }
+
+private:
+    xoshiro256plus_x4 generator;
+
+    // Structure of arrays so that each refill is made of aligned vector stores
+    alignas(32) double uniforms[batch_size];
+    alignas(32) double sphere_surface[3][batch_size];
+    alignas(32) double ball[3][batch_size];
+    alignas(32) double disk[2][batch_size];
+
+    int uniform_idx = batch_size;
+    int sphere_surface_idx = batch_size;
+    int ball_idx = batch_size;
+    int disk_idx = batch_size;
+};
@@ -3,6 +3,7 @@
 #include <memory>
 
 #include "hittable.h"
+#include "onb.h"
 #include "vec3.h"
 
 class sphere : public hittable
@@ -14,16 +15,22 @@ public:
     {
     };
 
-    virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+    virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const;
+    virtual void surface_interaction(const ray& r, const surface_hit& closest, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
+    // Samples the cone of directions subtended by the sphere
+    virtual double pdf_value(const point3& origin, const vec3& direction) const;
+    virtual vec3 random(const point3& origin, double u1, double u2) const;
+
 public:
     point3 center;
     double radius;
     std::shared_ptr<material> mat_ptr;
 };
 
-inline bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+inline bool sphere::intersect(const ray& r, double t_min, double t_max, surface_hit& closest) const
 {
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
@@ -35,35 +42,101 @@ inline bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     {
         auto root = std::sqrt(discriminant);
         auto temp = (-half_b - root) / a;
-
-        auto fill_sphere_hit_record = [&]()
-        {
-            rec.t = temp;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-        };
-
         if (temp < t_max && temp > t_min)
         {
-            fill_sphere_hit_record();
+            closest = surface_hit{temp, this};
             return true;
         }
         temp = (-half_b + root) / a;
         if (temp < t_max && temp > t_min)
         {
-            fill_sphere_hit_record();
+            closest = surface_hit{temp, this};
             return true;
         }
     }
     return false;
 }
 
-bool sphere::bounding_box(double /*t0*/, double /*t1*/, aabb& output_box) const
+inline void sphere::surface_interaction(const ray& r, const surface_hit& closest, hit_record& rec) const
+{
+    rec.t = closest.t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr;
+}
+
+inline bool sphere::occluded(const ray& r, double t_min, double t_max) const
+{
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+    auto discriminant = half_b * half_b - a * c;
+
+    if (discriminant <= 0)
+    {
+        return false;
+    }
+
+    auto root = std::sqrt(discriminant);
+    auto near_t = (-half_b - root) / a;
+    auto far_t = (-half_b + root) / a;
+    return (near_t < t_max && near_t > t_min) || (far_t < t_max && far_t > t_min);
+}
+
+inline bool sphere::bounding_box(double /*t0*/, double /*t1*/, aabb& output_box) const
 {
     output_box = aabb(
         center - vec3(radius, radius, radius),
         center + vec3(radius, radius, radius));
     return true;
 }
+
+// Direction inside the cone of half angle theta_max around +z, cos(theta_max) = sqrt(1 - radius^2 / distance^2)
+inline vec3 random_to_sphere(double radius, double distance_squared, double r1, double r2)
+{
+    auto z = 1 + r2 * (std::sqrt(1 - radius * radius / distance_squared) - 1);
+
+    auto phi = 2 * pi * r1;
+    auto sin_theta = std::sqrt(1 - z * z);
+    auto x = std::cos(phi) * sin_theta;
+    auto y = std::sin(phi) * sin_theta;
+
+    return vec3(x, y, z);
+}
+
+inline double sphere::pdf_value(const point3& origin, const vec3& direction) const
+{
+    auto distance_squared = (center - origin).length_squared();
+    // No cone to sample from inside the sphere
+    if (distance_squared <= radius * radius)
+    {
+        return 0.0;
+    }
+
+    surface_hit closest;
+    if (!intersect(ray(origin, direction), 0.001, infinity, closest))
+    {
+        return 0.0;
+    }
+
+    auto cos_theta_max = std::sqrt(1 - radius * radius / distance_squared);
+    auto solid_angle = 2 * pi * (1 - cos_theta_max);
+
+    return 1 / solid_angle;
+}
+
+inline vec3 sphere::random(const point3& origin, double u1, double u2) const
+{
+    vec3 direction = center - origin;
+    auto distance_squared = direction.length_squared();
+    if (distance_squared <= radius * radius)
+    {
+        return direction;
+    }
+
+    onb uvw;
+    uvw.build_from_w(direction);
+    return uvw.local(random_to_sphere(radius, distance_squared, u1, u2));
+}
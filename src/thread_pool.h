@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cpu_topology.h"
+
+// Persistent workers, created and pinned once then reused by every render, denoise... of the process
+class thread_pool
+{
+public:
+    // num_threads = 0 means one worker per allowed hardware thread, or per core when use_smt is false
+    thread_pool(const cpu_topology& topology, int num_threads = 0, bool use_smt = true, bool pin = true);
+    ~thread_pool();
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    int size() const { return static_cast<int>(workers.size()); }
+    int num_nodes() const { return nodes; }
+    int worker_node(int worker) const { return placement[static_cast<size_t>(worker)].numa_node; }
+    const logical_cpu& worker_cpu(int worker) const { return placement[static_cast<size_t>(worker)]; }
+
+    // Calls fn(item, worker) for every item in [0, count) and waits for all of them
+    // Items are split in contiguous ranges, one per NUMA node in proportion to its workers, and workers drain
+    // their own node's range before stealing from the others. Two loops over the same count therefore process
+    // the same item on the same node, which is what makes first touch placement pay off.
+    // Loops running at the same time from different threads share the workers, a free worker takes an item of
+    // the loop with the highest priority (0 when null), the oldest one among equals. The priority is read again
+    // for every item so that changing it takes effect right away, it must outlive the call.
+    void parallel_for(int count, std::function<void(int, int)> fn, const std::atomic<int>* priority = nullptr);
+
+private:
+    struct job
+    {
+        std::function<void(int, int)> fn;
+        const std::atomic<int>* priority = nullptr;
+        std::unique_ptr<std::atomic<int>[]> next;
+        std::vector<int> end;
+        std::atomic<int> remaining{0};
+
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        bool done = false;
+
+        // Next unclaimed item, own node first, -1 once everything is claimed
+        int claim(int node)
+        {
+            auto num_ranges = end.size();
+            for (size_t offset = 0; offset < num_ranges; ++offset)
+            {
+                auto range = (static_cast<size_t>(node) + offset) % num_ranges;
+                if (next[range].load(std::memory_order_relaxed) < end[range])
+                {
+                    auto item = next[range].fetch_add(1, std::memory_order_relaxed);
+                    if (item < end[range])
+                    {
+                        return item;
+                    }
+                }
+            }
+            return -1;
+        }
+
+        int current_priority() const
+        {
+            return priority ? priority->load(std::memory_order_relaxed) : 0;
+        }
+    };
+
+    void worker_loop(int worker);
+
+private:
+    std::vector<std::thread> workers;
+    std::vector<logical_cpu> placement;
+    std::vector<int> workers_per_node;
+    int nodes = 1;
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::deque<std::shared_ptr<job>> jobs;
+    bool stopping = false;
+};
+
+inline thread_pool::thread_pool(const cpu_topology& topology, int num_threads, bool use_smt, bool pin)
+{
+    auto order = topology.placement_order(use_smt);
+    if (order.empty())
+    {
+        order.push_back(logical_cpu{0, 0, 0, 0, 0, 0});
+    }
+    if (num_threads <= 0)
+    {
+        num_threads = static_cast<int>(order.size());
+    }
+
+    nodes = std::max(1, topology.num_numa_nodes());
+    workers_per_node.assign(static_cast<size_t>(nodes), 0);
+
+    // More workers than hardware threads wrap around the placement order
+    for (int worker = 0; worker < num_threads; ++worker)
+    {
+        auto cpu = order[static_cast<size_t>(worker) % order.size()];
+        cpu.numa_node = std::min(cpu.numa_node, nodes - 1);
+        placement.push_back(cpu);
+        ++workers_per_node[static_cast<size_t>(cpu.numa_node)];
+    }
+
+    workers.reserve(static_cast<size_t>(num_threads));
+    for (int worker = 0; worker < num_threads; ++worker)
+    {
+        workers.push_back(std::thread([this, worker, pin]()
+        {
+            if (pin)
+            {
+                cpu_topology::pin_current_thread(worker_cpu(worker));
+            }
+            worker_loop(worker);
+        }));
+    }
+}
+
+inline thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_cv.notify_all();
+
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+inline void thread_pool::parallel_for(int count, std::function<void(int, int)> fn, const std::atomic<int>* priority)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+
+    auto new_job = std::make_shared<job>();
+    new_job->fn = std::move(fn);
+    new_job->priority = priority;
+    auto num_ranges = static_cast<size_t>(nodes);
+    new_job->next = std::make_unique<std::atomic<int>[]>(num_ranges);
+    new_job->end.resize(num_ranges);
+    new_job->remaining = count;
+
+    // Nodes without workers get an empty range
+    auto total_workers = size();
+    int start = 0;
+    int workers_so_far = 0;
+    for (size_t node = 0; node < num_ranges; ++node)
+    {
+        workers_so_far += workers_per_node[node];
+        auto stop = static_cast<int>(static_cast<long long>(count) * workers_so_far / total_workers);
+        new_job->next[node] = start;
+        new_job->end[node] = stop;
+        start = stop;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(new_job);
+    }
+    work_cv.notify_all();
+
+    std::unique_lock<std::mutex> done_lock(new_job->done_mutex);
+    new_job->done_cv.wait(done_lock, [&]() { return new_job->done; });
+}
+
+inline void thread_pool::worker_loop(int worker)
+{
+    auto node = worker_node(worker);
+
+    while (true)
+    {
+        std::shared_ptr<job> current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_cv.wait(lock, [&]() { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+            {
+                return;
+            }
+            current = jobs.front();
+            for (const auto& candidate : jobs)
+            {
+                if (candidate->current_priority() > current->current_priority())
+                {
+                    current = candidate;
+                }
+            }
+        }
+
+        auto item = current->claim(node);
+        if (item < 0)
+        {
+            // Everything is claimed, the workers still running items will signal completion
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = std::find(jobs.begin(), jobs.end(), current);
+            if (it != jobs.end())
+            {
+                jobs.erase(it);
+            }
+            continue;
+        }
+
+        current->fn(item, worker);
+
+        if (current->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::lock_guard<std::mutex> lock(current->done_mutex);
+            current->done = true;
+            current->done_cv.notify_all();
+        }
+    }
+}
+
+// Array whose pages are first written by the pool workers that will later process them
+// The allocation itself does not touch memory, construct() value initializes the elements in num_chunks chunks
+// with pool.parallel_for, chunk c being handled on the node that also gets item c of any later loop over
+// num_chunks items (e.g. image rows)
+template<typename T>
+class first_touch_array
+{
+public:
+    first_touch_array() {}
+
+    explicit first_touch_array(size_t n)
+        : count(n), elements(n ? static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T)))) : nullptr)
+    {
+    }
+
+    ~first_touch_array()
+    {
+        release();
+    }
+
+    first_touch_array(const first_touch_array&) = delete;
+    first_touch_array& operator=(const first_touch_array&) = delete;
+
+    first_touch_array(first_touch_array&& other) noexcept
+        : count(other.count), elements(other.elements), constructed(other.constructed)
+    {
+        other.count = 0;
+        other.elements = nullptr;
+        other.constructed = false;
+    }
+
+    first_touch_array& operator=(first_touch_array&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            std::swap(count, other.count);
+            std::swap(elements, other.elements);
+            std::swap(constructed, other.constructed);
+        }
+        return *this;
+    }
+
+    void construct(thread_pool& pool, int num_chunks)
+    {
+        auto chunks = static_cast<size_t>(num_chunks);
+        pool.parallel_for(num_chunks, [&](int chunk, int /*worker*/)
+        {
+            auto start = count * static_cast<size_t>(chunk) / chunks;
+            auto stop = count * static_cast<size_t>(chunk + 1) / chunks;
+            for (auto idx = start; idx < stop; ++idx)
+            {
+                new (&elements[idx]) T();
+            }
+        });
+        constructed = true;
+    }
+
+    size_t size() const { return count; }
+    T* data() { return elements; }
+    const T* data() const { return elements; }
+    T& operator[](size_t idx) { return elements[idx]; }
+    const T& operator[](size_t idx) const { return elements[idx]; }
+
+private:
+    void release()
+    {
+        if (constructed)
+        {
+            for (size_t idx = 0; idx < count; ++idx)
+            {
+                elements[idx].~T();
+            }
+        }
+        if (elements)
+        {
+            ::operator delete(elements, std::align_val_t(alignof(T)));
+        }
+        elements = nullptr;
+        count = 0;
+        constructed = false;
+    }
+
+private:
+    size_t count = 0;
+    T* elements = nullptr;
+    bool constructed = false;
+};
@@ -5,6 +5,90 @@
 
 #include "rtweekend.h"
 
+#if defined(RT_SIMD_VEC3)
+// No warnings from external headers
+#pragma warning(push, 0)
+#include <vectorclass.h>
+#pragma warning(pop)
+#endif
+
+// Two backends with the same interface, picked at build time :
+// - three doubles, the default
+// - RT_SIMD_VEC3 (CMake option of the same name), the components padded to a Vec4d of the vectorclass library so
+//   that the arithmetic, dot and cross products run as whole register operations. The fourth lane is never read
+//   back into the others, whatever ends up in it does not matter. Results match the scalar backend up to the
+//   rounding of the sums, the vec3_backend tests check both agree (microbench --check).
+//   The components stay in the register, x(), y() and z() extract a lane. Whole renders with AVX2 still come out a
+//   few percent slower than the default : the dot products end in horizontal adds and the scalar code around the
+//   vectors extracts lanes one at a time. It stays off by default, the microbench times both.
+#if defined(RT_SIMD_VEC3)
+
+class vec3
+{
+public:
+    vec3() : e(0.0) {}
+    vec3(double e0, double e1, double e2) : e(e0, e1, e2, 0.0) {}
+    explicit vec3(const Vec4d& v) : e(v) {}
+
+    const Vec4d& simd() const { return e; }
+
+    double x() const { return e.extract(0); }
+    double y() const { return e.extract(1); }
+    double z() const { return e.extract(2); }
+
+    vec3 operator-() const { return vec3(-e); }
+    double operator[](int i) const { return e.extract(i); }
+
+    vec3& operator+=(const vec3& v)
+    {
+        e += v.e;
+        return *this;
+    }
+
+    vec3& operator*=(const double t)
+    {
+        e *= t;
+        return *this;
+    }
+
+    vec3& operator/=(const double t)
+    {
+        return *this *= 1 / t;
+    }
+
+    double length() const
+    {
+        return std::sqrt(length_squared());
+    }
+
+    double length_squared() const
+    {
+        return sum3(simd() * simd());
+    }
+
+    // Sum of the first three lanes, the fourth is zeroed on the way
+    static double sum3(const Vec4d& v)
+    {
+        return horizontal_add(permute4<0, 1, 2, -1>(v));
+    }
+
+    inline static vec3 random()
+    {
+        return vec3(random_double(), random_double(), random_double());
+    }
+
+    inline static vec3 random(double min, double max)
+    {
+        return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+    }
+
+public:
+    // The components stay in the register, e[i] reads a lane like the array of the other backend, lane 3 pads it
+    Vec4d e;
+};
+
+#else
+
 class vec3
 {
 public:
@@ -64,6 +148,8 @@ public:
     double e[3];
 };
 
+#endif
+
 // Type aliases for vec3
 using point3 = vec3;   // 3D point
 using color = vec3;    // RGB color
@@ -75,6 +161,52 @@ inline std::ostream& operator<<(std::ostream& out, const vec3& v)
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
+#if defined(RT_SIMD_VEC3)
+
+inline vec3 operator+(const vec3& u, const vec3& v)
+{
+    return vec3(u.simd() + v.simd());
+}
+
+inline vec3 operator-(const vec3& u, const vec3& v)
+{
+    return vec3(u.simd() - v.simd());
+}
+
+inline vec3 operator*(const vec3& u, const vec3& v)
+{
+    return vec3(u.simd() * v.simd());
+}
+
+inline vec3 operator*(double t, const vec3& v)
+{
+    return vec3(Vec4d(t) * v.simd());
+}
+
+inline vec3 operator*(const vec3& v, double t)
+{
+    return t * v;
+}
+
+inline vec3 operator/(vec3 v, double t)
+{
+    return (1 / t) * v;
+}
+
+inline double dot(const vec3& u, const vec3& v)
+{
+    return vec3::sum3(u.simd() * v.simd());
+}
+
+inline vec3 cross(const vec3& u, const vec3& v)
+{
+    auto a = u.simd();
+    auto b = v.simd();
+    return vec3(permute4<1, 2, 0, 3>(a) * permute4<2, 0, 1, 3>(b) - permute4<2, 0, 1, 3>(a) * permute4<1, 2, 0, 3>(b));
+}
+
+#else
+
 inline vec3 operator+(const vec3& u, const vec3& v)
 {
     return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
@@ -119,45 +251,34 @@ inline vec3 cross(const vec3& u, const vec3& v)
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
+#endif
+
 inline vec3 unit_vector(vec3 v)
 {
     return v / v.length();
 }
 
 // See section 8.5 about reflected rays distribution
+// The random_* helpers read samples warped four at a time by the thread's random_batch, no rejection loop
 inline vec3 random_in_unit_sphere()
 {
-    while (true)
-    {
-        auto p = vec3::random(-1, 1);
-        if (p.length_squared() >= 1)
-        {
-            continue;
-        }
-        return p;
-    }
+    double x, y, z;
+    random_batch::thread_instance().next_in_unit_sphere(x, y, z);
+    return vec3(x, y, z);
 }
 
 inline vec3 random_unit_vector()
 {
-    // radius rho = 1
-    auto a = random_double(0, 2 * pi);
-    auto z = random_double(-1, 1); // z = rho * cos(theta) = cos(theta) here
-    auto r = sqrt(1 - z * z); // r = sin(theta) here so that sin(theta) > 0
-    return vec3(r * cos(a), r * sin(a), z); // those are spheric coordinates for rho = 1
+    double x, y, z;
+    random_batch::thread_instance().next_unit_vector(x, y, z);
+    return vec3(x, y, z);
 }
 
 inline vec3 random_in_hemisphere(const vec3& normal)
 {
-    vec3 in_unit_sphere = random_in_unit_sphere();
-    if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
-    {
-        return in_unit_sphere;
-    }
-    else
-    {
-        return -in_unit_sphere;
-    }
+    vec3 on_unit_sphere = random_unit_vector();
+    // Flip into the same hemisphere as the normal
+    return dot(on_unit_sphere, normal) > 0.0 ? on_unit_sphere : -on_unit_sphere;
 }
 
 inline vec3 reflect(const vec3& v, const vec3& n)
@@ -175,21 +296,60 @@ inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
 
 inline vec3 random_in_unit_disk()
 {
-    while (true)
-    {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() >= 1)
-        {
-            continue;
-        }
-        return p;
+    double x, y;
+    random_batch::thread_instance().next_in_unit_disk(x, y);
+    return vec3(x, y, 0);
+}
 
+// Warps of uniform samples, the sampler decides where (u1, u2, u3) come from
 
-        // The distribution of the following code is most likely skewed, keeping it here for now
-        // might investigate
-        //auto radius = random_double();
-        //auto theta = random_double(0, 2 * pi);
+// Same mapping as random_unit_vector
+inline vec3 sample_unit_sphere_surface(double u1, double u2)
+{
+    auto a = 2 * pi * u1;
+    auto z = 1 - 2 * u2;
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    return vec3(r * std::cos(a), r * std::sin(a), z);
+}
 
-        //return vec3(radius * std::cos(theta), radius * std::sin(theta), 0.0);
-    }
+// Uniform in the ball, a direction and a radius distributed as the cube root
+inline vec3 sample_in_unit_sphere(double u1, double u2, double u3)
+{
+    return std::cbrt(u3) * sample_unit_sphere_surface(u1, u2);
+}
+
+// Concentric mapping of the unit square onto the disk, see Shirley and Chiu 1997
+// Unlike the rejection method it keeps the stratification of the input samples
+// Written with selects only, same as warp_unit_disk in simd_random.h
+inline vec3 sample_in_unit_disk(double u1, double u2)
+{
+    auto a = 2 * u1 - 1;
+    auto b = 2 * u2 - 1;
+    auto a_major = std::fabs(a) > std::fabs(b);
+
+    // The divisors can only be 0 when both a and b are, r is 0 then and theta does not matter
+    auto safe_a = a == 0 ? 1.0 : a;
+    auto safe_b = b == 0 ? 1.0 : b;
+
+    auto r = a_major ? a : b;
+    auto theta = a_major ? (pi / 4) * (b / safe_a) : (pi / 2) - (pi / 4) * (a / safe_b);
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+// Hemispheres are around +z, use an onb to orient them
+
+inline vec3 sample_uniform_hemisphere(double u1, double u2)
+{
+    auto a = 2 * pi * u1;
+    auto z = u2;
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    return vec3(r * std::cos(a), r * std::sin(a), z);
+}
+
+// Malley's method, the disk sample is lifted onto the hemisphere
+inline vec3 sample_cosine_hemisphere(double u1, double u2)
+{
+    auto d = sample_in_unit_disk(u1, u2);
+    auto z = std::sqrt(std::fmax(0.0, 1 - d.x() * d.x() - d.y() * d.y()));
+    return vec3(d.x(), d.y(), z);
 }
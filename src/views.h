@@ -0,0 +1,363 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "camera.h"
+#include "scene.h"
+#include "vec3.h"
+
+// Pixels of a view to render, as spans of columns [begin, end) for every row, rows counted from the top of the image
+// An empty region stands for the whole view
+struct pixel_region
+{
+    std::vector<std::vector<std::pair<int, int>>> rows;
+
+    bool whole() const { return rows.empty(); }
+
+    // Adds the pixels of [x0, x1) x [y0, y1), clamped to the image
+    void add_rect(int width, int height, int x0, int y0, int x1, int y1);
+    // Only keeps the pixels inside [x0, x1) x [y0, y1)
+    void clip(int width, int height, int x0, int y0, int x1, int y1);
+
+    size_t num_pixels(int width, int height) const;
+};
+
+struct rendered_view;
+class first_hit_cache;
+
+// One viewpoint of a batch render, every view of a batch shares the scene, its BVH and the thread pool
+struct view_spec
+{
+    // Appended to the output file names when there is more than one view
+    std::string name;
+    point3 lookfrom;
+    point3 lookat;
+    vec3 vup;
+    double vfov;
+    double aperture;
+    double dist_to_focus;
+
+    // Only these pixels get rendered, the others are copied from base when there is one and left black otherwise
+    // The base is blended in before denoising, it should come from a render that was not denoised
+    pixel_region region;
+    std::shared_ptr<const rendered_view> base;
+    // Camera ray hits of every sample, recorded by the render when the cache is empty and replayed otherwise
+    std::shared_ptr<first_hit_cache> first_hits;
+
+    camera make_camera(const scene& scn, double aspect_ratio) const
+    {
+        return camera(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, scn.time0, scn.time1);
+    }
+};
+
+inline void pixel_region::add_rect(int width, int height, int x0, int y0, int x1, int y1)
+{
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, width);
+    y1 = std::min(y1, height);
+    if (x0 >= x1 || y0 >= y1)
+    {
+        return;
+    }
+
+    rows.resize(static_cast<size_t>(height));
+    for (int y = y0; y < y1; ++y)
+    {
+        // Merged with the spans it touches, the spans stay sorted and apart
+        auto& spans = rows[static_cast<size_t>(y)];
+        auto span = std::make_pair(x0, x1);
+        std::vector<std::pair<int, int>> merged;
+        for (const auto& other : spans)
+        {
+            if (other.second < span.first || other.first > span.second)
+            {
+                merged.push_back(other);
+            }
+            else
+            {
+                span.first = std::min(span.first, other.first);
+                span.second = std::max(span.second, other.second);
+            }
+        }
+        merged.push_back(span);
+        std::sort(merged.begin(), merged.end());
+        spans = std::move(merged);
+    }
+}
+
+inline void pixel_region::clip(int width, int height, int x0, int y0, int x1, int y1)
+{
+    if (whole())
+    {
+        add_rect(width, height, x0, y0, x1, y1);
+        // Still a region when the rectangle is off the image, one without any pixel
+        rows.resize(static_cast<size_t>(height));
+        return;
+    }
+
+    for (int y = 0; y < static_cast<int>(rows.size()); ++y)
+    {
+        auto& spans = rows[static_cast<size_t>(y)];
+        if (y < y0 || y >= y1)
+        {
+            spans.clear();
+            continue;
+        }
+
+        std::vector<std::pair<int, int>> clipped;
+        for (const auto& span : spans)
+        {
+            auto begin = std::max(span.first, x0);
+            auto end = std::min(span.second, x1);
+            if (begin < end)
+            {
+                clipped.emplace_back(begin, end);
+            }
+        }
+        spans = std::move(clipped);
+    }
+}
+
+inline size_t pixel_region::num_pixels(int width, int height) const
+{
+    if (whole())
+    {
+        return static_cast<size_t>(width) * static_cast<size_t>(height);
+    }
+
+    size_t count = 0;
+    for (const auto& spans : rows)
+    {
+        for (const auto& span : spans)
+        {
+            count += static_cast<size_t>(span.second - span.first);
+        }
+    }
+    return count;
+}
+
+// Tiles of the view where any of the boxes can show up, every tile is tile_size pixels square
+// The corners of the boxes are projected through the view's camera, widened by the defocus blur at their depth and by
+// the pixel jitter. Only the boxes themselves are covered, not their shadows nor their reflections in other objects.
+// A box reaching behind the camera, or without bounds, marks the whole view.
+inline pixel_region project_boxes(
+    const view_spec& view, double aspect_ratio, int width, int height, const std::vector<aabb>& boxes, int tile_size = 16)
+{
+    auto w = unit_vector(view.lookfrom - view.lookat);
+    auto u = unit_vector(cross(view.vup, w));
+    auto v = cross(w, u);
+    auto half_height = std::tan(degrees_to_radians(view.vfov) / 2);
+    auto half_width = aspect_ratio * half_height;
+    auto lens_radius = view.aperture / 2;
+
+    pixel_region region;
+    region.rows.resize(static_cast<size_t>(height));
+    for (const auto& box : boxes)
+    {
+        // Objects without bounds can show up anywhere
+        if (!std::isfinite(box.min().x() + box.min().y() + box.min().z() + box.max().x() + box.max().y() + box.max().z()))
+        {
+            return pixel_region();
+        }
+
+        auto min_x = infinity;
+        auto max_x = -infinity;
+        auto min_y = infinity;
+        auto max_y = -infinity;
+        bool behind = false;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            auto p = point3(
+                (corner & 1) ? box.max().x() : box.min().x(),
+                (corner & 2) ? box.max().y() : box.min().y(),
+                (corner & 4) ? box.max().z() : box.min().z());
+            auto d = p - view.lookfrom;
+            auto depth = -dot(d, w);
+            if (depth <= 1e-9)
+            {
+                behind = true;
+                break;
+            }
+
+            // Screen coordinates in [0, 1] over the image, the same ones camera::get_ray takes
+            auto s = 0.5 + dot(d, u) / depth / (2 * half_width);
+            auto t = 0.5 + dot(d, v) / depth / (2 * half_height);
+            // Rays from the edge of the lens cross the focus plane this far from the pinhole projection
+            auto blur = lens_radius * std::fabs(1.0 - view.dist_to_focus / depth) / view.dist_to_focus;
+            auto blur_s = blur / (2 * half_width);
+            auto blur_t = blur / (2 * half_height);
+
+            min_x = std::min(min_x, (s - blur_s) * (width - 1));
+            max_x = std::max(max_x, (s + blur_s) * (width - 1));
+            // Rows go down the image, t up
+            min_y = std::min(min_y, (1.0 - t - blur_t) * (height - 1));
+            max_y = std::max(max_y, (1.0 - t + blur_t) * (height - 1));
+        }
+
+        if (behind)
+        {
+            return pixel_region();
+        }
+
+        // A pixel takes samples up to one pixel away from its corner
+        auto clamp_pixel = [](double value, int size) { return static_cast<int>(clamp(value, -1.0, static_cast<double>(size))); };
+        auto x0 = clamp_pixel(std::floor(min_x) - 1, width);
+        auto x1 = clamp_pixel(std::ceil(max_x) + 1, width);
+        auto y0 = clamp_pixel(std::floor(min_y) - 1, height);
+        auto y1 = clamp_pixel(std::ceil(max_y) + 1, height);
+        region.add_rect(width, height,
+            x0 / tile_size * tile_size, y0 / tile_size * tile_size,
+            (x1 / tile_size + 1) * tile_size, (y1 / tile_size + 1) * tile_size);
+    }
+    return region;
+}
+
+// The part of a batch wide buffer that belongs to one view, views are stored one after the other
+template<typename T>
+struct array_slice
+{
+    T* elements;
+    size_t count;
+
+    size_t size() const { return count; }
+    T* data() const { return elements; }
+    T& operator[](size_t idx) const { return elements[idx]; }
+};
+
+template<typename Array>
+auto view_slice(Array& buffer, int view, size_t pixels_per_view)
+{
+    return array_slice<std::remove_reference_t<decltype(buffer[0])>>{buffer.data() + static_cast<size_t>(view) * pixels_per_view, pixels_per_view};
+}
+
+// The camera the scene comes with
+inline view_spec default_view(const scene& scn)
+{
+    return view_spec{"", scn.lookfrom, scn.lookat, scn.vup, scn.vfov, scn.aperture, scn.dist_to_focus, pixel_region(), nullptr, nullptr};
+}
+
+inline std::string numbered_view_name(size_t idx)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "view%03zu", idx);
+    return name;
+}
+
+// count views around the scene's camera target, turning the default camera about vup
+inline std::vector<view_spec> turntable_views(const scene& scn, int count)
+{
+    std::vector<view_spec> views;
+    auto axis = unit_vector(scn.vup);
+    auto offset = scn.lookfrom - scn.lookat;
+
+    for (int idx = 0; idx < count; ++idx)
+    {
+        // Rodrigues rotation of the camera offset
+        auto angle = 2.0 * pi * idx / count;
+        auto cos_a = std::cos(angle);
+        auto sin_a = std::sin(angle);
+        auto rotated = offset * cos_a + cross(axis, offset) * sin_a + axis * (dot(axis, offset) * (1.0 - cos_a));
+
+        auto view = default_view(scn);
+        view.name = numbered_view_name(static_cast<size_t>(idx));
+        view.lookfrom = scn.lookat + rotated;
+        views.push_back(view);
+    }
+    return views;
+}
+
+// One view per line : [name] from_x from_y from_z at_x at_y at_z [vfov [aperture [focus_distance]]]
+// Values left out come from the scene's camera, empty lines and lines starting with # are skipped
+inline std::vector<view_spec> load_views(const std::string& filename, const scene& scn)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        throw std::runtime_error("Unable to open view file " + filename);
+    }
+
+    std::vector<view_spec> views;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line))
+    {
+        ++line_number;
+        auto first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+        {
+            continue;
+        }
+
+        auto view = default_view(scn);
+        view.name = numbered_view_name(views.size());
+
+        std::istringstream stream(line);
+        std::vector<std::string> tokens;
+        for (std::string token; stream >> token; )
+        {
+            tokens.push_back(token);
+        }
+
+        // A leading token that is not a number names the view
+        size_t next = 0;
+        char* end = nullptr;
+        std::strtod(tokens[0].c_str(), &end);
+        if (*end != '\0')
+        {
+            view.name = tokens[0];
+            next = 1;
+        }
+
+        std::vector<double> values;
+        for (; next < tokens.size(); ++next)
+        {
+            auto value = std::strtod(tokens[next].c_str(), &end);
+            if (*end != '\0')
+            {
+                throw std::runtime_error(filename + ":" + std::to_string(line_number) + " : not a number : " + tokens[next]);
+            }
+            values.push_back(value);
+        }
+        if (values.size() < 6 || values.size() > 9)
+        {
+            throw std::runtime_error(filename + ":" + std::to_string(line_number) + " : expected 6 to 9 values");
+        }
+
+        view.lookfrom = point3(values[0], values[1], values[2]);
+        view.lookat = point3(values[3], values[4], values[5]);
+        if (values.size() > 6)
+        {
+            view.vfov = values[6];
+        }
+        if (values.size() > 7)
+        {
+            view.aperture = values[7];
+        }
+        if (values.size() > 8)
+        {
+            view.dist_to_focus = values[8];
+        }
+        views.push_back(view);
+    }
+
+    if (views.empty())
+    {
+        throw std::runtime_error("No view in " + filename);
+    }
+    return views;
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "denoiser.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "vec3.h"
+
+// Spreads the 10 low bits of v so that there are two 0 bits between each of them
+inline uint32_t expand_bits_10(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Rays going the same way from nearby origins visit the same BVH nodes, the key groups them by direction
+// octant first, then along a 30 bit Morton curve of the origin inside bounds
+inline uint64_t ray_sort_key(const ray& r, const aabb& bounds)
+{
+    auto dir = r.direction();
+    uint64_t octant = (dir.x() < 0 ? 1 : 0) | (dir.y() < 0 ? 2 : 0) | (dir.z() < 0 ? 4 : 0);
+
+    uint32_t morton = 0;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        auto extent = bounds.max()[axis] - bounds.min()[axis];
+        auto relative = extent > 0.0 ? (r.origin()[axis] - bounds.min()[axis]) / extent : 0.0;
+        auto cell = static_cast<uint32_t>(clamp(relative, 0.0, 1.0) * 1023.0);
+        morton |= expand_bits_10(cell) << axis;
+    }
+
+    return (octant << 30) | morton;
+}
+
+// The pixel sample a path belongs to, the sampler is moved back to it before each bounce is shaded
+struct path_sample
+{
+    int x;
+    int y;
+    int index;
+};
+
+// Warps the bsdf samples of a bounce four at a time with the branch free warps of simd_random.h
+// The ball point shares the direction of the sphere surface point, only its radius comes from u.z
+inline void warp_bsdf_samples(std::vector<bounce_sample>& samples)
+{
+    for (size_t first = 0; first < samples.size(); first += 4)
+    {
+        auto count = std::min<size_t>(4, samples.size() - first);
+        // The lanes past the end warp zeros
+        alignas(32) double u[3][4] = {};
+        for (size_t lane = 0; lane < count; ++lane)
+        {
+            const auto& bsdf_u = samples[first + lane].bsdf.u;
+            u[0][lane] = bsdf_u.x();
+            u[1][lane] = bsdf_u.y();
+            u[2][lane] = bsdf_u.z();
+        }
+
+        Vec4d x, y, z;
+        warp_unit_sphere_surface(Vec4d().load_a(u[0]), Vec4d().load_a(u[1]), x, y, z);
+        Vec4d radius = cbrt(Vec4d().load_a(u[2]));
+
+        alignas(32) double surface[3][4];
+        alignas(32) double ball[3][4];
+        x.store_a(surface[0]);
+        y.store_a(surface[1]);
+        z.store_a(surface[2]);
+        (x * radius).store_a(ball[0]);
+        (y * radius).store_a(ball[1]);
+        (z * radius).store_a(ball[2]);
+
+        for (size_t lane = 0; lane < count; ++lane)
+        {
+            auto& bsdf = samples[first + lane].bsdf;
+            bsdf.on_sphere = vec3(surface[0][lane], surface[1][lane], surface[2][lane]);
+            bsdf.in_sphere = vec3(ball[0][lane], ball[1][lane], ball[2][lane]);
+            bsdf.warped = true;
+        }
+    }
+}
+
+// Batched path tracer, all the paths of a batch do their bounce k together
+// Before each bounce the rays are sorted by ray_sort_key and traced in that order, which keeps the BVH nodes
+// and primitives in cache between consecutive rays, the hits are then shaded in path order. Shadow rays get the
+// same treatment with occlusion queries. The sample values of every hit are drawn before the shading so that the
+// bounce is warped four paths at a time. Each render thread owns a batch and reuses its buffers.
+class wavefront_batch
+{
+public:
+    void clear()
+    {
+        paths.clear();
+        samples.clear();
+        aovs.clear();
+    }
+
+    void add_path(const ray& camera_ray, int x, int y, int sample_index)
+    {
+        paths.emplace_back(camera_ray);
+        samples.push_back(path_sample{x, y, sample_index});
+    }
+
+    size_t size() const { return paths.size(); }
+
+    // Runs every path to completion, aovs[path] holds the first hit attributes when need_aovs is set
+    void trace(const hittable& world, const aabb& bounds, const scene& scn, int depth, sampler& smp, bool need_aovs);
+
+private:
+    // Sorts the listed paths by the key of ray_of(path), then calls query(path) in that order
+    template<typename RayOf, typename Query>
+    void for_each_sorted(const std::vector<uint32_t>& ids, const aabb& bounds, RayOf ray_of, Query query);
+
+public:
+    std::vector<path_state> paths;
+    std::vector<first_hit_aov> aovs;
+    // Rays traced against the world since the batch was created
+    long long rays = 0;
+
+private:
+    std::vector<path_sample> samples;
+    std::vector<bounce_sample> bounce_samples;
+    std::vector<uint32_t> active;
+    std::vector<uint32_t> shadowed;
+    std::vector<uint64_t> keys;
+    std::vector<surface_hit> hits;
+    std::vector<char> hit_flags;
+};
+
+template<typename RayOf, typename Query>
+void wavefront_batch::for_each_sorted(const std::vector<uint32_t>& ids, const aabb& bounds, RayOf ray_of, Query query)
+{
+    // Key in the high bits, path index in the low 31 bits, sorting the integers sorts the paths
+    keys.clear();
+    for (auto path : ids)
+    {
+        keys.push_back((ray_sort_key(ray_of(path), bounds) << 31) | path);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    for (auto key : keys)
+    {
+        query(static_cast<uint32_t>(key & 0x7fffffff));
+    }
+}
+
+inline void wavefront_batch::trace(const hittable& world, const aabb& bounds, const scene& scn, int depth, sampler& smp, bool need_aovs)
+{
+    auto num_paths = paths.size();
+    hits.resize(num_paths);
+    hit_flags.resize(num_paths);
+    if (need_aovs)
+    {
+        aovs.assign(num_paths, first_hit_aov{color(0, 0, 0), vec3(0, 0, 0)});
+    }
+
+    active.clear();
+    for (size_t path = 0; path < num_paths; ++path)
+    {
+        active.push_back(static_cast<uint32_t>(path));
+    }
+
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    for (int bounce = 0; bounce < depth && !active.empty(); ++bounce)
+    {
+        for_each_sorted(active, bounds, [&](uint32_t path) { return paths[path].r; }, [&](uint32_t path)
+        {
+            hit_flags[path] = world.intersect(paths[path].r, 0.001, infinity, hits[path]);
+        });
+        rays += static_cast<long long>(active.size());
+
+        // The sampler is moved to each path's pixel sample, the values are drawn in the order the shading used to
+        // draw them so that the independent sampler's stream stays the same
+        bounce_samples.clear();
+        for (auto path : active)
+        {
+            if (hit_flags[path])
+            {
+                const auto& sample = samples[path];
+                smp.start_pixel_sample(sample.x, sample.y, sample.index);
+                bounce_samples.push_back(draw_bounce_sample(smp, bounce));
+            }
+        }
+        warp_bsdf_samples(bounce_samples);
+
+        // Shading in path order
+        shadowed.clear();
+        size_t next_sample = 0;
+        for (auto path : active)
+        {
+            auto& state = paths[path];
+            auto* aov = need_aovs ? &aovs[path] : nullptr;
+            if (!hit_flags[path])
+            {
+                shade_miss(state, scn, bounce, aov);
+                continue;
+            }
+
+            // Only the closest hit of each path gets its surface attributes
+            hit_record rec;
+            hits[path].primitive->surface_interaction(state.r, hits[path], rec);
+
+            shade_hit(state, rec, scn, bounce, bounce_samples[next_sample++], aov);
+            if (state.has_shadow_ray)
+            {
+                shadowed.push_back(path);
+            }
+        }
+
+        for_each_sorted(shadowed, bounds, [&](uint32_t path) { return paths[path].shadow_ray; }, [&](uint32_t path)
+        {
+            auto& state = paths[path];
+            resolve_shadow_ray(state, world.occluded(state.shadow_ray, 0.001, state.shadow_t_max));
+        });
+        rays += static_cast<long long>(shadowed.size());
+
+        active.erase(std::remove_if(active.begin(), active.end(), [&](uint32_t path) { return !paths[path].alive; }), active.end());
+    }
+}